@@ -0,0 +1,830 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+
+#include "particle.h"
+#include "dataset.h"
+#include "trajectory.h"
+#include "options.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// most problem sizes of a sweep
+#define MAX_VALUES 64
+
+/*
+ * An engine to check: the name it is selected by, its executable as built
+ * by the makefile, whether it runs on the GPU (and takes local work group
+ * sizes), whether it takes a number of test particles, whether it is
+ * started by the MPI launcher and whether it writes trajectories. Engines
+ * without trajectories only report the position of the first test
+ * particle. position and energy are the largest errors accepted, see
+ * checkEngine().
+ */
+typedef struct {
+    const char* name;
+    const char* executable;
+    int gpu;
+    int multiple;
+    int mpi;
+    int trajectory;
+    double position;
+    double energy;
+} engine_info_t;
+
+static engine_info_t engines[] = {
+    {"cpu_single", "cpu_single_64.exe", 0, 0, 0, 0, 1e-5, 0.0},
+    {"cpu_single_32", "cpu_single_32.exe", 0, 0, 0, 0, 1e-5, 0.0},
+    {"cpu_multiple", "cpu_multiple_64.exe", 0, 1, 0, 1, 1e-5, 1e-5},
+    {"cpu_multiple_32", "cpu_multiple_32.exe", 0, 1, 0, 1, 1e-5, 1e-5},
+    {"gpu_single", "gpu_single.exe", 1, 0, 0, 0, 1e-4, 0.0},
+    {"gpu_multiple", "gpu_multiple.exe", 1, 1, 0, 1, 1e-4, 1e-4},
+    {"hybrid", "hybrid.exe", 1, 1, 0, 0, 1e-4, 0.0},
+    {"mpi_multiple", "mpi_multiple.exe", 0, 1, 1, 1, 1e-5, 1e-5},
+};
+#define NUM_ENGINES (int)(sizeof(engines)/sizeof(engines[0]))
+
+/*
+ * The state of a sampled test particle after the iterations, as computed
+ * by the reference.
+ */
+typedef struct {
+    int index;
+    long double x[3];
+    long double v[3];
+} sample_t;
+
+/*
+ * The errors of one engine on one problem size, over the sampled test
+ * particles. The energy errors are negative if the engine does not report
+ * velocities.
+ */
+typedef struct {
+    const engine_info_t* engine;
+    int numTParticles;
+    int numPParticles;
+    int samples;
+    double position[3];     // median, 90th percentile and largest
+    double energy[3];
+    int pass;
+} result_t;
+
+// names of the integrators the reference implements, indexed by the
+// INTEGRATOR_ constants
+static const char* integratorNames[] = {"euler", "leapfrog", "rk4"};
+
+static uint64_t rngState;
+
+/*
+ * Returns a uniformly distributed number in [0, 1) from a SplitMix64
+ * generator, so the particles only depend on the seed and not on the
+ * rand() of the C library.
+ */
+static double uniform(void)
+{
+    uint64_t z = (rngState += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Stores a point distributed uniformly in the unit ball in p.
+ */
+static void pointInBall(float* p)
+{
+    double x, y, z;
+    do {
+        x = 2.0*uniform() - 1.0;
+        y = 2.0*uniform() - 1.0;
+        z = 2.0*uniform() - 1.0;
+    } while (x*x + y*y + z*z > 1.0);
+    p[0] = (float)x;
+    p[1] = (float)y;
+    p[2] = (float)z;
+}
+
+/*
+ * Creates numPParticles pseudo-particles of total mass about 1 and
+ * numTParticles test particles with speeds below 0.5, all in the unit
+ * ball, from the given seed.
+ */
+static dataset_t* generateDataset(int numPParticles, int numTParticles,
+                                  uint64_t seed)
+{
+    dataset_t* d = createDataset(numPParticles, numTParticles);
+    rngState = seed;
+    for (int i = 0; i < numPParticles; i++) {
+        float p[3];
+        pointInBall(p);
+        d->x[i] = p[0];
+        d->y[i] = p[1];
+        d->z[i] = p[2];
+        d->m[i] = (float)((0.5 + uniform()) / numPParticles);
+    }
+    for (int i = 0; i < numTParticles; i++) {
+        float p[3];
+        pointInBall(p);
+        d->tx[i] = p[0];
+        d->ty[i] = p[1];
+        d->tz[i] = p[2];
+        d->tm[i] = 1.0f;
+        pointInBall(p);
+        d->tvx[i] = 0.5f*p[0];
+        d->tvy[i] = 0.5f*p[1];
+        d->tvz[i] = 0.5f*p[2];
+    }
+    return d;
+}
+
+/*
+ * Adds value to the compensated sum (sum, c).
+ */
+static void kahanAdd(long double* sum, long double* c, long double value)
+{
+    long double y = value - *c;
+    long double t = *sum + y;
+    *c = (t - *sum) - y;
+    *sum = t;
+}
+
+/*
+ * Stores the acceleration caused by the first n pseudo-particles of d at p
+ * in a. The sums are compensated long double sums, so they stay far more
+ * accurate than the single precision engines even where long double is
+ * the same as double.
+ */
+static void referenceAcceleration(const dataset_t* d, int n,
+                                  const long double* p, long double* a)
+{
+    long double sum[3] = {0.0L, 0.0L, 0.0L};
+    long double c[3] = {0.0L, 0.0L, 0.0L};
+    for (int i = 0; i < n; i++) {
+        long double dx = d->x[i] - p[0];
+        long double dy = d->y[i] - p[1];
+        long double dz = d->z[i] - p[2];
+        long double invr = 1.0L / sqrtl(dx*dx + dy*dy + dz*dz + EPSILON);
+        long double f = d->m[i] * invr*invr*invr;
+        kahanAdd(&sum[0], &c[0], f*dx);
+        kahanAdd(&sum[1], &c[1], f*dy);
+        kahanAdd(&sum[2], &c[2], f*dz);
+    }
+    for (int k = 0; k < 3; k++) {
+        a[k] = sum[k];
+    }
+}
+
+/*
+ * Returns the potential of the first n pseudo-particles of d at p.
+ */
+static long double referencePotential(const dataset_t* d, int n,
+                                      const long double* p)
+{
+    long double sum = 0.0L;
+    long double c = 0.0L;
+    for (int i = 0; i < n; i++) {
+        long double dx = d->x[i] - p[0];
+        long double dy = d->y[i] - p[1];
+        long double dz = d->z[i] - p[2];
+        kahanAdd(&sum, &c, -d->m[i] / sqrtl(dx*dx + dy*dy + dz*dz + EPSILON));
+    }
+    return sum;
+}
+
+/*
+ * Advances the position x and velocity v of a test particle by the given
+ * number of steps of size t in the field of the first n pseudo-particles
+ * of d, with the same formulas as updateParticles() for each integrator
+ * but in long double.
+ */
+static void referenceSteps(const dataset_t* d, int n, int integrator,
+                           long double t, int iterations, long double* x,
+                           long double* v)
+{
+    long double a[3];
+    for (int step = 0; step < iterations; step++) {
+        if (integrator == INTEGRATOR_LEAPFROG) {
+            for (int k = 0; k < 3; k++) {
+                x[k] += v[k] * 0.5L*t;
+            }
+            referenceAcceleration(d, n, x, a);
+            for (int k = 0; k < 3; k++) {
+                v[k] += a[k] * t;
+                x[k] += v[k] * 0.5L*t;
+            }
+        } else if (integrator == INTEGRATOR_RK4) {
+            static const long double weight[4] = {1.0L, 2.0L, 2.0L, 1.0L};
+            static const long double offset[4] = {0.5L, 0.5L, 1.0L, 0.0L};
+            long double p[3], k1[3], sumX[3], sumV[3];
+            for (int k = 0; k < 3; k++) {
+                p[k] = x[k];
+                k1[k] = v[k];
+                sumX[k] = 0.0L;
+                sumV[k] = 0.0L;
+            }
+            for (int s = 0; s < 4; s++) {
+                referenceAcceleration(d, n, p, a);
+                for (int k = 0; k < 3; k++) {
+                    sumX[k] += weight[s] * k1[k];
+                    sumV[k] += weight[s] * a[k];
+                    p[k] = x[k] + offset[s]*t * k1[k];
+                    k1[k] = v[k] + offset[s]*t * a[k];
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                x[k] += t / 6.0L * sumX[k];
+                v[k] += t / 6.0L * sumV[k];
+            }
+        } else {
+            referenceAcceleration(d, n, x, a);
+            for (int k = 0; k < 3; k++) {
+                x[k] += v[k] * t + 0.5L * a[k] * t*t;
+                v[k] += a[k] * t;
+            }
+        }
+    }
+}
+
+/*
+ * Returns the energy per unit mass of a test particle at x with velocity
+ * v, and stores the sum of the magnitudes of its kinetic and potential
+ * energy, which the errors are relative to, in scale.
+ */
+static long double energy(const dataset_t* d, int n, const long double* x,
+                          const long double* v, long double* scale)
+{
+    long double kinetic = 0.5L*(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    long double potential = referencePotential(d, n, x);
+    *scale = kinetic + fabsl(potential);
+    return kinetic + potential;
+}
+
+/*
+ * Parses a comma separated list of problem sizes of the form TxP (test
+ * particles x pseudo-particles).
+ * Returns the number of sizes; exits if the list is invalid.
+ */
+static int parseSizes(const char* list, int (*sizes)[2])
+{
+    int count = 0;
+    const char* s = list;
+    while (*s != '\0') {
+        char* end;
+        long t = strtol(s, &end, 10);
+        long p = 0;
+        if (end != s && *end == 'x') {
+            const char* q = end + 1;
+            p = strtol(q, &end, 10);
+            if (end == q) {
+                p = 0;
+            }
+        }
+        if (end == s || t < 1 || p < 1 || count == MAX_VALUES
+                || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid list of sizes: %s\n", list);
+            exit(-1);
+        }
+        sizes[count][0] = (int)t;
+        sizes[count][1] = (int)p;
+        count++;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/*
+ * Returns the engine with the given name, or exits if there is none.
+ */
+static engine_info_t* findEngine(const char* name, size_t length)
+{
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        if (strlen(engines[i].name) == length
+                && strncmp(engines[i].name, name, length) == 0) {
+            return &engines[i];
+        }
+    }
+    fprintf(stderr, "Unknown engine %.*s\n", (int)length, name);
+    exit(-1);
+}
+
+/*
+ * Overrides the error bounds of engines with a comma separated list of
+ * NAME=POSITION:ENERGY.
+ */
+static void parseBounds(const char* list)
+{
+    const char* s = list;
+    while (*s != '\0') {
+        size_t length = strcspn(s, "=");
+        double position, energy;
+        int used = 0;
+        if (s[length] != '=' || sscanf(s + length + 1, "%lf:%lf%n",
+                                       &position, &energy, &used) != 2
+                || (s[length + 1 + used] != ','
+                    && s[length + 1 + used] != '\0')) {
+            fprintf(stderr, "Invalid list of bounds: %s\n", list);
+            exit(-1);
+        }
+        engine_info_t* e = findEngine(s, length);
+        e->position = position;
+        e->energy = energy;
+        s += length + 1 + used;
+        if (*s == ',') {
+            s++;
+        }
+    }
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the q-th quantile of n sorted values, interpolating linearly.
+ */
+static double quantile(const double* sorted, int n, double q)
+{
+    double pos = q*(n - 1);
+    int i = (int)pos;
+    if (i + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[i] + (pos - i)*(sorted[i + 1] - sorted[i]);
+}
+
+/*
+ * Sorts n errors and stores their median, 90th percentile and largest
+ * value in stats.
+ */
+static void summarize(double* errors, int n, double* stats)
+{
+    qsort(errors, n, sizeof(double), compareDoubles);
+    stats[0] = quantile(errors, n, 0.5);
+    stats[1] = quantile(errors, n, 0.9);
+    stats[2] = errors[n - 1];
+}
+
+/*
+ * Runs a command and stores the last position it reports in position.
+ * Returns 0 if it fails.
+ */
+static int runEngine(const char* command, double* position)
+{
+    FILE* p = popen(command, "r");
+    if (p == NULL) {
+        return 0;
+    }
+    char line[512];
+    int found = 0;
+    while (fgets(line, sizeof(line), p) != NULL) {
+        if (sscanf(line, "position: (%lf, %lf, %lf)", &position[0],
+                   &position[1], &position[2]) == 3) {
+            found = 1;
+        }
+    }
+    return pclose(p) == 0 && found;
+}
+
+/*
+ * Runs an engine on the first r->numTParticles test particles and
+ * r->numPParticles pseudo-particles of the dataset and compares the
+ * states it reaches to the reference for the sampled test particles.
+ * The position error of a test particle is its distance to the reference
+ * relative to the distance of the reference from the origin, and the
+ * energy error is the difference of the energy per unit mass relative to
+ * the sum of the magnitudes of the kinetic and potential energy of the
+ * reference. An engine passes if the 90th percentile of both is within
+ * its bounds, which leaves room for the few test particles which pass
+ * close to a pseudo-particle, where the rounding errors of any single
+ * precision engine are amplified.
+ * Returns 0 if the engine failed to run.
+ */
+static int checkEngine(result_t* r, const char* command,
+                       const char* trajectoryFile, const dataset_t* d,
+                       const sample_t* samples, int numSamples,
+                       int iterations)
+{
+    const engine_info_t* e = r->engine;
+    double position[3];
+    if (!runEngine(command, position)) {
+        return 0;
+    }
+
+    float* snapshot = NULL;
+    if (e->trajectory) {
+        snapshot = (float*)malloc(6*(size_t)r->numTParticles*sizeof(float));
+        if (snapshot == NULL) {
+            fprintf(stderr, "Error allocating memory for trajectory\n");
+            exit(-1);
+        }
+        if (trajectoryRead(trajectoryFile, iterations, r->numTParticles,
+                           snapshot) != 0) {
+            fprintf(stderr, "Error reading trajectory: %s\n",
+                    trajectoryFile);
+            free(snapshot);
+            return 0;
+        }
+    } else {
+        // only the first test particle, which is always the first sample
+        numSamples = 1;
+    }
+
+    double* positionErrors = (double*)malloc(numSamples*sizeof(double));
+    double* energyErrors = (double*)malloc(numSamples*sizeof(double));
+    for (int s = 0; s < numSamples; s++) {
+        const sample_t* ref = &samples[s];
+        long double x[3];
+        long double v[3];
+        if (snapshot != NULL) {
+            size_t n = r->numTParticles;
+            for (int k = 0; k < 3; k++) {
+                x[k] = snapshot[k*n + ref->index];
+                v[k] = snapshot[(3 + k)*n + ref->index];
+            }
+        } else {
+            for (int k = 0; k < 3; k++) {
+                x[k] = position[k];
+            }
+        }
+
+        long double dx = x[0] - ref->x[0];
+        long double dy = x[1] - ref->x[1];
+        long double dz = x[2] - ref->x[2];
+        long double length = sqrtl(ref->x[0]*ref->x[0] + ref->x[1]*ref->x[1]
+                                   + ref->x[2]*ref->x[2]);
+        positionErrors[s] = (double)(sqrtl(dx*dx + dy*dy + dz*dz)
+                                     / fmaxl(length, LDBL_MIN));
+
+        if (snapshot != NULL) {
+            long double scale;
+            long double refEnergy = energy(d, r->numPParticles, ref->x,
+                                           ref->v, &scale);
+            long double unused;
+            long double engineEnergy = energy(d, r->numPParticles, x, v,
+                                              &unused);
+            energyErrors[s] = (double)(fabsl(engineEnergy - refEnergy)
+                                       / fmaxl(scale, LDBL_MIN));
+        }
+    }
+
+    r->samples = numSamples;
+    summarize(positionErrors, numSamples, r->position);
+    r->pass = r->position[1] <= e->position;
+    if (snapshot != NULL) {
+        summarize(energyErrors, numSamples, r->energy);
+        r->pass = r->pass && r->energy[1] <= e->energy;
+    } else {
+        r->energy[0] = r->energy[1] = r->energy[2] = -1.0;
+    }
+
+    free(positionErrors);
+    free(energyErrors);
+    free(snapshot);
+    return 1;
+}
+
+/*
+ * Writes the command line which runs engine e on the given problem size
+ * into command.
+ */
+static void buildCommand(char* command, size_t size, const engine_info_t* e,
+                         const int* local, int numTParticles,
+                         int numPParticles, int iterations, float dt,
+                         const char* binDir, const char* mpirun,
+                         const char* extra, const char* integrator,
+                         const char* inputFile, const char* trajectoryFile,
+                         int stride)
+{
+    int len = snprintf(command, size, "%s%s%s%s%s %s",
+                       e->mpi ? mpirun : "", e->mpi ? " " : "",
+                       binDir ? binDir : "", binDir ? "/" : "",
+                       e->executable, extra ? extra : "");
+    if (e->gpu) {
+        len += snprintf(command + len, size - len, " %d", local[0]);
+        if (e->multiple) {
+            len += snprintf(command + len, size - len, " %d", local[1]);
+        }
+    }
+    if (e->multiple) {
+        len += snprintf(command + len, size - len, " %d", numTParticles);
+    }
+    len += snprintf(command + len, size - len,
+                    " %d %d %g --input %s --integrator %s", numPParticles,
+                    iterations, dt, inputFile, integrator);
+    if (e->trajectory) {
+        snprintf(command + len, size - len, " --trajectory %s --stride %d",
+                 trajectoryFile, stride);
+    }
+}
+
+/*
+ * Reads a whole file into a buffer allocated with malloc and stores its
+ * size in size. Returns NULL if it cannot be read.
+ */
+static char* readFile(const char* filename, long* size)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    char* data = NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (*size = ftell(f)) >= 0
+            && fseek(f, 0, SEEK_SET) == 0) {
+        data = (char*)malloc(*size > 0 ? *size : 1);
+        if (data != NULL && fread(data, 1, *size, f) != (size_t)*size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * Checks that a run which is interrupted and resumed from its checkpoint
+ * writes the same trajectory as one which is not. The snapshots are taken
+ * every 3 iterations and the checkpoints at a multiple of neither, so the
+ * resumed run starts between two snapshots. The commands are built by
+ * buildCommand() with the trajectory in trajectoryFile and the
+ * uninterrupted one in referenceFile.
+ * Returns 0 if the trajectories differ or a run failed.
+ */
+static int checkResume(const char* command, const char* stopCommand,
+                       const char* checkpointFile, int every,
+                       const char* trajectoryFile, const char* referenceFile)
+{
+    char run[4096];
+    double position[3];
+    remove(checkpointFile);
+    if (!runEngine(command, position) || rename(trajectoryFile,
+                                                referenceFile) != 0) {
+        return 0;
+    }
+    snprintf(run, sizeof(run), "%s --checkpoint %s --checkpoint-every %d",
+             stopCommand, checkpointFile, every);
+    fprintf(stderr, "%s\n", run);
+    if (!runEngine(run, position)) {
+        return 0;
+    }
+    snprintf(run, sizeof(run),
+             "%s --checkpoint %s --checkpoint-every %d --resume", command,
+             checkpointFile, every);
+    fprintf(stderr, "%s\n", run);
+    if (!runEngine(run, position)) {
+        return 0;
+    }
+
+    long size, referenceSize;
+    char* data = readFile(trajectoryFile, &size);
+    char* reference = readFile(referenceFile, &referenceSize);
+    int same = data != NULL && reference != NULL && size == referenceSize
+               && memcmp(data, reference, size) == 0;
+    free(data);
+    free(reference);
+    remove(checkpointFile);
+    remove(referenceFile);
+    return same;
+}
+
+/*
+ * Writes one result as a line of CSV.
+ */
+static void writeResult(FILE* out, const result_t* r, int iterations)
+{
+    const engine_info_t* e = r->engine;
+    fprintf(out, "%s,%d,%d,%d,%d,%.3e,%.3e,%.3e,", e->name,
+            r->numTParticles, r->numPParticles, iterations, r->samples,
+            r->position[0], r->position[1], r->position[2]);
+    if (r->energy[0] >= 0.0) {
+        fprintf(out, "%.3e,%.3e,%.3e,%.1e,%.1e,%s\n", r->energy[0],
+                r->energy[1], r->energy[2], e->position, e->energy,
+                r->pass ? "pass" : "fail");
+    } else {
+        fprintf(out, ",,,%.1e,,%s\n", e->position,
+                r->pass ? "pass" : "fail");
+    }
+    fflush(out);
+}
+
+/*
+ * Runs every engine on deterministic particles over a sweep of problem
+ * sizes and compares the positions and energies of the test particles
+ * after the iterations to a long double reference. Writes the errors of
+ * each engine and size as CSV and fails if an engine exceeds its bounds.
+ */
+int main(int argc, char** argv)
+{
+    char* engineOption = takeOption(&argc, argv, "--engines");
+    char* sizesOption = takeOption(&argc, argv, "--sizes");
+    char* localOption = takeOption(&argc, argv, "--local");
+    char* iterationsOption = takeOption(&argc, argv, "--iterations");
+    char* stepOption = takeOption(&argc, argv, "--step");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* samplesOption = takeOption(&argc, argv, "--samples");
+    char* seedOption = takeOption(&argc, argv, "--seed");
+    char* boundsOption = takeOption(&argc, argv, "--bounds");
+    char* binDir = takeOption(&argc, argv, "--bin");
+    char* cpuArgs = takeOption(&argc, argv, "--cpu-args");
+    char* gpuArgs = takeOption(&argc, argv, "--gpu-args");
+    char* mpirunOption = takeOption(&argc, argv, "--mpirun");
+    char* workDir = takeOption(&argc, argv, "--work");
+    char* outputFile = takeOption(&argc, argv, "--output");
+
+    const char* integratorName = integratorOption ? integratorOption
+                                                  : "euler";
+    int integrator = -1;
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(integratorName, integratorNames[i]) == 0) {
+            integrator = i;
+        }
+    }
+    if (argc != 1 || integrator < 0) {
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--engines E,...\tcpu_single, cpu_multiple, gpu_single, gpu_multiple (default all),\n\t\t\tcpu_single_32, cpu_multiple_32, hybrid or mpi_multiple\n");
+        fprintf(stderr, "\t--sizes TxP,...\tnumbers of test particles x pseudo-particles\n\t\t\t(default 16x64,256x1024,1024x16384)\n");
+        fprintf(stderr, "\t--local AxB\tlocal work group sizes of the GPU versions (default 64x1)\n");
+        fprintf(stderr, "\t--iterations N\titerations per run (default 100)\n");
+        fprintf(stderr, "\t--step DT\tsize of the time step (default 0.001)\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog or rk4\n");
+        fprintf(stderr, "\t--samples S\ttest particles compared to the reference (default 64)\n");
+        fprintf(stderr, "\t--seed N\tseed of the particles (default 1)\n");
+        fprintf(stderr, "\t--bounds E=X:V,...\tlargest 90th percentile of the position and energy errors of E\n");
+        fprintf(stderr, "\t--bin DIR\tdirectory of the executables\n");
+        fprintf(stderr, "\t--cpu-args A\toptions passed to the CPU versions, e.g. \"--precision double\"\n");
+        fprintf(stderr, "\t--gpu-args A\toptions passed to the GPU versions, e.g. \"--device-type cpu\"\n");
+        fprintf(stderr, "\t--mpirun C\tlauncher of mpi_multiple (default \"mpirun -np 2\")\n");
+        fprintf(stderr, "\t--work DIR\tdirectory of the temporary dataset and trajectory\n");
+        fprintf(stderr, "\t--output FILE\twrite the results to FILE instead of stdout\n");
+        exit(-1);
+    }
+
+    engine_info_t* selected[NUM_ENGINES];
+    int numSelected = 0;
+    const char* list = engineOption
+        ? engineOption : "cpu_single,cpu_multiple,gpu_single,gpu_multiple";
+    while (*list != '\0' && numSelected < NUM_ENGINES) {
+        size_t length = strcspn(list, ",");
+        selected[numSelected++] = findEngine(list, length);
+        list += list[length] == ',' ? length + 1 : length;
+    }
+    if (boundsOption != NULL) {
+        parseBounds(boundsOption);
+    }
+
+    int sizes[MAX_VALUES][2];
+    int numSizes = parseSizes(sizesOption ? sizesOption
+                                          : "16x64,256x1024,1024x16384",
+                              sizes);
+    int local[2] = {64, 1};
+    if (localOption != NULL
+            && (sscanf(localOption, "%dx%d", &local[0], &local[1]) < 1
+                || local[0] < 1 || local[1] < 1)) {
+        fprintf(stderr, "Invalid local size: %s\n", localOption);
+        exit(-1);
+    }
+    const int iterations = iterationsOption ? atoi(iterationsOption) : 100;
+    const float dt = stepOption ? (float)atof(stepOption) : 0.001f;
+    const int maxSamples = samplesOption ? atoi(samplesOption) : 64;
+    const uint64_t seed = seedOption ? strtoull(seedOption, NULL, 10) : 1;
+    const char* mpirun = mpirunOption ? mpirunOption : "mpirun -np 2";
+    if (iterations < 1 || maxSamples < 1) {
+        fprintf(stderr, "The iterations and samples must be positive\n");
+        exit(-1);
+    }
+
+    // one dataset for all sizes, each size uses the first particles of it
+    int maxT = 0;
+    int maxP = 0;
+    for (int s = 0; s < numSizes; s++) {
+        maxT = sizes[s][0] > maxT ? sizes[s][0] : maxT;
+        maxP = sizes[s][1] > maxP ? sizes[s][1] : maxP;
+    }
+    char inputFile[1024];
+    char trajectoryFile[1024];
+    char referenceFile[1024];
+    char checkpointFile[1024];
+    snprintf(inputFile, sizeof(inputFile), "%s%saccuracy_input.bin",
+             workDir ? workDir : "", workDir ? "/" : "");
+    snprintf(trajectoryFile, sizeof(trajectoryFile),
+             "%s%saccuracy_trajectory.bin", workDir ? workDir : "",
+             workDir ? "/" : "");
+    snprintf(referenceFile, sizeof(referenceFile),
+             "%s%saccuracy_reference.bin", workDir ? workDir : "",
+             workDir ? "/" : "");
+    snprintf(checkpointFile, sizeof(checkpointFile),
+             "%s%saccuracy_checkpoint.bin", workDir ? workDir : "",
+             workDir ? "/" : "");
+    dataset_t* d = generateDataset(maxP, maxT, seed);
+    if (writeDataset(inputFile, d) != 0) {
+        fprintf(stderr, "Error writing dataset: %s\n", inputFile);
+        exit(-1);
+    }
+
+    FILE* out = stdout;
+    if (outputFile != NULL) {
+        out = fopen(outputFile, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error opening %s\n", outputFile);
+            exit(-1);
+        }
+    }
+    fprintf(out, "engine,test_particles,pseudo_particles,iterations,samples,"
+            "position_median,position_p90,position_max,energy_median,"
+            "energy_p90,energy_max,position_bound,energy_bound,result\n");
+
+    int failures = 0;
+    sample_t* samples = (sample_t*)malloc(maxSamples*sizeof(sample_t));
+    for (int s = 0; s < numSizes; s++) {
+        const int numT = sizes[s][0];
+        const int numP = sizes[s][1];
+
+        // evenly spaced test particles, starting with the first one, which
+        // is the one the single test particle versions update
+        int numSamples = numT < maxSamples ? numT : maxSamples;
+        for (int k = 0; k < numSamples; k++) {
+            sample_t* ref = &samples[k];
+            ref->index = (int)((int64_t)k*numT / numSamples);
+            ref->x[0] = d->tx[ref->index];
+            ref->x[1] = d->ty[ref->index];
+            ref->x[2] = d->tz[ref->index];
+            ref->v[0] = d->tvx[ref->index];
+            ref->v[1] = d->tvy[ref->index];
+            ref->v[2] = d->tvz[ref->index];
+            referenceSteps(d, numP, integrator, dt, iterations, ref->x,
+                           ref->v);
+        }
+
+        for (int e = 0; e < numSelected; e++) {
+            const engine_info_t* engine = selected[e];
+            result_t r = {engine, engine->multiple ? numT : 1, numP, 0,
+                          {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, 0};
+
+            char command[2048];
+            buildCommand(command, sizeof(command), engine, local,
+                         r.numTParticles, numP, iterations, dt, binDir,
+                         mpirun, engine->gpu ? gpuArgs : cpuArgs,
+                         integratorName, inputFile, trajectoryFile,
+                         iterations);
+            fprintf(stderr, "%s\n", command);
+            if (!checkEngine(&r, command, trajectoryFile, d, samples,
+                             engine->multiple ? numSamples : 1,
+                             iterations)) {
+                fprintf(stderr, "failed: %s\n", command);
+                failures++;
+                continue;
+            }
+            writeResult(out, &r, iterations);
+            if (!r.pass) {
+                failures++;
+            }
+
+            // interrupted after 3/10 of the iterations, on the smallest
+            // size only, as it takes three more runs
+            if (engine->trajectory && s == 0 && iterations >= 10) {
+                int every = iterations / 5 + (iterations / 5 % 3 == 0);
+                char stopCommand[2048];
+                buildCommand(command, sizeof(command), engine, local,
+                             r.numTParticles, numP, iterations, dt, binDir,
+                             mpirun, engine->gpu ? gpuArgs : cpuArgs,
+                             integratorName, inputFile, trajectoryFile, 3);
+                buildCommand(stopCommand, sizeof(stopCommand), engine,
+                             local, r.numTParticles, numP,
+                             every + every / 2, dt, binDir, mpirun,
+                             engine->gpu ? gpuArgs : cpuArgs,
+                             integratorName, inputFile, trajectoryFile, 3);
+                fprintf(stderr, "%s\n", command);
+                if (!checkResume(command, stopCommand, checkpointFile,
+                                 every, trajectoryFile, referenceFile)) {
+                    fprintf(stderr, "resumed trajectory differs: %s\n",
+                            engine->name);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    free(samples);
+    freeDataset(d);
+    remove(inputFile);
+    remove(trajectoryFile);
+    remove(referenceFile);
+    remove(checkpointFile);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failures > 0 ? 1 : 0;
+}
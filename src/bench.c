@@ -0,0 +1,528 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "particle.h"
+#include "options.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// floating point operations per interaction, counted as in GPU Gems 3,
+// chapter 31 (the reciprocal square root counts as 4)
+#define FLOPS_PER_INTERACTION 20
+// bytes of a pseudo-particle: x, y, z and m
+#define PARTICLE_BYTES 16
+
+// most values of a swept parameter and most trials of a configuration
+#define MAX_VALUES 64
+#define MAX_TRIALS 1000
+
+/*
+ * An engine to benchmark: the name it is selected by, its executable as
+ * built by the makefile, whether it runs on the GPU (and takes local work
+ * group sizes) and whether it takes a number of test particles.
+ */
+typedef struct {
+    const char* name;
+    const char* executable;
+    int gpu;
+    int multiple;
+} engine_info_t;
+
+static const engine_info_t engines[] = {
+    {"cpu_single", "cpu_single_64.exe", 0, 0},
+    {"cpu_single_32", "cpu_single_32.exe", 0, 0},
+    {"cpu_multiple", "cpu_multiple_64.exe", 0, 1},
+    {"cpu_multiple_32", "cpu_multiple_32.exe", 0, 1},
+    {"gpu_single", "gpu_single.exe", 1, 0},
+    {"gpu_multiple", "gpu_multiple.exe", 1, 1},
+    {"hybrid", "hybrid.exe", 1, 1},
+};
+#define NUM_ENGINES (int)(sizeof(engines)/sizeof(engines[0]))
+
+// precisions of the sums, in the order they are run, so float comes first
+// and the others can be compared with it
+static const char* precisions[] = {"float", "kahan", "double"};
+#define NUM_PRECISIONS (int)(sizeof(precisions)/sizeof(precisions[0]))
+
+/*
+ * One configuration of an engine and the statistics of its trials.
+ */
+typedef struct {
+    const engine_info_t* engine;
+    int numTParticles;
+    int numPParticles;
+    int local[2];       // local work group sizes, 0 on the CPU
+    int iterations;
+    const char* precision;  // NULL if --precision is not swept
+    int trials;
+    double median;      // seconds per step
+    double p10;
+    double p90;
+    double min;
+    double vsFloat;     // median relative to float, negative if unknown
+} result_t;
+
+/*
+ * Parses a comma separated list of positive integers into values.
+ * Returns the number of values; exits if the list is invalid.
+ */
+static int parseList(const char* list, int* values, const char* name)
+{
+    int count = 0;
+    const char* s = list;
+    while (*s != '\0') {
+        char* end;
+        long value = strtol(s, &end, 10);
+        if (end == s || value < 1 || count == MAX_VALUES
+                || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid list for %s: %s\n", name, list);
+            exit(-1);
+        }
+        values[count++] = (int)value;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/*
+ * Parses a comma separated list of local work group sizes of the form A
+ * or AxB, where B (work-items per test particle) defaults to 1.
+ * Returns the number of sizes; exits if the list is invalid.
+ */
+static int parseLocalSizes(const char* list, int (*sizes)[2])
+{
+    int count = 0;
+    const char* s = list;
+    while (*s != '\0') {
+        char* end;
+        long a = strtol(s, &end, 10);
+        long b = 1;
+        if (end != s && *end == 'x') {
+            const char* t = end + 1;
+            b = strtol(t, &end, 10);
+            if (end == t) {
+                b = 0;
+            }
+        }
+        if (end == s || a < 1 || b < 1 || count == MAX_VALUES
+                || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Invalid list of local sizes: %s\n", list);
+            exit(-1);
+        }
+        sizes[count][0] = (int)a;
+        sizes[count][1] = (int)b;
+        count++;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/*
+ * Parses a comma separated list of precisions into values, in the order of
+ * precisions[] and without duplicates.
+ * Returns the number of precisions; exits if the list is invalid.
+ */
+static int parsePrecisions(const char* list, const char** values)
+{
+    int selected[NUM_PRECISIONS] = {0};
+    const char* s = list;
+    while (*s != '\0') {
+        size_t length = strcspn(s, ",");
+        int i = 0;
+        while (i < NUM_PRECISIONS && (strlen(precisions[i]) != length
+                || strncmp(precisions[i], s, length) != 0)) {
+            i++;
+        }
+        if (i == NUM_PRECISIONS) {
+            fprintf(stderr, "Unknown precision %.*s\n", (int)length, s);
+            exit(-1);
+        }
+        selected[i] = 1;
+        s += s[length] == ',' ? length + 1 : length;
+    }
+    int count = 0;
+    for (int i = 0; i < NUM_PRECISIONS; i++) {
+        if (selected[i]) {
+            values[count++] = precisions[i];
+        }
+    }
+    if (count == 0) {
+        fprintf(stderr, "Invalid list for --precision: %s\n", list);
+        exit(-1);
+    }
+    return count;
+}
+
+/*
+ * Returns the engine with the given name, or exits if there is none.
+ */
+static const engine_info_t* findEngine(const char* name, size_t length)
+{
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        if (strlen(engines[i].name) == length
+                && strncmp(engines[i].name, name, length) == 0) {
+            return &engines[i];
+        }
+    }
+    fprintf(stderr, "Unknown engine %.*s\n", (int)length, name);
+    exit(-1);
+}
+
+/*
+ * Writes the command line which runs configuration r into command.
+ */
+static void buildCommand(char* command, size_t size, const result_t* r,
+                         const char* binDir, const char* extra, float dt)
+{
+    const engine_info_t* e = r->engine;
+    int len = snprintf(command, size, "%s%s%s %s", binDir ? binDir : "",
+                       binDir ? "/" : "", e->executable, extra ? extra : "");
+    if (r->precision != NULL) {
+        len += snprintf(command + len, size - len, " --precision %s",
+                        r->precision);
+    }
+    if (e->gpu) {
+        len += snprintf(command + len, size - len, " %d", r->local[0]);
+        if (e->multiple) {
+            len += snprintf(command + len, size - len, " %d", r->local[1]);
+        }
+    }
+    if (e->multiple) {
+        len += snprintf(command + len, size - len, " %d", r->numTParticles);
+    }
+    snprintf(command + len, size - len, " %d %d %g", r->numPParticles,
+             r->iterations, dt);
+}
+
+/*
+ * Runs a command and returns the time it reports for the iterations of
+ * configuration r, or a negative value if it fails.
+ */
+static double runOnce(const char* command, const result_t* r)
+{
+    FILE* p = popen(command, "r");
+    if (p == NULL) {
+        return -1.0;
+    }
+    char line[512];
+    double seconds = -1.0;
+    double rate;
+    while (fgets(line, sizeof(line), p) != NULL) {
+        if (sscanf(line, "time: %lf s, %lf interactions/s", &seconds,
+                   &rate) == 2) {
+            // the rate has more significant digits than the time
+            if (rate > 0.0) {
+                seconds = (double)r->numTParticles*r->numPParticles
+                          *r->iterations / rate;
+            }
+        }
+    }
+    if (pclose(p) != 0) {
+        return -1.0;
+    }
+    return seconds;
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Returns the q-th quantile of n sorted values, interpolating linearly.
+ */
+static double quantile(const double* sorted, int n, double q)
+{
+    double pos = q*(n - 1);
+    int i = (int)pos;
+    if (i + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[i] + (pos - i)*(sorted[i + 1] - sorted[i]);
+}
+
+/*
+ * Runs configuration r warmup times, then r->trials times, and stores the
+ * statistics of the time per step of the trials in r.
+ * Returns 0 if a run failed.
+ */
+static int measure(result_t* r, const char* command, int warmup)
+{
+    double times[MAX_TRIALS];
+    for (int k = 0; k < warmup + r->trials; k++) {
+        double seconds = runOnce(command, r);
+        if (seconds < 0.0) {
+            return 0;
+        }
+        if (k >= warmup) {
+            times[k - warmup] = seconds / r->iterations;
+        }
+    }
+
+    qsort(times, r->trials, sizeof(double), compareDoubles);
+    r->median = quantile(times, r->trials, 0.5);
+    r->p10 = quantile(times, r->trials, 0.1);
+    r->p90 = quantile(times, r->trials, 0.9);
+    r->min = times[0];
+    return 1;
+}
+
+/*
+ * Returns the bytes of pseudo-particles loaded from memory per interaction
+ * of configuration r: every test particle streams all pseudo-particles,
+ * except that cpu_multiple shares each tile between up to BLOCK_SIZE test
+ * particles and gpu_multiple between the test particles of a work-group.
+ */
+static double bytesPerInteraction(const result_t* r)
+{
+    int reuse = 1;
+    if (r->engine->multiple) {
+        reuse = r->engine->gpu ? r->local[0] : BLOCK_SIZE;
+        if (reuse > r->numTParticles) {
+            reuse = r->numTParticles;
+        }
+    }
+    return (double)PARTICLE_BYTES / reuse;
+}
+
+/*
+ * Writes one result as a line of CSV or as a JSON object. peakFlops and
+ * peakBandwidth (GFLOP/s and GB/s) give the roofline bound of the
+ * configuration if both are positive.
+ */
+static void writeResult(FILE* out, const result_t* r, int json, int first,
+                        double peakFlops, double peakBandwidth)
+{
+    double rate = r->numTParticles*(double)r->numPParticles / r->median;
+    double gflops = rate*FLOPS_PER_INTERACTION / 1e9;
+    double bytes = bytesPerInteraction(r);
+    double intensity = FLOPS_PER_INTERACTION / bytes;
+    double bound = -1.0;
+    if (peakFlops > 0.0 && peakBandwidth > 0.0) {
+        bound = fmin(peakFlops, intensity*peakBandwidth);
+    }
+
+    char local[32] = "";
+    if (r->engine->gpu && r->engine->multiple) {
+        snprintf(local, sizeof(local), "%dx%d", r->local[0], r->local[1]);
+    } else if (r->engine->gpu) {
+        snprintf(local, sizeof(local), "%d", r->local[0]);
+    }
+
+    const char* precision = r->precision ? r->precision : "";
+    char vsFloat[32] = "";
+    if (r->vsFloat > 0.0) {
+        snprintf(vsFloat, sizeof(vsFloat), "%.3f", r->vsFloat);
+    }
+
+    if (!json) {
+        fprintf(out, "%s,%d,%d,%s,%s,%d,%d,%.6e,%.6e,%.6e,%.6e,%s,%.6e,"
+                "%.3f,%.3f,%.3f,", r->engine->name, r->numTParticles,
+                r->numPParticles, local, precision, r->iterations, r->trials,
+                r->median, r->p10, r->p90, r->min, vsFloat, rate, gflops,
+                bytes, intensity);
+        if (bound > 0.0) {
+            fprintf(out, "%.3f,%.3f\n", bound, gflops / bound);
+        } else {
+            fprintf(out, ",\n");
+        }
+        fflush(out);
+        return;
+    }
+
+    fprintf(out, "%s  {\"engine\": \"%s\", \"test_particles\": %d, "
+            "\"pseudo_particles\": %d, \"local_size\": \"%s\", "
+            "\"precision\": \"%s\", \"iterations\": %d, \"trials\": %d, "
+            "\"median_step_s\": %.6e, \"p10_step_s\": %.6e, "
+            "\"p90_step_s\": %.6e, \"min_step_s\": %.6e, "
+            "\"step_vs_float\": %s, \"interactions_per_s\": %.6e, "
+            "\"gflops\": %.3f, \"bytes_per_interaction\": %.3f, "
+            "\"flops_per_byte\": %.3f", first ? "" : ",\n",
+            r->engine->name, r->numTParticles, r->numPParticles, local,
+            precision, r->iterations, r->trials, r->median, r->p10, r->p90,
+            r->min, vsFloat[0] ? vsFloat : "null", rate, gflops, bytes,
+            intensity);
+    if (bound > 0.0) {
+        fprintf(out, ", \"roofline_gflops\": %.3f, \"roofline_fraction\": "
+                "%.3f}", bound, gflops / bound);
+    } else {
+        fprintf(out, ", \"roofline_gflops\": null, "
+                "\"roofline_fraction\": null}");
+    }
+    fflush(out);
+}
+
+/*
+ * Runs every engine over a sweep of problem sizes, local work group sizes
+ * and iterations, and writes the statistics of the time per step of each
+ * configuration as CSV or JSON.
+ */
+int main(int argc, char** argv)
+{
+    char* engineOption = takeOption(&argc, argv, "--engines");
+    char* tOption = takeOption(&argc, argv, "--test");
+    char* pOption = takeOption(&argc, argv, "--pseudo");
+    char* localOption = takeOption(&argc, argv, "--local");
+    char* iterationsOption = takeOption(&argc, argv, "--iterations");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* stepOption = takeOption(&argc, argv, "--step");
+    char* warmupOption = takeOption(&argc, argv, "--warmup");
+    char* trialsOption = takeOption(&argc, argv, "--trials");
+    char* binDir = takeOption(&argc, argv, "--bin");
+    char* cpuArgs = takeOption(&argc, argv, "--cpu-args");
+    char* gpuArgs = takeOption(&argc, argv, "--gpu-args");
+    char* formatOption = takeOption(&argc, argv, "--format");
+    char* outputFile = takeOption(&argc, argv, "--output");
+    char* peakFlopsOption = takeOption(&argc, argv, "--peak-gflops");
+    char* peakBandwidthOption = takeOption(&argc, argv, "--peak-bandwidth");
+
+    const char* format = formatOption ? formatOption : "csv";
+    const int json = strcmp(format, "json") == 0;
+    if (argc != 1 || (!json && strcmp(format, "csv") != 0)) {
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--engines E,...\tcpu_single, cpu_multiple, gpu_single, gpu_multiple (default all),\n\t\t\tcpu_single_32, cpu_multiple_32 or hybrid\n");
+        fprintf(stderr, "\t--test T,...\tnumbers of test particles (default 1024)\n");
+        fprintf(stderr, "\t--pseudo P,...\tnumbers of pseudo-particles (default 1024,16384)\n");
+        fprintf(stderr, "\t--local L,...\tlocal work group sizes A or AxB of the GPU versions (default 64)\n");
+        fprintf(stderr, "\t--iterations I,...\titerations per run (default 100)\n");
+        fprintf(stderr, "\t--precision P,...\tfloat, kahan or double sums (default: not passed)\n");
+        fprintf(stderr, "\t--step DT\tsize of the time step (default 0.01)\n");
+        fprintf(stderr, "\t--warmup N\truns before the measured ones (default 1)\n");
+        fprintf(stderr, "\t--trials N\tmeasured runs (default 5)\n");
+        fprintf(stderr, "\t--bin DIR\tdirectory of the executables\n");
+        fprintf(stderr, "\t--cpu-args A\toptions passed to the CPU versions, e.g. \"--threads 8\"\n");
+        fprintf(stderr, "\t--gpu-args A\toptions passed to the GPU versions, e.g. \"--batch 0\"\n");
+        fprintf(stderr, "\t--format F\tcsv (default) or json\n");
+        fprintf(stderr, "\t--output FILE\twrite the results to FILE instead of stdout\n");
+        fprintf(stderr, "\t--peak-gflops G\tpeak GFLOP/s of the device, for the roofline\n");
+        fprintf(stderr, "\t--peak-bandwidth B\tpeak memory bandwidth in GB/s, for the roofline\n");
+        exit(-1);
+    }
+
+    const engine_info_t* selected[NUM_ENGINES];
+    int numSelected = 0;
+    const char* list = engineOption
+        ? engineOption : "cpu_single,cpu_multiple,gpu_single,gpu_multiple";
+    while (*list != '\0' && numSelected < NUM_ENGINES) {
+        size_t length = strcspn(list, ",");
+        selected[numSelected++] = findEngine(list, length);
+        list += list[length] == ',' ? length + 1 : length;
+    }
+
+    int tValues[MAX_VALUES];
+    int pValues[MAX_VALUES];
+    int localValues[MAX_VALUES][2];
+    int iterationValues[MAX_VALUES];
+    const char* precisionValues[NUM_PRECISIONS] = {NULL};
+    int numT = parseList(tOption ? tOption : "1024", tValues, "--test");
+    int numP = parseList(pOption ? pOption : "1024,16384", pValues,
+                         "--pseudo");
+    int numLocal = parseLocalSizes(localOption ? localOption : "64",
+                                   localValues);
+    int numIterations = parseList(iterationsOption ? iterationsOption
+                                                   : "100",
+                                  iterationValues, "--iterations");
+    int numPrecision = precisionOption
+                       ? parsePrecisions(precisionOption, precisionValues) : 1;
+    const float dt = stepOption ? (float)atof(stepOption) : 0.01f;
+    const int warmup = warmupOption ? atoi(warmupOption) : 1;
+    const int trials = trialsOption ? atoi(trialsOption) : 5;
+    if (trials < 1 || trials > MAX_TRIALS) {
+        fprintf(stderr, "The number of trials must be 1 to %d\n", MAX_TRIALS);
+        exit(-1);
+    }
+    const double peakFlops = peakFlopsOption ? atof(peakFlopsOption) : 0.0;
+    const double peakBandwidth = peakBandwidthOption
+                                 ? atof(peakBandwidthOption) : 0.0;
+
+    FILE* out = stdout;
+    if (outputFile != NULL) {
+        out = fopen(outputFile, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error opening %s\n", outputFile);
+            exit(-1);
+        }
+    }
+    if (json) {
+        fprintf(out, "[\n");
+    } else {
+        fprintf(out, "engine,test_particles,pseudo_particles,local_size,"
+                "precision,iterations,trials,median_step_s,p10_step_s,"
+                "p90_step_s,min_step_s,step_vs_float,interactions_per_s,"
+                "gflops,bytes_per_interaction,flops_per_byte,roofline_gflops,"
+                "roofline_fraction\n");
+    }
+
+    // the single test particle versions and the CPU versions ignore some
+    // of the parameters, so they only run once for each of their values.
+    // The precisions of a configuration are run one after the other, float
+    // first, so the others can be compared with it.
+    int first = 1;
+    int failures = 0;
+    double floatMedian = -1.0;
+    for (int e = 0; e < numSelected; e++) {
+        const engine_info_t* engine = selected[e];
+        int numConfigs = (engine->multiple ? numT : 1) * numP
+                         * (engine->gpu ? numLocal : 1) * numIterations
+                         * numPrecision;
+        for (int c = 0; c < numConfigs; c++) {
+            int k = c;
+            result_t r = {engine, 1, 0, {0, 0}, 0, NULL, trials,
+                          0.0, 0.0, 0.0, 0.0, -1.0};
+            if (k % numPrecision == 0) {
+                floatMedian = -1.0;
+            }
+            r.precision = precisionValues[k % numPrecision];
+            k /= numPrecision;
+            r.iterations = iterationValues[k % numIterations];
+            k /= numIterations;
+            if (engine->gpu) {
+                r.local[0] = localValues[k % numLocal][0];
+                r.local[1] = localValues[k % numLocal][1];
+                k /= numLocal;
+            }
+            r.numPParticles = pValues[k % numP];
+            k /= numP;
+            if (engine->multiple) {
+                r.numTParticles = tValues[k];
+            }
+
+            char command[1024];
+            buildCommand(command, sizeof(command), &r, binDir,
+                         engine->gpu ? gpuArgs : cpuArgs, dt);
+            fprintf(stderr, "%s\n", command);
+            if (!measure(&r, command, warmup)) {
+                fprintf(stderr, "failed: %s\n", command);
+                failures++;
+                continue;
+            }
+            if (r.precision != NULL && strcmp(r.precision, "float") == 0) {
+                floatMedian = r.median;
+            }
+            if (floatMedian > 0.0) {
+                r.vsFloat = r.median / floatMedian;
+            }
+            writeResult(out, &r, json, first, peakFlops, peakBandwidth);
+            first = 0;
+        }
+    }
+
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failures > 0 ? 1 : 0;
+}
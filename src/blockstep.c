@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "blockstep.h"
+
+/*
+ * Hierarchical block time steps. A test particle on level k advances by
+ * t / 2^k at a time, so a time step t is split into 2^levels sub-steps and
+ * a test particle on level k starts a step on every 2^(levels-k)-th of
+ * them. Only the test particles which start a step are updated on a
+ * sub-step. Since the test particles do not act on each other, they do not
+ * have to be synchronized in between, and all of them are at the end of the
+ * time step after the last sub-step.
+ */
+struct blockstep {
+    int levels;             // finest level
+    float eta;              // fraction of the velocity it may change by
+    unsigned char* level;   // level of each test particle
+    int ready;              // whether level has been set
+
+    // the test particles which start a step on the current sub-step,
+    // grouped by level, and their indices in the test particles
+    tparticles_t* due;
+    int* index;
+
+    double count;           // steps taken by all test particles
+};
+
+/*
+ * Creates the block time steps for n test particles with levels 0 to
+ * levels. A test particle moves to the level whose step is at most eta
+ * times the time it takes its acceleration to change its velocity by the
+ * velocity itself, i.e. it changes its velocity by at most a fraction eta
+ * per step.
+ */
+blockstep_t* blockstepCreate(int n, int levels, float eta)
+{
+    if (levels < 0 || levels > MAX_LEVEL) {
+        fprintf(stderr, "The number of levels must be 0 to %d\n", MAX_LEVEL);
+        exit(-1);
+    }
+    blockstep_t* bs = (blockstep_t*)calloc(1, sizeof(blockstep_t));
+    if (bs == NULL) {
+        fprintf(stderr, "Error allocating memory for block steps\n");
+        exit(-1);
+    }
+    bs->levels = levels;
+    bs->eta = eta;
+    bs->level = (unsigned char*)malloc(n > 0 ? n : 1);
+    bs->index = (int*)malloc((n > 0 ? n : 1)*sizeof(int));
+    if (bs->level == NULL || bs->index == NULL) {
+        fprintf(stderr, "Error allocating memory for block steps\n");
+        exit(-1);
+    }
+    bs->due = createTParticles(n);
+    return bs;
+}
+
+/*
+ * Returns the coarsest level whose step is at most dt, or the finest level
+ * if there is none. Also gives the level of a step size h, since steps are
+ * exact powers of two of t.
+ */
+static int levelFor(const blockstep_t* bs, float dt, float t)
+{
+    int k = 0;
+    while (k < bs->levels && ldexpf(t, -k) > dt) {
+        k++;
+    }
+    return k;
+}
+
+/*
+ * Returns the coarsest level with a step starting on sub-step s.
+ */
+static int coarsestLevel(const blockstep_t* bs, int s)
+{
+    int k = bs->levels;
+    while (k > 0 && s % (1 << (bs->levels - k + 1)) == 0) {
+        k--;
+    }
+    return k;
+}
+
+/*
+ * Returns the step, at most eta times |v|/|a|, for a test particle with
+ * velocity v and acceleration a.
+ */
+static float stepFor(const blockstep_t* bs, const double* v, const double* a)
+{
+    double speed = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    double accel = sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
+    return accel > 0.0 ? (float)(bs->eta * speed / accel) : INFINITY;
+}
+
+/*
+ * Sets the level of every test particle, from the size of its step (h) if
+ * it has one, e.g. after resuming from a checkpoint, or from its
+ * acceleration otherwise.
+ */
+static void initLevels(blockstep_t* bs, tparticles_t* ps,
+                       const field_t* field, float t)
+{
+    for (int i = 0; i < ps->n; i++) {
+        if (ps->h[i] <= 0.0f) {
+            float a[3];
+            fieldAcceleration(field, ps->x[i], ps->y[i], ps->z[i], a);
+            double v[3] = {ps->vx[i], ps->vy[i], ps->vz[i]};
+            double acc[3] = {a[0], a[1], a[2]};
+            ps->h[i] = ldexpf(t, -levelFor(bs, stepFor(bs, v, acc), t));
+        }
+        bs->level[i] = (unsigned char)levelFor(bs, ps->h[i], t);
+    }
+    bs->ready = 1;
+}
+
+/*
+ * Advances all test particles by a time step t. On each sub-step the test
+ * particles which start a step are copied into consecutive arrays, grouped
+ * by level, so each level is updated with engineStep() and the threads and
+ * tiles of a full update. Afterwards each of them picks the level of its
+ * next step from the mean acceleration of the step it took, moving to a
+ * coarser level by at most one level per step and only where the coarser
+ * level starts a step. The size of its step is kept in h.
+ */
+void blockstepRun(blockstep_t* bs, engine_t* engine, tparticles_t* ps,
+                  const field_t* field, float t)
+{
+    const int levels = bs->levels;
+    const int subSteps = 1 << levels;
+    tparticles_t* due = bs->due;
+
+    if (!bs->ready) {
+        initLevels(bs, ps, field, t);
+    }
+
+    for (int s = 0; s < subSteps; s++) {
+        // group the test particles which start a step by level
+        int coarsest = coarsestLevel(bs, s);
+        int start[MAX_LEVEL + 2] = {0};
+        for (int i = 0; i < ps->n; i++) {
+            if (bs->level[i] >= coarsest) {
+                start[bs->level[i] + 1]++;
+            }
+        }
+        for (int k = coarsest; k <= levels; k++) {
+            start[k + 1] += start[k];
+        }
+        int next[MAX_LEVEL + 1];
+        for (int k = coarsest; k <= levels; k++) {
+            next[k] = start[k];
+        }
+        for (int i = 0; i < ps->n; i++) {
+            if (bs->level[i] >= coarsest) {
+                int j = next[bs->level[i]]++;
+                bs->index[j] = i;
+                due->x[j] = ps->x[i];
+                due->y[j] = ps->y[i];
+                due->z[j] = ps->z[i];
+                due->vx[j] = ps->vx[i];
+                due->vy[j] = ps->vy[i];
+                due->vz[j] = ps->vz[i];
+            }
+        }
+
+        for (int k = coarsest; k <= levels; k++) {
+            if (start[k + 1] > start[k]) {
+                tparticles_t group = sliceTParticles(due, start[k],
+                                                     start[k + 1] - start[k]);
+                engineStep(engine, &group, field, ldexpf(t, -k));
+            }
+        }
+
+        // copy the test particles back and pick their next level
+        int total = start[levels + 1];
+        for (int j = 0; j < total; j++) {
+            int i = bs->index[j];
+            int k = bs->level[i];
+            float h = ldexpf(t, -k);
+            double v[3] = {due->vx[j], due->vy[j], due->vz[j]};
+            double a[3] = {(v[0] - ps->vx[i]) / h, (v[1] - ps->vy[i]) / h,
+                           (v[2] - ps->vz[i]) / h};
+
+            int wanted = levelFor(bs, stepFor(bs, v, a), t);
+            int end = coarsestLevel(bs, s + (1 << (levels - k)));
+            if (wanted < k - 1) {
+                wanted = k - 1;
+            }
+            if (wanted < end) {
+                wanted = end;
+            }
+            bs->level[i] = (unsigned char)wanted;
+            ps->h[i] = ldexpf(t, -wanted);
+
+            ps->x[i] = due->x[j];
+            ps->y[i] = due->y[j];
+            ps->z[i] = due->z[j];
+            ps->vx[i] = due->vx[j];
+            ps->vy[i] = due->vy[j];
+            ps->vz[i] = due->vz[j];
+        }
+        bs->count += total;
+    }
+}
+
+/*
+ * Returns the number of steps taken by all test particles together.
+ */
+double blockstepCount(const blockstep_t* bs)
+{
+    return bs->count;
+}
+
+void blockstepFree(blockstep_t* bs)
+{
+    freeTParticles(bs->due);
+    free(bs->level);
+    free(bs->index);
+    free(bs);
+}
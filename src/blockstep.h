@@ -0,0 +1,19 @@
+#ifndef BLOCKSTEP_H
+#define BLOCKSTEP_H
+
+#include "particle.h"
+#include "engine.h"
+
+// finest level of the block time steps, so a time step is split into at
+// most 2^MAX_LEVEL sub-steps
+#define MAX_LEVEL 16
+
+typedef struct blockstep blockstep_t;
+
+blockstep_t* blockstepCreate(int, int, float);
+void blockstepRun(blockstep_t*, engine_t*, tparticles_t*, const field_t*,
+                  float);
+double blockstepCount(const blockstep_t*);
+void blockstepFree(blockstep_t*);
+
+#endif
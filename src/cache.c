@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define KIND_OCTREE 1
+#define KIND_GRID   2
+
+/*
+ * Header of a cache file. It is followed by the sections of the cached
+ * structure, each aligned to MAP_ALIGN bytes so they can be used directly
+ * from the mapped file.
+ */
+typedef struct {
+    char magic[4];          // "PNBC"
+    uint32_t version;       // CACHE_VERSION
+    uint32_t kind;          // KIND_OCTREE or KIND_GRID
+    uint32_t reserved;
+    uint64_t key;           // hash of the pseudo-particles and parameters
+    uint64_t counts[2];     // number of nodes and particles, or resolution
+    float params[4];        // grid origin and spacing
+    char padding[8];
+} cache_header_t;
+
+/*
+ * Hash of the pseudo-particles of a field.
+ */
+static uint64_t hashField(const field_t* field)
+{
+    uint64_t h = HASH_SEED;
+    size_t size = field->n*sizeof(float);
+    h = hashBytes(h, &field->n, sizeof(field->n));
+    h = hashBytes(h, field->x, size);
+    h = hashBytes(h, field->y, size);
+    h = hashBytes(h, field->z, size);
+    h = hashBytes(h, field->m, size);
+    return h;
+}
+
+static void cachePath(char* path, size_t size, const char* dir,
+                      const char* name, uint64_t key)
+{
+    int length = snprintf(path, size, "%s/%s-%016llx.bin", dir, name,
+                          (unsigned long long)key);
+    if (length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "Cache directory name too long: %s\n", dir);
+        exit(-1);
+    }
+}
+
+/*
+ * Maps a cache file and checks that it contains the expected structure.
+ * Returns NULL if the file does not exist or does not match.
+ */
+static mapfile_t* openCache(const char* path, uint32_t kind, uint64_t key)
+{
+    mapfile_t* map = mapFile(path);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    const cache_header_t* header = (const cache_header_t*)map->data;
+    if (map->size < sizeof(cache_header_t)
+            || memcmp(header->magic, "PNBC", 4) != 0
+            || header->version != CACHE_VERSION
+            || header->kind != kind
+            || header->key != key) {
+        unmapFile(map);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ * Writes a cache file through a temporary file, so a concurrent run never
+ * maps a partially written cache.
+ */
+static void writeCache(const char* path, const cache_header_t* header,
+                       const void** sections, const size_t* sizes,
+                       int numSections)
+{
+    char* tmpPath = (char*)malloc(strlen(path) + 5);
+    if (tmpPath == NULL) {
+        return;
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error writing cache file: %s\n", tmpPath);
+        free(tmpPath);
+        return;
+    }
+    writePadded(fp, header, sizeof(cache_header_t));
+    for (int i = 0; i < numSections; i++) {
+        writePadded(fp, sections[i], sizes[i]);
+    }
+    int err = ferror(fp);
+    err |= fclose(fp);
+
+    if (err != 0 || replaceFile(tmpPath, path) != 0) {
+        fprintf(stderr, "Error writing cache file: %s\n", path);
+        remove(tmpPath);
+    }
+    free(tmpPath);
+}
+
+static void initHeader(cache_header_t* header, uint32_t kind, uint64_t key)
+{
+    memset(header, 0, sizeof(cache_header_t));
+    memcpy(header->magic, "PNBC", 4);
+    header->version = CACHE_VERSION;
+    header->kind = kind;
+    header->key = key;
+}
+
+/*
+ * Returns the octree for the pseudo-particles of a field. If dir is not
+ * NULL, a tree built by an earlier run with the same pseudo-particles is
+ * mapped from the cache in that directory; otherwise (or if there is no
+ * such tree yet) the tree is built and, if dir is not NULL, stored there.
+ */
+octree_t* loadOctree(const char* dir, const field_t* field, float theta)
+{
+    if (dir == NULL) {
+        return octreeBuild(field->x, field->y, field->z, field->m, field->n,
+                           theta);
+    }
+
+    // theta is only used when traversing the tree, so it is not part of the key
+    int params[3] = {LEAF_SIZE, MAX_DEPTH, (int)sizeof(octnode_t)};
+    uint64_t key = hashBytes(hashField(field), params, sizeof(params));
+    char path[4096];
+    cachePath(path, sizeof(path), dir, "octree", key);
+
+    mapfile_t* map = openCache(path, KIND_OCTREE, key);
+    if (map != NULL) {
+        const cache_header_t* header = (const cache_header_t*)map->data;
+        size_t numNodes = header->counts[0];
+        size_t n = header->counts[1];
+        size_t nodesSize = alignOffset(numNodes*sizeof(octnode_t));
+        size_t arraySize = alignOffset(n*sizeof(float));
+
+        if (map->size >= alignOffset(sizeof(cache_header_t)) + nodesSize
+                         + 4*arraySize) {
+            char* data = (char*)map->data
+                       + alignOffset(sizeof(cache_header_t));
+            octree_t* tree = (octree_t*)malloc(sizeof(octree_t));
+            tree->nodes = (octnode_t*)data;
+            tree->numNodes = (int)numNodes;
+            data += nodesSize;
+            tree->x = (float*)data;
+            tree->y = (float*)(data + arraySize);
+            tree->z = (float*)(data + 2*arraySize);
+            tree->m = (float*)(data + 3*arraySize);
+            tree->n = (int)n;
+            tree->theta = theta;
+            tree->map = map;
+            return tree;
+        }
+        unmapFile(map);
+    }
+
+    octree_t* tree = octreeBuild(field->x, field->y, field->z, field->m,
+                                 field->n, theta);
+
+    cache_header_t header;
+    initHeader(&header, KIND_OCTREE, key);
+    header.counts[0] = tree->numNodes;
+    header.counts[1] = tree->n;
+    const void* sections[5] = {tree->nodes, tree->x, tree->y, tree->z,
+                               tree->m};
+    size_t arraySize = tree->n*sizeof(float);
+    size_t sizes[5] = {tree->numNodes*sizeof(octnode_t), arraySize,
+                       arraySize, arraySize, arraySize};
+    writeCache(path, &header, sections, sizes, 5);
+
+    return tree;
+}
+
+/*
+ * Returns the grid for a field, mapping it from the cache in dir if an
+ * earlier run sampled the same field with the same kernel, precision and
+ * reciprocal square root, or building (and caching) it otherwise. If dir
+ * is NULL, the grid is always built.
+ */
+grid_t* loadGrid(const char* dir, const field_t* field, int res, int interp,
+                 int numThreads)
+{
+    if (dir == NULL) {
+        return gridBuild(field, res, interp, numThreads);
+    }
+
+    // the samples depend on the octree (if any) and on the kernel which
+    // sums the accelerations, but not on the interpolation
+    float params[4] = {(float)res, GRID_MARGIN,
+                       field->tree != NULL ? field->tree->theta : -1.0f,
+                       (float)kernelFast()};
+    uint64_t key = hashBytes(hashField(field), params, sizeof(params));
+    key = hashBytes(key, kernelName(), strlen(kernelName()) + 1);
+    key = hashBytes(key, precisionName(), strlen(precisionName()) + 1);
+    char path[4096];
+    cachePath(path, sizeof(path), dir, "grid", key);
+
+    mapfile_t* map = openCache(path, KIND_GRID, key);
+    if (map != NULL) {
+        const cache_header_t* header = (const cache_header_t*)map->data;
+        size_t numSamples = (size_t)res*res*res;
+
+        if (header->counts[0] == (uint64_t)res
+                && map->size >= alignOffset(sizeof(cache_header_t))
+                                + alignOffset(4*numSamples*sizeof(float))) {
+            grid_t* g = (grid_t*)malloc(sizeof(grid_t));
+            g->res = res;
+            g->min[0] = header->params[0];
+            g->min[1] = header->params[1];
+            g->min[2] = header->params[2];
+            g->spacing = header->params[3];
+            g->interp = interp;
+            g->samples = (float*)((char*)map->data
+                                  + alignOffset(sizeof(cache_header_t)));
+            g->map = map;
+            return g;
+        }
+        unmapFile(map);
+    }
+
+    grid_t* g = gridBuild(field, res, interp, numThreads);
+
+    cache_header_t header;
+    initHeader(&header, KIND_GRID, key);
+    header.counts[0] = res;
+    header.params[0] = g->min[0];
+    header.params[1] = g->min[1];
+    header.params[2] = g->min[2];
+    header.params[3] = g->spacing;
+    const void* sections[1] = {g->samples};
+    size_t sizes[1] = {4*(size_t)res*res*res*sizeof(float)};
+    writeCache(path, &header, sections, sizes, 1);
+
+    return g;
+}
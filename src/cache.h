@@ -0,0 +1,16 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "particle.h"
+#include "octree.h"
+#include "grid.h"
+
+// increment whenever the layout of a cache file or a cached structure changes
+#define CACHE_VERSION 2
+
+octree_t* loadOctree(const char*, const field_t*, float);
+grid_t* loadGrid(const char*, const field_t*, int, int, int);
+
+#endif
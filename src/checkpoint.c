@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "checkpoint.h"
+#include "mapfile.h"
+
+/*
+ * Header of a checkpoint file. It is followed by the arrays x, y, z, m, vx,
+ * vy, vz, h of the test particles after the given number of iterations.
+ * The remaining fields identify the run, so a checkpoint is not resumed with
+ * different particles or parameters.
+ */
+typedef struct {
+    char magic[4];          // "PNBK"
+    uint32_t version;       // CHECKPOINT_VERSION
+    uint64_t iteration;     // number of completed iterations
+    uint64_t runHash;       // hash of the pseudo-particles and options
+    uint32_t numTParticles;
+    uint32_t numPParticles;
+    float timeStep;
+    uint32_t reserved;
+} checkpoint_header_t;
+
+/*
+ * Checkpoints are written by a background thread from a copy of the state
+ * of the test particles, so the simulation only waits if it wants to take
+ * the next checkpoint before the previous one has been written.
+ */
+struct checkpoint {
+    char* filename;
+    checkpoint_header_t header;
+    float* state;
+    int full;
+    int closing;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/*
+ * Writes the checkpoint to a temporary file and then replaces the previous
+ * checkpoint with it, so there always is a complete checkpoint on disk.
+ */
+static void writeCheckpoint(checkpoint_t* ck)
+{
+    size_t tmpSize = strlen(ck->filename) + 5;
+    char* tmpPath = (char*)malloc(tmpSize);
+    snprintf(tmpPath, tmpSize, "%s.tmp", ck->filename);
+
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error writing checkpoint: %s\n", tmpPath);
+        free(tmpPath);
+        return;
+    }
+    size_t size = CHECKPOINT_FIELDS*(size_t)ck->header.numTParticles;
+    int err = fwrite(&ck->header, sizeof(checkpoint_header_t), 1, fp) != 1;
+    err |= fwrite(ck->state, sizeof(float), size, fp) != size;
+    err |= syncFile(fp);
+    err |= fclose(fp);
+
+    if (err != 0 || replaceFile(tmpPath, ck->filename) != 0) {
+        fprintf(stderr, "Error writing checkpoint: %s\n", ck->filename);
+        remove(tmpPath);
+    }
+    free(tmpPath);
+}
+
+static void* writerMain(void* arg)
+{
+    checkpoint_t* ck = (checkpoint_t*)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&ck->lock);
+        while (!ck->full && !ck->closing) {
+            pthread_cond_wait(&ck->changed, &ck->lock);
+        }
+        if (!ck->full) {
+            pthread_mutex_unlock(&ck->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&ck->lock);
+
+        writeCheckpoint(ck);
+
+        pthread_mutex_lock(&ck->lock);
+        ck->full = 0;
+        pthread_cond_broadcast(&ck->changed);
+        pthread_mutex_unlock(&ck->lock);
+    }
+}
+
+/*
+ * Starts writing checkpoints of a run to filename. The number of particles,
+ * the time step and a hash of the pseudo-particles and of the options
+ * which change the results are stored with each
+ * checkpoint and checked by readCheckpoint().
+ */
+checkpoint_t* checkpointOpen(const char* filename, int numTParticles,
+                             int numPParticles, float timeStep,
+                             uint64_t runHash)
+{
+    checkpoint_t* ck = (checkpoint_t*)calloc(1, sizeof(checkpoint_t));
+    ck->filename = (char*)malloc(strlen(filename) + 1);
+    ck->state = (float*)malloc(CHECKPOINT_FIELDS*(size_t)numTParticles
+                               *sizeof(float));
+    if (ck->filename == NULL || ck->state == NULL) {
+        fprintf(stderr, "Error allocating memory for checkpoint\n");
+        exit(-1);
+    }
+    strcpy(ck->filename, filename);
+
+    memcpy(ck->header.magic, "PNBK", 4);
+    ck->header.version = CHECKPOINT_VERSION;
+    ck->header.runHash = runHash;
+    ck->header.numTParticles = numTParticles;
+    ck->header.numPParticles = numPParticles;
+    ck->header.timeStep = timeStep;
+
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->changed, NULL);
+    if (pthread_create(&ck->writer, NULL, writerMain, ck) != 0) {
+        fprintf(stderr, "Error creating checkpoint thread\n");
+        exit(-1);
+    }
+    return ck;
+}
+
+/*
+ * Returns the buffer for the state of the next checkpoint, waiting for the
+ * previous checkpoint to be written first. The buffer holds the arrays
+ * x, y, z, m, vx, vy, vz, h of all test particles, one after the other,
+ * where h is the size of the next step with an adaptive integrator.
+ */
+float* checkpointBegin(checkpoint_t* ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    while (ck->full) {
+        pthread_cond_wait(&ck->changed, &ck->lock);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return ck->state;
+}
+
+/*
+ * Hands the state stored by the caller to the writer. iteration is the
+ * number of iterations which have been completed.
+ */
+void checkpointCommit(checkpoint_t* ck, int iteration)
+{
+    pthread_mutex_lock(&ck->lock);
+    ck->header.iteration = iteration;
+    ck->full = 1;
+    pthread_cond_broadcast(&ck->changed);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+/*
+ * Waits for the last checkpoint to be written.
+ */
+void checkpointClose(checkpoint_t* ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    ck->closing = 1;
+    pthread_cond_broadcast(&ck->changed);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->writer, NULL);
+
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->changed);
+    free(ck->filename);
+    free(ck->state);
+    free(ck);
+}
+
+/*
+ * Reads the state of the test particles from a checkpoint and stores the
+ * number of completed iterations in iteration. Exits if the checkpoint
+ * belongs to a run with different particles or parameters.
+ * Returns the arrays x, y, z, m, vx, vy, vz, h of the test particles, or
+ * NULL if no checkpoint has been written yet.
+ */
+float* readCheckpoint(const char* filename, int numTParticles,
+                      int numPParticles, float timeStep, uint64_t runHash,
+                      int* iteration)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, "PNBK", 4) != 0
+            || header.version != CHECKPOINT_VERSION) {
+        fprintf(stderr, "Not a checkpoint file: %s\n", filename);
+        exit(-1);
+    }
+    if (header.numTParticles != (uint32_t)numTParticles
+            || header.numPParticles != (uint32_t)numPParticles
+            || header.timeStep != timeStep
+            || header.runHash != runHash) {
+        fprintf(stderr, "Checkpoint %s belongs to a different run\n",
+                filename);
+        exit(-1);
+    }
+
+    size_t size = CHECKPOINT_FIELDS*(size_t)numTParticles;
+    float* state = (float*)malloc(size*sizeof(float));
+    if (state == NULL || fread(state, sizeof(float), size, fp) != size) {
+        fprintf(stderr, "Error reading checkpoint: %s\n", filename);
+        exit(-1);
+    }
+    fclose(fp);
+
+    *iteration = (int)header.iteration;
+    return state;
+}
@@ -0,0 +1,21 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+// increment whenever the layout of a checkpoint file changes
+#define CHECKPOINT_VERSION 2
+
+// number of values stored per test particle: x, y, z, m, vx, vy, vz and
+// the size of its next step
+#define CHECKPOINT_FIELDS 8
+
+typedef struct checkpoint checkpoint_t;
+
+checkpoint_t* checkpointOpen(const char*, int, int, float, uint64_t);
+float* checkpointBegin(checkpoint_t*);
+void checkpointCommit(checkpoint_t*, int);
+void checkpointClose(checkpoint_t*);
+float* readCheckpoint(const char*, int, int, float, uint64_t, int*);
+
+#endif
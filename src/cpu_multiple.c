@@ -1,7 +1,92 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "particle.h"
+#include "octree.h"
+#include "grid.h"
+#include "packed.h"
+#include "cache.h"
+#include "dataset.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "engine.h"
+#include "blockstep.h"
+#include "mapfile.h"
+#include "options.h"
+#include "timer.h"
+#include "profile.h"
+
+/*
+ * Copies the state of the recorded test particles into the next trajectory
+ * snapshot.
+ */
+static void recordSnapshot(trajectory_t* tr, const tparticles_t* tParticles,
+                           int iteration)
+{
+    int first = trajectoryFirst(tr);
+    size_t size = trajectoryCount(tr)*sizeof(float);
+    float* snapshot = trajectoryBegin(tr);
+    const float* arrays[6] = {tParticles->x, tParticles->y, tParticles->z,
+                              tParticles->vx, tParticles->vy, tParticles->vz};
+    for (int k = 0; k < 6; k++) {
+        memcpy((char*)snapshot + k*size, arrays[k] + first, size);
+    }
+    trajectoryCommit(tr, iteration);
+}
+
+/*
+ * Copies the state of all test particles into the next checkpoint, in the
+ * order x, y, z, m, vx, vy, vz, h.
+ */
+static void saveCheckpoint(checkpoint_t* ck, const tparticles_t* tParticles,
+                           int iteration)
+{
+    size_t size = tParticles->n*sizeof(float);
+    float* state = checkpointBegin(ck);
+    const float* arrays[CHECKPOINT_FIELDS] = {
+        tParticles->x, tParticles->y, tParticles->z, tParticles->m,
+        tParticles->vx, tParticles->vy, tParticles->vz, tParticles->h};
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        memcpy((char*)state + k*size, arrays[k], size);
+    }
+    checkpointCommit(ck, iteration);
+}
+
+/*
+ * Restores the state of all test particles from a checkpoint.
+ */
+static void restoreCheckpoint(const float* state, tparticles_t* tParticles)
+{
+    size_t size = tParticles->n*sizeof(float);
+    float* arrays[CHECKPOINT_FIELDS] = {
+        tParticles->x, tParticles->y, tParticles->z, tParticles->m,
+        tParticles->vx, tParticles->vy, tParticles->vz, tParticles->h};
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        memcpy(arrays[k], (const char*)state + k*size, size);
+    }
+}
+
+/*
+ * Hashes the pseudo-particles and the options which change the results, so
+ * a checkpoint is only resumed by the same run.
+ */
+static uint64_t hashRun(const field_t* field, const char** options,
+                        int numOptions)
+{
+    size_t size = field->n*sizeof(float);
+    uint64_t h = HASH_SEED;
+    h = hashBytes(h, field->x, size);
+    h = hashBytes(h, field->y, size);
+    h = hashBytes(h, field->z, size);
+    h = hashBytes(h, field->m, size);
+    for (int i = 0; i < numOptions; i++) {
+        // the terminating zero separates the options
+        const char* option = options[i] ? options[i] : "";
+        h = hashBytes(h, option, strlen(option) + 1);
+    }
+    return h;
+}
 
 /*
  * Creates a number of "pseudo-particles" which have an x-, y-, and z-coordiate
@@ -11,67 +96,371 @@
  */
 int main(int argc, char** argv)
 {
+    // options
+    char* threadsOption = takeOption(&argc, argv, "--threads");
+    const int numThreads = threadsOption ? atoi(threadsOption) : 1;
+    char* kernelOption = takeOption(&argc, argv, "--kernel");
+    const int fastRsqrt = takeFlag(&argc, argv, "--fast-rsqrt");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    char* levelsOption = takeOption(&argc, argv, "--levels");
+    char* etaOption = takeOption(&argc, argv, "--eta");
+    char* thetaOption = takeOption(&argc, argv, "--theta");
+    char* gridOption = takeOption(&argc, argv, "--grid");
+    char* interpOption = takeOption(&argc, argv, "--interp");
+    char* cacheDir = takeOption(&argc, argv, "--cache");
+    char* inputFile = takeOption(&argc, argv, "--input");
+    char* trajectoryFile = takeOption(&argc, argv, "--trajectory");
+    char* strideOption = takeOption(&argc, argv, "--stride");
+    char* subsetOption = takeOption(&argc, argv, "--subset");
+    char* checkpointFile = takeOption(&argc, argv, "--checkpoint");
+    char* everyOption = takeOption(&argc, argv, "--checkpoint-every");
+    const int resume = takeFlag(&argc, argv, "--resume");
+    const int profileFlag = takeFlag(&argc, argv, "--profile");
+    char* traceFile = takeOption(&argc, argv, "--trace");
+
     if (argc != 5) {
         fprintf(stderr, "requires 4 command line arguments:\n");
         fprintf(stderr, "\t#test particles\n\t#pseudo-particles\n");
         fprintf(stderr, "\t#iterations\n\tsize of time step\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--threads N\tnumber of threads (default 1)\n");
+        fprintf(stderr, "\t--kernel K\tauto, avx512, avx2, sse or scalar\n");
+        fprintf(stderr, "\t--fast-rsqrt\tuse an approximate 1/sqrt\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--levels L\tsplit time steps into up to 2^L block "
+                "steps per test particle\n");
+        fprintf(stderr, "\t--eta E\tfraction of the velocity a block step may "
+                "change (default 0.01)\n");
+        fprintf(stderr, "\t--theta T\tuse a Barnes-Hut octree with opening angle T\n");
+        fprintf(stderr, "\t--grid N\tinterpolate from N^3 precomputed samples\n");
+        fprintf(stderr, "\t--interp I\tlinear (default) or cubic interpolation\n");
+        fprintf(stderr, "\t--cache DIR\treuse the octree and grid from earlier runs\n");
+        fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+        fprintf(stderr, "\t--trajectory FILE\twrite the trajectories of the test particles\n");
+        fprintf(stderr, "\t--stride K\trecord every K iterations (default 1)\n");
+        fprintf(stderr, "\t--subset FIRST:COUNT\trecord only COUNT test particles\n");
+        fprintf(stderr, "\t--checkpoint FILE\tsave the test particles periodically\n");
+        fprintf(stderr, "\t--checkpoint-every K\tsave every K iterations (default 100)\n");
+        fprintf(stderr, "\t--resume\tcontinue from the checkpoint, if there is one\n");
+        fprintf(stderr, "\t--profile\tprint the time spent in each phase\n");
+        fprintf(stderr, "\t--trace FILE\twrite the phases as a Chrome trace\n");
+        exit(-1);
+    }
+    if (resume && checkpointFile == NULL) {
+        fprintf(stderr, "--resume requires --checkpoint\n");
+        exit(-1);
+    }
+
+    int precision = PRECISION_FLOAT;
+    if (precisionOption != NULL) {
+        precision = parsePrecision(precisionOption);
+        if (precision < 0) {
+            fprintf(stderr, "Unknown precision %s\n", precisionOption);
+            exit(-1);
+        }
+    }
+    int storage = STORAGE_FLOAT;
+    if (storageOption != NULL) {
+        storage = parseStorage(storageOption);
+        if (storage < 0) {
+            fprintf(stderr, "Unknown storage %s\n", storageOption);
+            exit(-1);
+        }
+        if (storage != STORAGE_FLOAT && precision != PRECISION_FLOAT) {
+            fprintf(stderr, "--storage requires --precision float\n");
+            exit(-1);
+        }
+    }
+    if (!selectKernel(kernelOption, fastRsqrt, precision)) {
+        fprintf(stderr, "Kernel %s is not supported\n", kernelOption);
+        exit(-1);
+    }
+    int interp = INTERP_LINEAR;
+    if (interpOption != NULL) {
+        interp = parseInterp(interpOption);
+        if (interp < 0) {
+            fprintf(stderr, "Unknown interpolation %s\n", interpOption);
+            exit(-1);
+        }
+    }
+    int integrator = INTEGRATOR_EULER;
+    if (integratorOption != NULL) {
+        integrator = parseIntegrator(integratorOption);
+        if (integrator < 0) {
+            fprintf(stderr, "Unknown integrator %s\n", integratorOption);
+            exit(-1);
+        }
+    }
+    selectIntegrator(integrator,
+                     toleranceOption ? (float)atof(toleranceOption) : 1e-6f);
+    if (levelsOption != NULL && integrator == INTEGRATOR_ADAPTIVE) {
+        fprintf(stderr, "--levels requires a fixed step integrator\n");
         exit(-1);
     }
 
+    // time spent in each phase of the run
+    profile_t* profile = profileCreate(profileFlag, traceFile);
+    phase_t* setupPhase = profilePhase(profile, "setup");
+    phase_t* stepPhase = profilePhase(profile, "step");
+    phase_t* outputPhase = profilePhase(profile, "output");
+    double setupBegin = profileTime(setupPhase);
+
     const int numTParticles = atoi(argv[1]);
     const int numPParticles = atoi(argv[2]);
     const int iterations = atoi(argv[3]);
     const float timeStep = (float)atof(argv[4]);
 
+    // particles read from a file, instead of random ones
+    dataset_t* input = NULL;
+    if (inputFile != NULL) {
+        input = readDataset(inputFile);
+        if (numTParticles > input->numTParticles
+                || numPParticles > input->numPParticles) {
+            fprintf(stderr, "%s only has %d test particles and %d "
+                    "pseudo-particles\n", inputFile, input->numTParticles,
+                    input->numPParticles);
+            exit(-1);
+        }
+    }
+
     // positions and masses of pseudo-particles
-    float* x = (float*)malloc(numPParticles*sizeof(float));
-    float* y = (float*)malloc(numPParticles*sizeof(float));
-    float* z = (float*)malloc(numPParticles*sizeof(float));
-    float* m = (float*)malloc(numPParticles*sizeof(float));
+    float* x;
+    float* y;
+    float* z;
+    float* m;
 
-    // array of test particles
-    particle_t** tParticles = (particle_t**)malloc(numTParticles*sizeof(particle_t*));
+    // test particles
+    tparticles_t* tParticles = createTParticles(numTParticles);
 
     // initialize pseudo-particles
-    for (int i = 0; i < numPParticles; i++) {
-        x[i] = rand();
-        y[i] = rand();
-        z[i] = rand();
-        m[i] = rand();
+    if (input != NULL) {
+        // use the mapped file directly
+        x = input->x;
+        y = input->y;
+        z = input->z;
+        m = input->m;
+    } else {
+        x = (float*)malloc(numPParticles*sizeof(float));
+        y = (float*)malloc(numPParticles*sizeof(float));
+        z = (float*)malloc(numPParticles*sizeof(float));
+        m = (float*)malloc(numPParticles*sizeof(float));
+        for (int i = 0; i < numPParticles; i++) {
+            x[i] = rand();
+            y[i] = rand();
+            z[i] = rand();
+            m[i] = rand();
+        }
+    }
+
+    // pseudo-particles acting on the test particles
+    field_t field = {x, y, z, m, numPParticles, NULL, NULL};
+    octree_t* tree = NULL;
+    if (thetaOption != NULL) {
+        tree = loadOctree(cacheDir, &field, (float)atof(thetaOption));
+        field.tree = tree;
+    }
+    grid_t* grid = NULL;
+    if (gridOption != NULL) {
+        grid = loadGrid(cacheDir, &field, atoi(gridOption), interp, numThreads);
+        field.grid = grid;
     }
+    packed_t* packed = NULL;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(x, y, z, m, 1, numPParticles, storage);
+        field.packed = packed;
+    }
+
     // initialize test particles
-    for (int i = 0; i < numTParticles; i++) {
-        tParticles[i] = (particle_t*)malloc(sizeof(particle_t));
-        tParticles[i]->x = rand();
-        tParticles[i]->y = rand();
-        tParticles[i]->z = rand();
-        tParticles[i]->m =  rand() % 500;
-        tParticles[i]->vx = rand() % 5;
-        tParticles[i]->vy = rand() % 5;
-        tParticles[i]->vz = rand() % 5;
+    if (input != NULL) {
+        size_t size = numTParticles*sizeof(float);
+        memcpy(tParticles->x, input->tx, size);
+        memcpy(tParticles->y, input->ty, size);
+        memcpy(tParticles->z, input->tz, size);
+        memcpy(tParticles->m, input->tm, size);
+        memcpy(tParticles->vx, input->tvx, size);
+        memcpy(tParticles->vy, input->tvy, size);
+        memcpy(tParticles->vz, input->tvz, size);
+    } else {
+        for (int i = 0; i < numTParticles; i++) {
+            tParticles->x[i] = rand();
+            tParticles->y[i] = rand();
+            tParticles->z[i] = rand();
+            tParticles->m[i] = rand() % 500;
+            tParticles->vx[i] = rand() % 5;
+            tParticles->vy[i] = rand() % 5;
+            tParticles->vz[i] = rand() % 5;
+        }
+    }
+
+    // continue where an earlier run of the same simulation stopped
+    checkpoint_t* checkpoint = NULL;
+    const int checkpointEvery = everyOption ? atoi(everyOption) : 100;
+    int start = 0;
+    if (checkpointFile != NULL) {
+        if (checkpointEvery < 1) {
+            fprintf(stderr, "Invalid checkpoint interval\n");
+            exit(-1);
+        }
+        const char* options[] = {kernelName(), precisionName(),
+                                 fastRsqrt ? "fast-rsqrt" : NULL,
+                                 thetaOption, gridOption, interpOption,
+                                 integratorName(), toleranceOption,
+                                 levelsOption, etaOption,
+                                 storageName(storage)};
+        uint64_t runHash = hashRun(&field, options, 11);
+        if (resume) {
+            float* state = readCheckpoint(checkpointFile, numTParticles,
+                                          numPParticles, timeStep, runHash,
+                                          &start);
+            if (state != NULL) {
+                restoreCheckpoint(state, tParticles);
+                free(state);
+                printf("resuming after iteration %d\n", start);
+            }
+        }
+        checkpoint = checkpointOpen(checkpointFile, numTParticles,
+                                    numPParticles, timeStep, runHash);
+    }
+
+    // how far the 16-bit storage moves the accelerations
+    if (packed != NULL) {
+        double maxError, rmsError;
+        packError(packed, x, y, z, m, 1, tParticles->x, tParticles->y, tParticles->z, 1,
+                  numTParticles, &maxError, &rmsError);
+        printf("storage: %s, relative error of the acceleration: "
+               "max %.3e, rms %.3e\n", storageName(storage), maxError,
+               rmsError);
+    }
+
+    // how far the interpolation moves the accelerations and the potential
+    if (grid != NULL) {
+        double maxError, rmsError, maxPotential, rmsPotential;
+        gridError(grid, &field, tParticles->x, tParticles->y, tParticles->z, 1,
+                  numTParticles, &maxError, &rmsError, &maxPotential,
+                  &rmsPotential);
+        printf("grid: %s, relative error of the acceleration: max %.3e, "
+               "rms %.3e, of the potential: max %.3e, rms %.3e\n",
+               interpName(interp), maxError, rmsError, maxPotential,
+               rmsPotential);
     }
 
     // print the initial position of the first test particle
     printf("position: (%.12f, %.12f, %.12f)\n",
-            tParticles[0]->x, tParticles[0]->y, tParticles[0]->z);
+            tParticles->x[0], tParticles->y[0], tParticles->z[0]);
 
     // print the initial x position of the first 3 test particles.
     // printf("position: (%.12f, %.12f, %.12f)\n",
-            // tParticles[0]->x, tParticles[1]->x, tParticles[2]->x);
+            // tParticles->x[0], tParticles->x[1], tParticles->x[2]);
+
+    // trajectories are written in the background while the particles are
+    // being updated
+    trajectory_t* trajectory = NULL;
+    if (trajectoryFile != NULL) {
+        int first = 0;
+        int count = numTParticles;
+        if (subsetOption != NULL
+                && sscanf(subsetOption, "%d:%d", &first, &count) != 2) {
+            fprintf(stderr, "--subset requires FIRST:COUNT\n");
+            exit(-1);
+        }
+        trajectory = trajectoryOpen(trajectoryFile, numTParticles,
+                                    strideOption ? atoi(strideOption) : 1,
+                                    first, count, start);
+        // a resumed run records what an uninterrupted run would
+        if (start == 0 || trajectoryDue(trajectory, start)) {
+            recordSnapshot(trajectory, tParticles, start);
+        }
+    }
 
     // update particles over a number of iterations
-    for (int i = 0; i < iterations; i++) {
-        for (int j = 0; j < numTParticles; j++) {
-            updateParticle(tParticles[j], x, y, z, m, numPParticles, timeStep);
+    engine_t* engine = engineCreate(numThreads);
+    blockstep_t* blocksteps = NULL;
+    if (levelsOption != NULL) {
+        blocksteps = blockstepCreate(numTParticles, atoi(levelsOption),
+                                     etaOption ? (float)atof(etaOption)
+                                               : 0.01f);
+    }
+    profileEnd(setupPhase, setupBegin);
+    double begin = wallTime();
+    for (int i = start; i < iterations; i++) {
+        double stepBegin = profileTime(stepPhase);
+        if (blocksteps != NULL) {
+            blockstepRun(blocksteps, engine, tParticles, &field, timeStep);
+        } else {
+            engineStep(engine, tParticles, &field, timeStep);
+        }
+        profileEnd(stepPhase, stepBegin);
+
+        // waits if the background writers are still busy with the last
+        // snapshot or checkpoint
+        double outputBegin = profileTime(outputPhase);
+        int output = 0;
+        if (trajectory != NULL && trajectoryDue(trajectory, i + 1)) {
+            recordSnapshot(trajectory, tParticles, i + 1);
+            output = 1;
+        }
+        if (checkpoint != NULL && (i + 1) % checkpointEvery == 0) {
+            saveCheckpoint(checkpoint, tParticles, i + 1);
+            output = 1;
+        }
+        if (output) {
+            profileEnd(outputPhase, outputBegin);
         }
     }
+    double seconds = wallTime() - begin;
+    engineDestroy(engine);
+
+    // waits for the last snapshot and checkpoint to be written
+    double closeBegin = profileTime(outputPhase);
+    if (checkpoint != NULL) {
+        checkpointClose(checkpoint);
+    }
+    if (trajectory != NULL) {
+        trajectoryClose(trajectory);
+    }
+    if (checkpoint != NULL || trajectory != NULL) {
+        profileEnd(outputPhase, closeBegin);
+    }
+    if (grid != NULL) {
+        gridFree(grid);
+    }
+    if (tree != NULL) {
+        octreeFree(tree);
+    }
+    if (packed != NULL) {
+        packFree(packed);
+    }
 
     // print the final position of the first test particles
     printf("position: (%.12f, %.12f, %.12f)\n",
-            tParticles[0]->x, tParticles[0]->y, tParticles[0]->z);
+            tParticles->x[0], tParticles->y[0], tParticles->z[0]);
+    freeTParticles(tParticles);
+
+    // pairs of particles per second, as if every pair was summed directly
+    double interactions = (double)numTParticles*numPParticles
+                          *(iterations - start);
+    printf("time: %.3f s, %.3e interactions/s (%s, %s, %s)\n", seconds,
+           interactions / seconds, kernelName(), precisionName(),
+           integratorName());
+    if (blocksteps != NULL) {
+        // compared to 2^L steps of every test particle with the finest step
+        double steps = blockstepCount(blocksteps)
+                       / ((double)numTParticles*(iterations - start));
+        printf("block steps: %.2f per test particle and iteration, "
+               "%.1fx fewer than with the finest step\n", steps,
+               (1 << atoi(levelsOption)) / steps);
+        blockstepFree(blocksteps);
+    }
+    profileReport(profile, stdout);
 
     // print the final x position of the first 3 test particles
     // printf("position: (%.12f, %.12f, %.12f)\n",
-            // tParticles[0]->x, tParticles[1]->x, tParticles[2]->x);
+            // tParticles->x[0], tParticles->x[1], tParticles->x[2]);
 
 }
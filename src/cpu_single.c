@@ -1,7 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "particle.h"
+#include "octree.h"
+#include "grid.h"
+#include "packed.h"
+#include "cache.h"
+#include "dataset.h"
+#include "options.h"
+#include "timer.h"
+#include "profile.h"
 
 /*
  * Creates a number of "pseudo-particles" which have an x-, y-, and z-coordiate
@@ -11,51 +20,216 @@
  */
 int main(int argc, char** argv)
 {
+    // options
+    char* kernelOption = takeOption(&argc, argv, "--kernel");
+    const int fastRsqrt = takeFlag(&argc, argv, "--fast-rsqrt");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    char* thetaOption = takeOption(&argc, argv, "--theta");
+    char* gridOption = takeOption(&argc, argv, "--grid");
+    char* interpOption = takeOption(&argc, argv, "--interp");
+    char* cacheDir = takeOption(&argc, argv, "--cache");
+    char* inputFile = takeOption(&argc, argv, "--input");
+    const int profileFlag = takeFlag(&argc, argv, "--profile");
+    char* traceFile = takeOption(&argc, argv, "--trace");
+
     if (argc != 4) {
         fprintf(stderr, "requires 3 command line arguments:\n");
         fprintf(stderr, "\t#pseudo-particles\n\t#iterations\n");
         fprintf(stderr, "\tsize of time step\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--kernel K\tauto, avx512, avx2, sse or scalar\n");
+        fprintf(stderr, "\t--fast-rsqrt\tuse an approximate 1/sqrt\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--theta T\tuse a Barnes-Hut octree with opening angle T\n");
+        fprintf(stderr, "\t--grid N\tinterpolate from N^3 precomputed samples\n");
+        fprintf(stderr, "\t--interp I\tlinear (default) or cubic interpolation\n");
+        fprintf(stderr, "\t--cache DIR\treuse the octree and grid from earlier runs\n");
+        fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+        fprintf(stderr, "\t--profile\tprint the time spent in each phase\n");
+        fprintf(stderr, "\t--trace FILE\twrite the phases as a Chrome trace\n");
         exit(-1);
     }
 
+    int precision = PRECISION_FLOAT;
+    if (precisionOption != NULL) {
+        precision = parsePrecision(precisionOption);
+        if (precision < 0) {
+            fprintf(stderr, "Unknown precision %s\n", precisionOption);
+            exit(-1);
+        }
+    }
+    int storage = STORAGE_FLOAT;
+    if (storageOption != NULL) {
+        storage = parseStorage(storageOption);
+        if (storage < 0) {
+            fprintf(stderr, "Unknown storage %s\n", storageOption);
+            exit(-1);
+        }
+        if (storage != STORAGE_FLOAT && precision != PRECISION_FLOAT) {
+            fprintf(stderr, "--storage requires --precision float\n");
+            exit(-1);
+        }
+    }
+    if (!selectKernel(kernelOption, fastRsqrt, precision)) {
+        fprintf(stderr, "Kernel %s is not supported\n", kernelOption);
+        exit(-1);
+    }
+    int interp = INTERP_LINEAR;
+    if (interpOption != NULL) {
+        interp = parseInterp(interpOption);
+        if (interp < 0) {
+            fprintf(stderr, "Unknown interpolation %s\n", interpOption);
+            exit(-1);
+        }
+    }
+    int integrator = INTEGRATOR_EULER;
+    if (integratorOption != NULL) {
+        integrator = parseIntegrator(integratorOption);
+        if (integrator < 0) {
+            fprintf(stderr, "Unknown integrator %s\n", integratorOption);
+            exit(-1);
+        }
+    }
+    selectIntegrator(integrator,
+                     toleranceOption ? (float)atof(toleranceOption) : 1e-6f);
+
+    // time spent in each phase of the run
+    profile_t* profile = profileCreate(profileFlag, traceFile);
+    phase_t* setupPhase = profilePhase(profile, "setup");
+    phase_t* stepPhase = profilePhase(profile, "step");
+    double setupBegin = profileTime(setupPhase);
+
     const int numPParticles = atoi(argv[1]);    // number of pseudo-particles
     const int iterations = atoi(argv[2]);
     const float timeStep = (float)atof(argv[3]);
 
+    // particles read from a file, instead of random ones
+    dataset_t* input = NULL;
+    if (inputFile != NULL) {
+        input = readDataset(inputFile);
+        if (numPParticles > input->numPParticles
+                || input->numTParticles < 1) {
+            fprintf(stderr, "%s only has %d test particles and %d "
+                    "pseudo-particles\n", inputFile, input->numTParticles,
+                    input->numPParticles);
+            exit(-1);
+        }
+    }
+
     // positions and masses of pseudo-particles
-    float* x = (float*)malloc((numPParticles)*sizeof(float));
-    float* y = (float*)malloc((numPParticles)*sizeof(float));
-    float* z = (float*)malloc((numPParticles)*sizeof(float));
-    float* m = (float*)malloc((numPParticles)*sizeof(float));
+    float* x;
+    float* y;
+    float* z;
+    float* m;
 
     // initialize pseudo-particles
-    for (int i = 0; i < numPParticles; i++) {
-        x[i] = rand();
-        y[i] = rand();
-        z[i] = rand();
-        m[i] = rand();
+    if (input != NULL) {
+        // use the mapped file directly
+        x = input->x;
+        y = input->y;
+        z = input->z;
+        m = input->m;
+    } else {
+        x = (float*)malloc((numPParticles)*sizeof(float));
+        y = (float*)malloc((numPParticles)*sizeof(float));
+        z = (float*)malloc((numPParticles)*sizeof(float));
+        m = (float*)malloc((numPParticles)*sizeof(float));
+        for (int i = 0; i < numPParticles; i++) {
+            x[i] = rand();
+            y[i] = rand();
+            z[i] = rand();
+            m[i] = rand();
+        }
+    }
+
+    // pseudo-particles acting on the test particle
+    field_t field = {x, y, z, m, numPParticles, NULL, NULL};
+    octree_t* tree = NULL;
+    if (thetaOption != NULL) {
+        tree = loadOctree(cacheDir, &field, (float)atof(thetaOption));
+        field.tree = tree;
+    }
+    grid_t* grid = NULL;
+    if (gridOption != NULL) {
+        grid = loadGrid(cacheDir, &field, atoi(gridOption), interp, 1);
+        field.grid = grid;
+    }
+    packed_t* packed = NULL;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(x, y, z, m, 1, numPParticles, storage);
+        field.packed = packed;
     }
 
     // initialize test particle
-    particle_t* testParticle = (particle_t*)malloc(sizeof(particle_t));
-    testParticle->x = rand();
-    testParticle->y = rand();
-    testParticle->z = rand();
-    testParticle->m = rand() % 500;
-    testParticle->vx = rand() % 5;
-    testParticle->vy = rand() % 5;
-    testParticle->vz = rand() % 5;
+    tparticles_t* testParticle = createTParticles(1);
+    if (input != NULL) {
+        testParticle->x[0] = input->tx[0];
+        testParticle->y[0] = input->ty[0];
+        testParticle->z[0] = input->tz[0];
+        testParticle->m[0] = input->tm[0];
+        testParticle->vx[0] = input->tvx[0];
+        testParticle->vy[0] = input->tvy[0];
+        testParticle->vz[0] = input->tvz[0];
+    } else {
+        testParticle->x[0] = rand();
+        testParticle->y[0] = rand();
+        testParticle->z[0] = rand();
+        testParticle->m[0] = rand() % 500;
+        testParticle->vx[0] = rand() % 5;
+        testParticle->vy[0] = rand() % 5;
+        testParticle->vz[0] = rand() % 5;
+    }
+
+    // how far the 16-bit storage moves the accelerations
+    if (packed != NULL) {
+        double maxError, rmsError;
+        packError(packed, x, y, z, m, 1, testParticle->x, testParticle->y, testParticle->z, 1,
+                  1, &maxError, &rmsError);
+        printf("storage: %s, relative error of the acceleration: "
+               "max %.3e, rms %.3e\n", storageName(storage), maxError,
+               rmsError);
+    }
+
+    // how far the interpolation moves the accelerations and the potential
+    if (grid != NULL) {
+        double maxError, rmsError, maxPotential, rmsPotential;
+        gridError(grid, &field, testParticle->x, testParticle->y, testParticle->z, 1,
+                  1, &maxError, &rmsError, &maxPotential,
+                  &rmsPotential);
+        printf("grid: %s, relative error of the acceleration: max %.3e, "
+               "rms %.3e, of the potential: max %.3e, rms %.3e\n",
+               interpName(interp), maxError, rmsError, maxPotential,
+               rmsPotential);
+    }
 
     // print initial position
     printf("position: (%.12f, %.12f, %.12f)\n",
-            testParticle->x, testParticle->y, testParticle->z);
+            testParticle->x[0], testParticle->y[0], testParticle->z[0]);
+
+    profileEnd(setupPhase, setupBegin);
 
     // update particle over a number of iterations
+    double begin = wallTime();
     for (int i = 0; i < iterations; i++) {
-        updateParticle(testParticle, x, y, z, m, numPParticles, timeStep);
+        double stepBegin = profileTime(stepPhase);
+        updateParticles(testParticle, 0, 1, &field, timeStep);
+        profileEnd(stepPhase, stepBegin);
     }
+    double seconds = wallTime() - begin;
 
     // print final position
     printf("position: (%.12f, %.12f, %.12f)\n",
-            testParticle->x, testParticle->y, testParticle->z);
+            testParticle->x[0], testParticle->y[0], testParticle->z[0]);
+
+    // pairs of particles per second, as if every pair was summed directly
+    printf("time: %.3f s, %.3e interactions/s (%s, %s, %s)\n", seconds,
+           (double)numPParticles*iterations / seconds, kernelName(),
+           precisionName(), integratorName());
+    profileReport(profile, stdout);
 }
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataset.h"
+
+/*
+ * Columns read from a CSV file, stored as one growing array per column.
+ */
+typedef struct {
+    int numColumns;
+    int rows;
+    int capacity;
+    float* columns[7];
+} table_t;
+
+/*
+ * Parses up to numColumns comma-separated numbers from a line.
+ * Returns 0 if the line does not contain enough numbers (e.g. a header).
+ */
+static int parseLine(const char* line, int numColumns, float* values)
+{
+    const char* p = line;
+    for (int i = 0; i < numColumns; i++) {
+        char* end;
+        values[i] = strtof(p, &end);
+        if (end == p) {
+            return 0;
+        }
+        p = end;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (i + 1 < numColumns) {
+            if (*p != ',') {
+                return 0;
+            }
+            p++;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Reads a CSV file with numColumns numbers per line. Lines which do not
+ * start with numColumns numbers (such as a header) are skipped.
+ */
+static void readTable(const char* filename, table_t* table)
+{
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        exit(-1);
+    }
+
+    char line[4096];
+    float values[7];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (!parseLine(line, table->numColumns, values)) {
+            continue;
+        }
+        if (table->rows == table->capacity) {
+            table->capacity = table->capacity ? 2*table->capacity : 1024;
+            for (int i = 0; i < table->numColumns; i++) {
+                table->columns[i] = (float*)realloc(table->columns[i],
+                                        table->capacity*sizeof(float));
+                if (table->columns[i] == NULL) {
+                    fprintf(stderr, "Error allocating memory\n");
+                    exit(-1);
+                }
+            }
+        }
+        for (int i = 0; i < table->numColumns; i++) {
+            table->columns[i][table->rows] = values[i];
+        }
+        table->rows++;
+    }
+    fclose(fp);
+}
+
+/*
+ * Converts pseudo-particles and test particles from CSV files into a
+ * dataset file which can be passed to the other programs with --input.
+ * Each line of the pseudo-particle file is "x,y,z,m" and each line of the
+ * test particle file is "x,y,z,m,vx,vy,vz".
+ */
+int main(int argc, char** argv)
+{
+    if (argc != 4) {
+        fprintf(stderr, "requires 3 command line arguments:\n");
+        fprintf(stderr, "\tpseudo-particle CSV file (x,y,z,m)\n");
+        fprintf(stderr, "\ttest particle CSV file (x,y,z,m,vx,vy,vz)");
+        fprintf(stderr, " or - for none\n");
+        fprintf(stderr, "\toutput file\n");
+        exit(-1);
+    }
+
+    table_t pTable;
+    table_t tTable;
+    memset(&pTable, 0, sizeof(pTable));
+    memset(&tTable, 0, sizeof(tTable));
+    pTable.numColumns = 4;
+    tTable.numColumns = 7;
+
+    readTable(argv[1], &pTable);
+    if (strcmp(argv[2], "-") != 0) {
+        readTable(argv[2], &tTable);
+    }
+
+    dataset_t* d = createDataset(pTable.rows, tTable.rows);
+    float* pArrays[4] = {d->x, d->y, d->z, d->m};
+    float* tArrays[7] = {d->tx, d->ty, d->tz, d->tm, d->tvx, d->tvy, d->tvz};
+    for (int i = 0; i < 4 && pTable.rows > 0; i++) {
+        memcpy(pArrays[i], pTable.columns[i], pTable.rows*sizeof(float));
+    }
+    for (int i = 0; i < 7 && tTable.rows > 0; i++) {
+        memcpy(tArrays[i], tTable.columns[i], tTable.rows*sizeof(float));
+    }
+
+    if (writeDataset(argv[3], d) != 0) {
+        fprintf(stderr, "Error writing dataset: %s\n", argv[3]);
+        exit(-1);
+    }
+    printf("%d pseudo-particles, %d test particles\n",
+           d->numPParticles, d->numTParticles);
+
+    freeDataset(d);
+    return 0;
+}
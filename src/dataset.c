@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dataset.h"
+
+/*
+ * Header of a dataset file. It is followed by the arrays x, y, z, m of the
+ * pseudo-particles and x, y, z, m, vx, vy, vz of the test particles, each
+ * starting at a multiple of MAP_ALIGN bytes.
+ */
+typedef struct {
+    char magic[4];          // "PNBD"
+    uint32_t version;       // DATASET_VERSION
+    uint64_t numPParticles;
+    uint64_t numTParticles;
+    char padding[40];
+} dataset_header_t;
+
+/*
+ * Points the arrays of a dataset at consecutive aligned sections of data.
+ */
+static void assignArrays(dataset_t* d, char* data)
+{
+    size_t pSize = alignOffset(d->numPParticles*sizeof(float));
+    size_t tSize = alignOffset(d->numTParticles*sizeof(float));
+    float** pArrays[4] = {&d->x, &d->y, &d->z, &d->m};
+    float** tArrays[7] = {&d->tx, &d->ty, &d->tz, &d->tm,
+                          &d->tvx, &d->tvy, &d->tvz};
+
+    for (int i = 0; i < 4; i++) {
+        *pArrays[i] = (float*)data;
+        data += pSize;
+    }
+    for (int i = 0; i < 7; i++) {
+        *tArrays[i] = (float*)data;
+        data += tSize;
+    }
+}
+
+static size_t dataSize(int numPParticles, int numTParticles)
+{
+    return 4*alignOffset(numPParticles*sizeof(float))
+         + 7*alignOffset(numTParticles*sizeof(float));
+}
+
+/*
+ * Allocates an (uninitialized) dataset with the given number of
+ * pseudo-particles and test particles.
+ */
+dataset_t* createDataset(int numPParticles, int numTParticles)
+{
+    dataset_t* d = (dataset_t*)calloc(1, sizeof(dataset_t));
+    if (d == NULL) {
+        fprintf(stderr, "Error allocating memory for dataset\n");
+        exit(-1);
+    }
+    d->numPParticles = numPParticles;
+    d->numTParticles = numTParticles;
+
+    char* data = (char*)malloc(dataSize(numPParticles, numTParticles));
+    if (data == NULL) {
+        fprintf(stderr, "Error allocating memory for dataset\n");
+        exit(-1);
+    }
+    assignArrays(d, data);
+    return d;
+}
+
+/*
+ * Maps a dataset file into memory. The arrays of the dataset point into
+ * the mapped file, so nothing is copied.
+ */
+dataset_t* readDataset(const char* filename)
+{
+    mapfile_t* map = mapFile(filename);
+    if (map == NULL) {
+        fprintf(stderr, "Error opening dataset: %s\n", filename);
+        exit(-1);
+    }
+
+    const dataset_header_t* header = (const dataset_header_t*)map->data;
+    if (map->size < sizeof(dataset_header_t)
+            || memcmp(header->magic, "PNBD", 4) != 0) {
+        fprintf(stderr, "Not a dataset file: %s\n", filename);
+        exit(-1);
+    }
+    if (header->version != DATASET_VERSION) {
+        fprintf(stderr, "Unsupported dataset version %u: %s\n",
+                header->version, filename);
+        exit(-1);
+    }
+    if (header->numPParticles > INT32_MAX || header->numTParticles > INT32_MAX
+            || map->size < alignOffset(sizeof(dataset_header_t))
+                           + dataSize((int)header->numPParticles,
+                                      (int)header->numTParticles)) {
+        fprintf(stderr, "Dataset file is truncated: %s\n", filename);
+        exit(-1);
+    }
+
+    dataset_t* d = (dataset_t*)calloc(1, sizeof(dataset_t));
+    d->numPParticles = (int)header->numPParticles;
+    d->numTParticles = (int)header->numTParticles;
+    d->map = map;
+    assignArrays(d, (char*)map->data + alignOffset(sizeof(dataset_header_t)));
+    return d;
+}
+
+/*
+ * Writes a dataset to a file. Returns 0 on success.
+ */
+int writeDataset(const char* filename, const dataset_t* d)
+{
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    dataset_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PNBD", 4);
+    header.version = DATASET_VERSION;
+    header.numPParticles = d->numPParticles;
+    header.numTParticles = d->numTParticles;
+    writePadded(fp, &header, sizeof(header));
+
+    const float* pArrays[4] = {d->x, d->y, d->z, d->m};
+    const float* tArrays[7] = {d->tx, d->ty, d->tz, d->tm,
+                               d->tvx, d->tvy, d->tvz};
+    for (int i = 0; i < 4; i++) {
+        writePadded(fp, pArrays[i], d->numPParticles*sizeof(float));
+    }
+    for (int i = 0; i < 7; i++) {
+        writePadded(fp, tArrays[i], d->numTParticles*sizeof(float));
+    }
+
+    int err = ferror(fp);
+    err |= fclose(fp);
+    return err;
+}
+
+void freeDataset(dataset_t* d)
+{
+    if (d->map != NULL) {
+        unmapFile(d->map);
+    } else {
+        free(d->x);
+    }
+    free(d);
+}
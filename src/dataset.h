@@ -0,0 +1,38 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "mapfile.h"
+
+// increment whenever the layout of a dataset file changes
+#define DATASET_VERSION 1
+
+/*
+ * A set of pseudo-particles and test particles, stored as separate arrays
+ * for each component. Datasets read from a file point directly into the
+ * mapped file and must not be modified.
+ */
+typedef struct {
+    int numPParticles;
+    float* x;
+    float* y;
+    float* z;
+    float* m;
+
+    int numTParticles;
+    float* tx;
+    float* ty;
+    float* tz;
+    float* tm;
+    float* tvx;
+    float* tvy;
+    float* tvz;
+
+    mapfile_t* map;
+} dataset_t;
+
+dataset_t* createDataset(int, int);
+dataset_t* readDataset(const char*);
+int writeDataset(const char*, const dataset_t*);
+void freeDataset(dataset_t*);
+
+#endif
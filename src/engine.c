@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "engine.h"
+
+// number of test particles a worker takes from its queue at a time
+#define CHUNK_SIZE BLOCK_SIZE
+
+/*
+ * The range of test particles which is still waiting to be updated by a
+ * worker. The owner takes chunks from the front while other workers steal
+ * from the back.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int begin;
+    int end;
+} queue_t;
+
+typedef struct {
+    engine_t* engine;
+    int id;
+} worker_t;
+
+struct engine {
+    int numThreads;
+    pthread_t* threads;
+    worker_t* workers;
+    queue_t* queues;
+
+    // used to start the workers and to wait for the end of a step
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int generation;
+    int pending;
+    int quit;
+
+    // the current step
+    tparticles_t* tParticles;
+    const field_t* field;
+    float t;
+};
+
+/*
+ * Takes up to CHUNK_SIZE test particles from the front of a queue.
+ * Returns 0 if the queue is empty.
+ */
+static int takeChunk(queue_t* q, int* begin, int* end)
+{
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->begin < q->end) {
+        *begin = q->begin;
+        *end = q->begin + CHUNK_SIZE < q->end ? q->begin + CHUNK_SIZE : q->end;
+        q->begin = *end;
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/*
+ * Moves half of the remaining test particles of another worker's queue
+ * into the (empty) queue of the given worker.
+ * Returns 0 if there was nothing left to steal.
+ */
+static int steal(engine_t* e, int id)
+{
+    for (int k = 1; k < e->numThreads; k++) {
+        queue_t* victim = &e->queues[(id + k) % e->numThreads];
+        int begin = 0, end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end - victim->begin;
+        if (remaining > 0) {
+            end = victim->end;
+            begin = end - (remaining + 1) / 2;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (end > begin) {
+            queue_t* own = &e->queues[id];
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Updates test particles until there is no work left in any queue.
+ * Each test particle is updated by exactly one worker and its sum over the
+ * pseudo-particles is done in the same order regardless of which worker
+ * updates it, so the result does not depend on the number of threads.
+ */
+static void work(engine_t* e, int id)
+{
+    int begin, end;
+    do {
+        while (takeChunk(&e->queues[id], &begin, &end)) {
+            updateParticles(e->tParticles, begin, end, e->field, e->t);
+        }
+    } while (steal(e, id));
+}
+
+static void* workerMain(void* arg)
+{
+    worker_t* w = (worker_t*)arg;
+    engine_t* e = w->engine;
+    int generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&e->lock);
+        while (e->generation == generation && !e->quit) {
+            pthread_cond_wait(&e->start, &e->lock);
+        }
+        if (e->quit) {
+            pthread_mutex_unlock(&e->lock);
+            return NULL;
+        }
+        generation = e->generation;
+        pthread_mutex_unlock(&e->lock);
+
+        work(e, w->id);
+
+        pthread_mutex_lock(&e->lock);
+        if (--e->pending == 0) {
+            pthread_cond_signal(&e->done);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+/*
+ * Creates an engine which updates test particles using the given number of
+ * threads (including the calling thread).
+ */
+engine_t* engineCreate(int numThreads)
+{
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+
+    engine_t* e = (engine_t*)calloc(1, sizeof(engine_t));
+    e->numThreads = numThreads;
+    e->queues = (queue_t*)calloc(numThreads, sizeof(queue_t));
+    e->workers = (worker_t*)calloc(numThreads, sizeof(worker_t));
+    e->threads = (pthread_t*)calloc(numThreads, sizeof(pthread_t));
+    if (e->queues == NULL || e->workers == NULL || e->threads == NULL) {
+        fprintf(stderr, "Error allocating memory for engine\n");
+        exit(-1);
+    }
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->start, NULL);
+    pthread_cond_init(&e->done, NULL);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_mutex_init(&e->queues[i].lock, NULL);
+        e->workers[i].engine = e;
+        e->workers[i].id = i;
+    }
+
+    // worker 0 is the thread calling engineStep()
+    for (int i = 1; i < numThreads; i++) {
+        if (pthread_create(&e->threads[i], NULL, workerMain,
+                           &e->workers[i]) != 0) {
+            fprintf(stderr, "Error creating worker thread\n");
+            exit(-1);
+        }
+    }
+
+    return e;
+}
+
+/*
+ * Updates every test particle once. The test particles are split evenly
+ * between the workers, which steal from each other when they run out of
+ * work. Returns after all test particles have been updated.
+ */
+void engineStep(engine_t* e, tparticles_t* tParticles, const field_t* field,
+                float t)
+{
+    const int numTParticles = tParticles->n;
+    e->tParticles = tParticles;
+    e->field = field;
+    e->t = t;
+
+    for (int i = 0; i < e->numThreads; i++) {
+        e->queues[i].begin = (int)((long long)numTParticles * i / e->numThreads);
+        e->queues[i].end = (int)((long long)numTParticles * (i + 1) / e->numThreads);
+    }
+
+    pthread_mutex_lock(&e->lock);
+    e->pending = e->numThreads - 1;
+    e->generation++;
+    pthread_cond_broadcast(&e->start);
+    pthread_mutex_unlock(&e->lock);
+
+    work(e, 0);
+
+    // wait for the other workers to finish this step
+    pthread_mutex_lock(&e->lock);
+    while (e->pending > 0) {
+        pthread_cond_wait(&e->done, &e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+void engineDestroy(engine_t* e)
+{
+    pthread_mutex_lock(&e->lock);
+    e->quit = 1;
+    pthread_cond_broadcast(&e->start);
+    pthread_mutex_unlock(&e->lock);
+
+    for (int i = 1; i < e->numThreads; i++) {
+        pthread_join(e->threads[i], NULL);
+    }
+    for (int i = 0; i < e->numThreads; i++) {
+        pthread_mutex_destroy(&e->queues[i].lock);
+    }
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->start);
+    pthread_cond_destroy(&e->done);
+
+    free(e->queues);
+    free(e->workers);
+    free(e->threads);
+    free(e);
+}
@@ -0,0 +1,12 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "particle.h"
+
+typedef struct engine engine_t;
+
+engine_t* engineCreate(int);
+void engineStep(engine_t*, tparticles_t*, const field_t*, float);
+void engineDestroy(engine_t*);
+
+#endif
@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/opencl.h>
+
+#include "oclSetup.h"
+#include "options.h"
+#include "dataset.h"
+#include "timer.h"
+#include "profile.h"
+#include "packed.h"
+
+// longest name and dataset path of a job
+#define MAX_NAME 64
+#define MAX_PATH 4096
+
+/*
+ * One simulation of the ensemble: count test particles advanced by
+ * iterations time steps of timeStep. The test particles are the first
+ * count of the dataset file, or random ones from srand(seed) if file is
+ * empty. index is the position of the job in the job file and first the
+ * index of its first test particle in the shared buffer.
+ */
+typedef struct {
+    char name[MAX_NAME];
+    int count;
+    int iterations;
+    float timeStep;
+    unsigned int seed;
+    char file[MAX_PATH];
+    int index;
+    int first;
+} job_t;
+
+/*
+ * Reads the jobs from a text file with one job per line:
+ *     NAME COUNT ITERATIONS TIMESTEP [seed:N | file:PATH]
+ * Empty lines and lines starting with # are skipped. Without the last
+ * field, a job uses the seed of its position in the file (1 for the first
+ * job). Stores the number of jobs in numJobs.
+ */
+static job_t* readJobs(const char* filename, int* numJobs)
+{
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening file: %s\n", filename);
+        exit(-1);
+    }
+
+    job_t* jobs = NULL;
+    int n = 0;
+    int capacity = 0;
+    char line[MAX_PATH + 256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineNumber++;
+        char* p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+        if (n == capacity) {
+            capacity = capacity > 0 ? 2*capacity : 16;
+            jobs = (job_t*)realloc(jobs, capacity*sizeof(job_t));
+            if (jobs == NULL) {
+                fprintf(stderr, "Error allocating memory for jobs\n");
+                exit(-1);
+            }
+        }
+        job_t* job = &jobs[n];
+        memset(job, 0, sizeof(job_t));
+        char source[MAX_PATH + 8] = "";
+        int fields = sscanf(p, "%63s %d %d %f %4103s", job->name, &job->count,
+                            &job->iterations, &job->timeStep, source);
+        if (fields < 4 || job->count < 1 || job->iterations < 0) {
+            fprintf(stderr, "%s:%d: expected NAME COUNT ITERATIONS "
+                    "TIMESTEP [seed:N | file:PATH]\n", filename, lineNumber);
+            exit(-1);
+        }
+        job->index = n;
+        job->seed = n + 1;
+        if (strncmp(source, "seed:", 5) == 0) {
+            job->seed = (unsigned int)strtoul(source + 5, NULL, 10);
+        } else if (strncmp(source, "file:", 5) == 0) {
+            if (strlen(source + 5) >= sizeof(job->file)) {
+                fprintf(stderr, "%s:%d: file name too long\n", filename,
+                        lineNumber);
+                exit(-1);
+            }
+            strcpy(job->file, source + 5);
+        } else if (source[0] != '\0') {
+            fprintf(stderr, "%s:%d: unknown initial conditions %s\n",
+                    filename, lineNumber, source);
+            exit(-1);
+        }
+        n++;
+    }
+    fclose(fp);
+    if (n == 0) {
+        fprintf(stderr, "No jobs in %s\n", filename);
+        exit(-1);
+    }
+    *numJobs = n;
+    return jobs;
+}
+
+/*
+ * Orders jobs by decreasing number of iterations, keeping the order of the
+ * file among jobs with the same number.
+ */
+static int compareJobs(const void* a, const void* b)
+{
+    const job_t* ja = (const job_t*)a;
+    const job_t* jb = (const job_t*)b;
+    if (ja->iterations != jb->iterations) {
+        return jb->iterations - ja->iterations;
+    }
+    return ja->index - jb->index;
+}
+
+/*
+ * Orders jobs as in the job file.
+ */
+static int compareIndex(const void* a, const void* b)
+{
+    return ((const job_t*)a)->index - ((const job_t*)b)->index;
+}
+
+/*
+ * Writes the test particles of a job to DIR/NAME.csv, one per line as
+ * x,y,z,m,vx,vy,vz, which csv2bin reads as test particles.
+ */
+static void writeJob(const char* dir, const job_t* job,
+                     const cl_float8* tParticles)
+{
+    char path[MAX_PATH + MAX_NAME + 8];
+    int length = snprintf(path, sizeof(path), "%s/%s.csv", dir, job->name);
+    if (length < 0 || (size_t)length >= sizeof(path)) {
+        fprintf(stderr, "Output directory name too long: %s\n", dir);
+        exit(-1);
+    }
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(-1);
+    }
+    for (int i = 0; i < job->count; i++) {
+        const float* s = tParticles[job->first + i].s;
+        fprintf(fp, "%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n",
+                s[0], s[1], s[2], s[3], s[4], s[5], s[6]);
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        exit(-1);
+    }
+}
+
+/*
+ * Runs an ensemble of independent simulations (jobs) against the same
+ * pseudo-particles in one process. The pseudo-particles are created or
+ * read and uploaded once, and the test particles of all jobs share one
+ * buffer and one kernel launch per time step, with the time step of each
+ * test particle taken from its job. The jobs are stored by decreasing
+ * number of iterations, so the test particles which still have steps left
+ * are always a prefix of the buffer and each launch only covers them.
+ */
+int main(int argc, char* argv[])
+{
+    // options
+    ocl_options_t oclOptions;
+    takeOclOptions(&argc, argv, &oclOptions);
+    char* inputFile = takeOption(&argc, argv, "--input");
+    char* outputDir = takeOption(&argc, argv, "--output");
+    char* batchOption = takeOption(&argc, argv, "--batch");
+    const int batch = batchOption ? atoi(batchOption) : 1;
+    char* unrollOption = takeOption(&argc, argv, "--unroll");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    const int profileFlag = takeFlag(&argc, argv, "--profile");
+    char* traceFile = takeOption(&argc, argv, "--trace");
+
+    if (argc != 5) {
+        fprintf(stderr, "requires 4 command line arguments:\n");
+        fprintf(stderr, "\tlocal work group size (test particles, work-items per test particle)\n");
+        fprintf(stderr, "\t#pseudo-particles\n");
+        fprintf(stderr, "\tjob file, one job per line: NAME COUNT ITERATIONS TIMESTEP [seed:N | file:PATH]\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--platform P\tOpenCL platform, by index or name\n");
+        fprintf(stderr, "\t--device-type T\tgpu (default if there is one), cpu, accelerator or all\n");
+        fprintf(stderr, "\t--device D\tindex of the device of that type\n");
+        fprintf(stderr, "\t--cache DIR\treuse the compiled kernels from earlier runs\n");
+        fprintf(stderr, "\t--unroll U\tunroll factor of the kernel loop (default 4)\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--input FILE\tread the pseudo-particles from a dataset file\n");
+        fprintf(stderr, "\t--output DIR\twrite the test particles of each job to DIR/NAME.csv\n");
+        fprintf(stderr, "\t--batch K\twait for the device every K steps (default 1, 0 = only at the end)\n");
+        fprintf(stderr, "\t--profile\tprint the time spent in each phase\n");
+        fprintf(stderr, "\t--trace FILE\twrite the phases as a Chrome trace\n");
+        exit(-1);
+    }
+
+    // time spent in each phase of the run; the device phases are measured
+    // by the command queue and wait is the time the host waits for them
+    profile_t* profile = profileCreate(profileFlag, traceFile);
+    phase_t* setupPhase = profilePhase(profile, "setup");
+    phase_t* uploadPhase = profilePhase(profile, "upload");
+    phase_t* stepPhase = profilePhase(profile, "step");
+    phase_t* waitPhase = profilePhase(profile, "wait");
+    phase_t* readbackPhase = profilePhase(profile, "readback");
+    phase_t* outputPhase = profilePhase(profile, "output");
+    oclOptions.profiling = profile != NULL;
+    double setupBegin = wallTime();
+    cl_event event;
+
+    const int numPParticles = atoi(argv[3]);
+    int numJobs;
+    job_t* jobs = readJobs(argv[4], &numJobs);
+    qsort(jobs, numJobs, sizeof(job_t), compareJobs);
+    int numTParticles = 0;
+    for (int j = 0; j < numJobs; j++) {
+        jobs[j].first = numTParticles;
+        numTParticles += jobs[j].count;
+    }
+    // the first job has the most iterations
+    const int iterations = jobs[0].iterations;
+
+    // localSize[0] test particles per work-group, localSize[1] work-items
+    // per test particle, so there is a single work-group in dimension 1
+    size_t localSize[2] = {atoi(argv[1]), atoi(argv[2])};
+
+    const char* precision = precisionOption ? precisionOption : "float";
+    const int useKahan = strcmp(precision, "kahan") == 0;
+    const int useDouble = strcmp(precision, "double") == 0;
+    if (!useKahan && !useDouble && strcmp(precision, "float") != 0) {
+        fprintf(stderr, "Unknown precision %s\n", precision);
+        exit(-1);
+    }
+    const int storage = storageOption ? parseStorage(storageOption)
+                                      : STORAGE_FLOAT;
+    if (storage < 0) {
+        fprintf(stderr, "Unknown storage %s\n", storageOption);
+        exit(-1);
+    }
+    if (storage != STORAGE_FLOAT && (useKahan || useDouble)) {
+        fprintf(stderr, "--storage requires --precision float\n");
+        exit(-1);
+    }
+
+    // in the order of the INTEGRATOR_ constants in oclNBody_multiple.cl
+    const char* integrators[] = {"euler", "leapfrog", "rk4", "adaptive"};
+    const char* integratorName = integratorOption ? integratorOption : "euler";
+    int integrator = 0;
+    while (integrator < 4
+            && strcmp(integratorName, integrators[integrator]) != 0) {
+        integrator++;
+    }
+    if (integrator == 4) {
+        fprintf(stderr, "Unknown integrator %s\n", integratorName);
+        exit(-1);
+    }
+    const float tolerance = toleranceOption ? (float)atof(toleranceOption)
+                                            : 1e-6f;
+
+    cl_int err;
+    cl_platform_id cpPlatform;
+    cl_device_id device_id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+
+    // the number of test particles changes as jobs finish and the time
+    // step is per test particle, so only the rest is compiled in
+    char buildOptions[512];
+    int len = snprintf(buildOptions, sizeof(buildOptions),
+                       "-DUNROLL=%d%s%s -DINTEGRATOR=%d -DTOLERANCE=%af"
+                       " -DPARTICLE_STEPS -DNUM_PSEUDO=%du"
+                       " -DLOCAL_SIZE_0=%u -DLOCAL_SIZE_1=%u",
+                       unrollOption ? atoi(unrollOption) : 4,
+                       useDouble ? " -DUSE_DOUBLE" : "",
+                       useKahan ? " -DUSE_KAHAN" : "", integrator, tolerance,
+                       numPParticles, (unsigned)localSize[0],
+                       (unsigned)localSize[1]);
+    if (storage != STORAGE_FLOAT) {
+        snprintf(buildOptions + len, sizeof(buildOptions) - len,
+                 " -DSTORAGE=%d -DCELL_SIZE=%d", storage, CELL_SIZE);
+    }
+    // size of an element of the tile in the kernel
+    const size_t realSize = useDouble ? 4*sizeof(cl_double)
+                                      : 4*sizeof(cl_float);
+
+    oclSetup(&cpPlatform, &device_id, &context, &queue,
+             &program, "oclNBody_multiple.cl", buildOptions, &oclOptions);
+
+    // pseudo-particles read from a file, instead of random ones
+    dataset_t* input = NULL;
+    if (inputFile != NULL) {
+        input = readDataset(inputFile);
+        if (numPParticles > input->numPParticles) {
+            fprintf(stderr, "%s only has %d pseudo-particles\n", inputFile,
+                    input->numPParticles);
+            exit(-1);
+        }
+    }
+
+    // initialize pseduo-particles
+    size_t pParticles_size = numPParticles*sizeof(cl_float4);
+    cl_float4* h_pParticles = (cl_float4*)malloc(pParticles_size);
+    for (int i = 0; i < numPParticles; i++) {
+        if (input != NULL) {
+            cl_float4 temp = {{input->x[i], input->y[i],
+                               input->z[i], input->m[i]}};
+            h_pParticles[i] = temp;
+            continue;
+        }
+        cl_float4 temp = {{rand(), rand(), rand(), rand()}};
+        h_pParticles[i] = temp;
+    }
+    if (input != NULL) {
+        freeDataset(input);
+    }
+
+    // initialize the test particles of every job and their time steps
+    size_t tParticles_size = numTParticles*sizeof(cl_float8);
+    cl_float8* h_tParticles = (cl_float8*)malloc(tParticles_size);
+    float* h_timeSteps = (float*)malloc(numTParticles*sizeof(float));
+    for (int j = 0; j < numJobs; j++) {
+        const job_t* job = &jobs[j];
+        cl_float8* ps = h_tParticles + job->first;
+        dataset_t* d = NULL;
+        if (job->file[0] != '\0') {
+            d = readDataset(job->file);
+            if (job->count > d->numTParticles) {
+                fprintf(stderr, "%s only has %d test particles\n", job->file,
+                        d->numTParticles);
+                exit(-1);
+            }
+        } else {
+            srand(job->seed);
+        }
+        for (int i = 0; i < job->count; i++) {
+            h_timeSteps[job->first + i] = job->timeStep;
+            if (d != NULL) {
+                cl_float8 temp = {{d->tx[i],  d->ty[i],  d->tz[i],
+                                   d->tm[i],  d->tvx[i], d->tvy[i],
+                                   d->tvz[i], 0.0f                 }};
+                ps[i] = temp;
+                continue;
+            }
+            cl_float8 temp = {{rand(),   rand(),   rand(),   rand() % 500,
+                               rand()%5, rand()%5, rand()%5, 0.0f       }};
+            ps[i] = temp;
+        }
+        if (d != NULL) {
+            freeDataset(d);
+        }
+    }
+
+    // with 16-bit storage the device gets the packed pseudo-particles and
+    // their cells instead (see packed.h)
+    packed_t* packed = NULL;
+    const void* pseudoData = h_pParticles;
+    size_t pseudoSize = pParticles_size;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(&h_pParticles[0].s[0], &h_pParticles[0].s[1],
+                            &h_pParticles[0].s[2], &h_pParticles[0].s[3], 4,
+                            numPParticles, storage);
+        pseudoData = packed->data;
+        pseudoSize = 4*(size_t)numPParticles*sizeof(cl_ushort);
+
+        // how far the 16-bit storage moves the accelerations
+        double maxError, rmsError;
+        packError(packed, &h_pParticles[0].s[0], &h_pParticles[0].s[1],
+                  &h_pParticles[0].s[2], &h_pParticles[0].s[3], 4,
+                  &h_tParticles[0].s[0], &h_tParticles[0].s[1],
+                  &h_tParticles[0].s[2], 8, numTParticles, &maxError,
+                  &rmsError);
+        printf("storage: %s, relative error of the acceleration: "
+               "max %.3e, rms %.3e\n", storageName(storage), maxError,
+               rmsError);
+    }
+
+    // create buffers
+    cl_mem d_pParticles = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                         pseudoSize, NULL, &err);
+    cl_mem d_tParticles = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                         tParticles_size, NULL, &err);
+    cl_mem d_timeSteps = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                        numTParticles*sizeof(cl_float),
+                                        NULL, &err);
+    cl_mem d_cells = NULL;
+    if (packed != NULL && err == 0) {
+        d_cells = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                 packed->numCells*CELL_FIELDS*sizeof(cl_float),
+                                 NULL, &err);
+    }
+    if (err != 0) {
+        fprintf(stderr, "Error creating buffers\n");
+        exit(-1);
+    }
+    double setup = wallTime() - setupBegin;
+    profileEnd(setupPhase, setupBegin);
+
+    // copy data to device
+    err  = clEnqueueWriteBuffer(queue, d_pParticles, CL_TRUE, 0,
+                                pseudoSize, pseudoData, 0,
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    if (packed != NULL) {
+        err |= clEnqueueWriteBuffer(queue, d_cells, CL_TRUE, 0,
+                                    packed->numCells*CELL_FIELDS
+                                    *sizeof(cl_float), packed->cells, 0,
+                                    NULL, uploadPhase ? &event : NULL);
+        oclProfile(uploadPhase, event);
+    }
+    err |= clEnqueueWriteBuffer(queue, d_tParticles, CL_TRUE, 0,
+                                tParticles_size, h_tParticles, 0,
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    err |= clEnqueueWriteBuffer(queue, d_timeSteps, CL_TRUE, 0,
+                                numTParticles*sizeof(cl_float), h_timeSteps,
+                                0, NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    if (err != 0) {
+        fprintf(stderr, "Error copying data to device\n");
+        exit(-1);
+    }
+    oclProfileCollect();
+
+    // setup kernel
+    cl_kernel kernel_step = clCreateKernel(program, "step", &err);
+    if (err != 0) {
+        fprintf(stderr, "Error creating kernels\n");
+        exit(-1);
+    }
+
+    // set the arguments for kernel; len1 is set whenever a job finishes
+    // and t is unused with PARTICLE_STEPS
+    const float unused = 0.0f;
+    err  = clSetKernelArg(kernel_step, 0, sizeof(cl_mem), &d_tParticles);
+    err |= clSetKernelArg(kernel_step, 1, sizeof(cl_mem), &d_pParticles);
+    err |= clSetKernelArg(kernel_step, 3, sizeof(int),    &numPParticles);
+    err |= clSetKernelArg(kernel_step, 4, sizeof(float),  &unused);
+    err |= clSetKernelArg(kernel_step, 5, localSize[0]*localSize[1]
+                                          *realSize, NULL);
+    err |= clSetKernelArg(kernel_step, 6, sizeof(cl_mem), &d_timeSteps);
+    if (packed != NULL) {
+        err |= clSetKernelArg(kernel_step, 7, sizeof(cl_mem), &d_cells);
+    }
+    if (err != 0) {
+        fprintf(stderr, "Error setting kernel arguments\n");
+        exit(-1);
+    }
+
+    // execute kernels. The queue runs the launches in order, so steps are
+    // enqueued back to back and the host only waits for the device every
+    // batch steps. The test particles of finished jobs are past the end of
+    // every later launch, so they are all read back at the end.
+    double begin = wallTime();
+    int active = numJobs;
+    int numActive = -1;
+    for (int i = 0; i < iterations; i++) {
+        while (active > 0 && jobs[active - 1].iterations <= i) {
+            active--;
+        }
+        int count = jobs[active - 1].first + jobs[active - 1].count;
+        if (count != numActive) {
+            numActive = count;
+            err = clSetKernelArg(kernel_step, 2, sizeof(int), &numActive);
+            if (err != 0) {
+                fprintf(stderr, "Error setting kernel arguments\n");
+                exit(-1);
+            }
+        }
+        size_t globalSize[2] = {ceil(numActive / (float)localSize[0])
+                                * localSize[0], localSize[1]};
+
+        // compute acceleration and update position
+        err = clEnqueueNDRangeKernel(queue, kernel_step, 2,
+                                     NULL, globalSize, localSize,
+                                     0, NULL, stepPhase ? &event : NULL);
+        if (err) {
+            printf("Error executing step kernel\n");
+        } else {
+            oclProfile(stepPhase, event);
+        }
+
+        if (batch > 0 && (i + 1) % batch == 0) {
+            double waitBegin = profileTime(waitPhase);
+            clFinish(queue);
+            profileEnd(waitPhase, waitBegin);
+            oclProfileCollect();
+        }
+    }
+
+    double waitBegin = profileTime(waitPhase);
+    clFinish(queue);
+    profileEnd(waitPhase, waitBegin);
+    double seconds = wallTime() - begin;
+    oclProfileCollect();
+
+    // copy data from device to host
+    err = clEnqueueReadBuffer(queue, d_tParticles, CL_TRUE, 0,
+                              tParticles_size, h_tParticles, 0,
+                              NULL, readbackPhase ? &event : NULL);
+    if (err != 0) {
+        fprintf(stderr, "error copying data to host\n");
+        exit(-1);
+    }
+    oclProfile(readbackPhase, event);
+    oclProfileCollect();
+
+    // print the final position of the first test particle of each job, in
+    // the order of the job file, and write the results
+    double outputBegin = profileTime(outputPhase);
+    double interactions = 0.0;
+    qsort(jobs, numJobs, sizeof(job_t), compareIndex);
+    for (int j = 0; j < numJobs; j++) {
+        const job_t* job = &jobs[j];
+        const float* s = h_tParticles[job->first].s;
+        printf("%s: %d test particles, %d iterations of %g, "
+               "position: (%.12f, %.12f, %.12f)\n", job->name, job->count,
+               job->iterations, job->timeStep, s[0], s[1], s[2]);
+        if (outputDir != NULL) {
+            writeJob(outputDir, job, h_tParticles);
+        }
+        interactions += (double)job->count*numPParticles*job->iterations;
+    }
+    profileEnd(outputPhase, outputBegin);
+
+    printf("jobs: %d with %d test particles, setup %.3f s\n", numJobs,
+           numTParticles, setup);
+    printf("time: %.3f s, %.3e interactions/s (opencl, %s, %s)\n", seconds,
+           interactions / seconds, precision, integratorName);
+    profileReport(profile, stdout);
+    if (packed != NULL) {
+        packFree(packed);
+    }
+    free(jobs);
+}
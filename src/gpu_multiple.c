@@ -1,9 +1,70 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
-#include <Cl/opencl.h>
+#include <string.h>
+#include <math.h>
+#include <CL/opencl.h>
 
 #include "oclSetup.h"
+#include "options.h"
+#include "dataset.h"
+#include "timer.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "mapfile.h"
+#include "profile.h"
+#include "packed.h"
+
+/*
+ * Copies the state of the recorded test particles into the next trajectory
+ * snapshot.
+ */
+static void recordSnapshot(trajectory_t* tr, cl_float8* tParticles,
+                           int iteration)
+{
+    int first = trajectoryFirst(tr);
+    int count = trajectoryCount(tr);
+    float* snapshot = trajectoryBegin(tr);
+    for (int j = 0; j < count; j++) {
+        const cl_float8* p = &tParticles[first + j];
+        snapshot[j] = p->s[0];
+        snapshot[count + j] = p->s[1];
+        snapshot[2*count + j] = p->s[2];
+        snapshot[3*count + j] = p->s[4];
+        snapshot[4*count + j] = p->s[5];
+        snapshot[5*count + j] = p->s[6];
+    }
+    trajectoryCommit(tr, iteration);
+}
+
+/*
+ * Copies the state of all test particles into the next checkpoint. The
+ * size of the next step with an adaptive integrator is kept in s7.
+ */
+static void saveCheckpoint(checkpoint_t* ck, cl_float8* tParticles,
+                           int numTParticles, int iteration)
+{
+    float* state = checkpointBegin(ck);
+    for (int j = 0; j < numTParticles; j++) {
+        for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+            state[k*numTParticles + j] = tParticles[j].s[k];
+        }
+    }
+    checkpointCommit(ck, iteration);
+}
+
+/*
+ * Restores the state of all test particles from a checkpoint.
+ */
+static void restoreCheckpoint(const float* state, cl_float8* tParticles,
+                              int numTParticles)
+{
+    for (int j = 0; j < numTParticles; j++) {
+        for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+            tParticles[j].s[k] = state[k*numTParticles + j];
+        }
+    }
+}
+
 /*
  * Creates a number of "pseudo-particles" which have an x-, y-, and z-coordiate
  * and a mass. These pseudo-particles do not move but they interact
@@ -12,22 +73,116 @@
  */
 int main(int argc, char* argv[])
 {
+    // options
+    ocl_options_t oclOptions;
+    takeOclOptions(&argc, argv, &oclOptions);
+    char* inputFile = takeOption(&argc, argv, "--input");
+    char* trajectoryFile = takeOption(&argc, argv, "--trajectory");
+    char* strideOption = takeOption(&argc, argv, "--stride");
+    char* subsetOption = takeOption(&argc, argv, "--subset");
+    char* checkpointFile = takeOption(&argc, argv, "--checkpoint");
+    char* everyOption = takeOption(&argc, argv, "--checkpoint-every");
+    const int resume = takeFlag(&argc, argv, "--resume");
+    char* batchOption = takeOption(&argc, argv, "--batch");
+    const int batch = batchOption ? atoi(batchOption) : 1;
+    const int generic = takeFlag(&argc, argv, "--generic");
+    char* unrollOption = takeOption(&argc, argv, "--unroll");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    const int profileFlag = takeFlag(&argc, argv, "--profile");
+    char* traceFile = takeOption(&argc, argv, "--trace");
+
     if (argc != 7) {
         fprintf(stderr, "requires 6 command line arguments:\n");
-        fprintf(stderr, "\tlocal work group size (2 dimensions)\n");
+        fprintf(stderr, "\tlocal work group size (test particles, work-items per test particle)\n");
         fprintf(stderr, "\t#test particles\n\t#pseudo-particles\n");
         fprintf(stderr, "\t#iterations\n\tsize of time step\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--platform P\tOpenCL platform, by index or name\n");
+        fprintf(stderr, "\t--device-type T\tgpu (default if there is one), cpu, accelerator or all\n");
+        fprintf(stderr, "\t--device D\tindex of the device of that type\n");
+        fprintf(stderr, "\t--cache DIR\treuse the compiled kernels from earlier runs\n");
+        fprintf(stderr, "\t--generic\tdo not compile the problem size into the kernel\n");
+        fprintf(stderr, "\t--unroll U\tunroll factor of the kernel loop (default 4)\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+        fprintf(stderr, "\t--trajectory FILE\twrite the trajectories of the test particles\n");
+        fprintf(stderr, "\t--stride K\trecord every K iterations (default 1)\n");
+        fprintf(stderr, "\t--subset FIRST:COUNT\trecord only COUNT test particles\n");
+        fprintf(stderr, "\t--checkpoint FILE\tsave the test particles periodically\n");
+        fprintf(stderr, "\t--checkpoint-every K\tsave every K iterations (default 100)\n");
+        fprintf(stderr, "\t--resume\tcontinue from the checkpoint, if there is one\n");
+        fprintf(stderr, "\t--batch K\twait for the device every K steps (default 1, 0 = only for output)\n");
+        fprintf(stderr, "\t--profile\tprint the time spent in each phase\n");
+        fprintf(stderr, "\t--trace FILE\twrite the phases as a Chrome trace\n");
         exit(-1);
     }
+    if (resume && checkpointFile == NULL) {
+        fprintf(stderr, "--resume requires --checkpoint\n");
+        exit(-1);
+    }
+
+    // time spent in each phase of the run; the device phases are measured
+    // by the command queue and wait is the time the host waits for them
+    profile_t* profile = profileCreate(profileFlag, traceFile);
+    phase_t* setupPhase = profilePhase(profile, "setup");
+    phase_t* uploadPhase = profilePhase(profile, "upload");
+    phase_t* stepPhase = profilePhase(profile, "step");
+    phase_t* waitPhase = profilePhase(profile, "wait");
+    phase_t* readbackPhase = profilePhase(profile, "readback");
+    phase_t* outputPhase = profilePhase(profile, "output");
+    oclOptions.profiling = profile != NULL;
+    double setupBegin = profileTime(setupPhase);
+    cl_event event;
 
     const int numTParticles = atoi(argv[3]);
     const int numPParticles = atoi(argv[4]);
     const int iterations = atoi(argv[5]);
     const float timeStep = (float)atof(argv[6]);
 
+    // localSize[0] test particles per work-group, localSize[1] work-items
+    // per test particle, so there is a single work-group in dimension 1
     size_t localSize[2] = {atoi(argv[1]), atoi(argv[2])};
     size_t globalSize[2] = {ceil(numTParticles / (float)localSize[0]) * localSize[0],
-                            ceil(numPParticles / (float)localSize[1]) * localSize[1]};
+                            localSize[1]};
+
+    const char* precision = precisionOption ? precisionOption : "float";
+    const int useKahan = strcmp(precision, "kahan") == 0;
+    const int useDouble = strcmp(precision, "double") == 0;
+    if (!useKahan && !useDouble && strcmp(precision, "float") != 0) {
+        fprintf(stderr, "Unknown precision %s\n", precision);
+        exit(-1);
+    }
+    const int storage = storageOption ? parseStorage(storageOption)
+                                      : STORAGE_FLOAT;
+    if (storage < 0) {
+        fprintf(stderr, "Unknown storage %s\n", storageOption);
+        exit(-1);
+    }
+    if (storage != STORAGE_FLOAT && (useKahan || useDouble)) {
+        fprintf(stderr, "--storage requires --precision float\n");
+        exit(-1);
+    }
+
+    // in the order of the INTEGRATOR_ constants in oclNBody_multiple.cl
+    const char* integrators[] = {"euler", "leapfrog", "rk4", "adaptive"};
+    const char* integratorName = integratorOption ? integratorOption : "euler";
+    int integrator = 0;
+    while (integrator < 4
+            && strcmp(integratorName, integrators[integrator]) != 0) {
+        integrator++;
+    }
+    if (integrator == 4) {
+        fprintf(stderr, "Unknown integrator %s\n", integratorName);
+        exit(-1);
+    }
+    const float tolerance = toleranceOption ? (float)atof(toleranceOption)
+                                            : 1e-6f;
 
     cl_int err;
     cl_platform_id cpPlatform;
@@ -36,13 +191,54 @@ int main(int argc, char* argv[])
     cl_command_queue queue;
     cl_program program;
 
+    // compile the problem constants into the kernel (see oclNBody_multiple.cl)
+    char buildOptions[512];
+    int len = snprintf(buildOptions, sizeof(buildOptions),
+                       "-DUNROLL=%d%s%s -DINTEGRATOR=%d -DTOLERANCE=%af",
+                       unrollOption ? atoi(unrollOption) : 4,
+                       useDouble ? " -DUSE_DOUBLE" : "",
+                       useKahan ? " -DUSE_KAHAN" : "", integrator, tolerance);
+    if (storage != STORAGE_FLOAT) {
+        len += snprintf(buildOptions + len, sizeof(buildOptions) - len,
+                        " -DSTORAGE=%d -DCELL_SIZE=%d", storage, CELL_SIZE);
+    }
+    if (!generic) {
+        snprintf(buildOptions + len, sizeof(buildOptions) - len,
+                 " -DNUM_TEST=%du -DNUM_PSEUDO=%du -DTIME_STEP=%af"
+                 " -DLOCAL_SIZE_0=%u -DLOCAL_SIZE_1=%u", numTParticles,
+                 numPParticles, timeStep, (unsigned)localSize[0],
+                 (unsigned)localSize[1]);
+    }
+    // size of an element of the tile in the kernel
+    const size_t realSize = useDouble ? 4*sizeof(cl_double)
+                                      : 4*sizeof(cl_float);
+
     oclSetup(&cpPlatform, &device_id, &context, &queue,
-             &program, "oclNBody_multiple.cl");
+             &program, "oclNBody_multiple.cl", buildOptions, &oclOptions);
+
+    // particles read from a file, instead of random ones
+    dataset_t* input = NULL;
+    if (inputFile != NULL) {
+        input = readDataset(inputFile);
+        if (numTParticles > input->numTParticles
+                || numPParticles > input->numPParticles) {
+            fprintf(stderr, "%s only has %d test particles and %d "
+                    "pseudo-particles\n", inputFile, input->numTParticles,
+                    input->numPParticles);
+            exit(-1);
+        }
+    }
 
     // initialize pseduo-particles
     size_t pParticles_size = numPParticles*sizeof(cl_float4);
     cl_float4* h_pParticles = (cl_float4*)malloc(pParticles_size);
     for (int i = 0; i < numPParticles; i++) {
+        if (input != NULL) {
+            cl_float4 temp = {{input->x[i], input->y[i],
+                               input->z[i], input->m[i]}};
+            h_pParticles[i] = temp;
+            continue;
+        }
         cl_float4 temp = {{rand(), rand(), rand(), rand()}};
         h_pParticles[i] = temp;
     }
@@ -51,78 +247,131 @@ int main(int argc, char* argv[])
     size_t tParticles_size = numTParticles*sizeof(cl_float8);
     cl_float8* h_tParticles = (cl_float8*)malloc(tParticles_size);
     for (int i = 0; i < numTParticles; i++) {
+        if (input != NULL) {
+            cl_float8 temp = {{input->tx[i],  input->ty[i],  input->tz[i],
+                               input->tm[i],  input->tvx[i], input->tvy[i],
+                               input->tvz[i], 0.0f                         }};
+            h_tParticles[i] = temp;
+            continue;
+        }
         cl_float8 temp = {{rand(),   rand(),   rand(),   rand() % 500,
                            rand()%5, rand()%5, rand()%5, 0.0f       }};
         h_tParticles[i] = temp;
     }
+    if (input != NULL) {
+        freeDataset(input);
+    }
+
+    // with 16-bit storage the device gets the packed pseudo-particles and
+    // their cells instead (see packed.h)
+    packed_t* packed = NULL;
+    const void* pseudoData = h_pParticles;
+    size_t pseudoSize = pParticles_size;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(&h_pParticles[0].s[0], &h_pParticles[0].s[1],
+                            &h_pParticles[0].s[2], &h_pParticles[0].s[3], 4,
+                            numPParticles, storage);
+        pseudoData = packed->data;
+        pseudoSize = 4*(size_t)numPParticles*sizeof(cl_ushort);
+
+        // how far the 16-bit storage moves the accelerations
+        double maxError, rmsError;
+        packError(packed, &h_pParticles[0].s[0], &h_pParticles[0].s[1],
+                  &h_pParticles[0].s[2], &h_pParticles[0].s[3], 4,
+                  &h_tParticles[0].s[0], &h_tParticles[0].s[1],
+                  &h_tParticles[0].s[2], 8, numTParticles, &maxError,
+                  &rmsError);
+        printf("storage: %s, relative error of the acceleration: "
+               "max %.3e, rms %.3e\n", storageName(storage), maxError,
+               rmsError);
+    }
 
+    // continue where an earlier run of the same simulation stopped
+    checkpoint_t* checkpoint = NULL;
+    const int checkpointEvery = everyOption ? atoi(everyOption) : 100;
+    int start = 0;
+    if (checkpointFile != NULL) {
+        if (checkpointEvery < 1) {
+            fprintf(stderr, "Invalid checkpoint interval\n");
+            exit(-1);
+        }
+        // the work group size changes the order of the summation
+        uint64_t runHash = hashBytes(HASH_SEED, h_pParticles, pParticles_size);
+        runHash = hashBytes(runHash, localSize, sizeof(localSize));
+        runHash = hashBytes(runHash, buildOptions, strlen(buildOptions));
+        if (resume) {
+            float* state = readCheckpoint(checkpointFile, numTParticles,
+                                          numPParticles, timeStep, runHash,
+                                          &start);
+            if (state != NULL) {
+                restoreCheckpoint(state, h_tParticles, numTParticles);
+                free(state);
+                printf("resuming after iteration %d\n", start);
+            }
+        }
+        checkpoint = checkpointOpen(checkpointFile, numTParticles,
+                                    numPParticles, timeStep, runHash);
+    }
 
     // create buffers
     cl_mem d_pParticles = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                         pParticles_size, NULL, &err);
+                                         pseudoSize, NULL, &err);
     cl_mem d_tParticles = clCreateBuffer(context, CL_MEM_READ_WRITE,
                                          tParticles_size, NULL, &err);
-    cl_mem d_accel      = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                         numTParticles*numPParticles*sizeof(cl_float4),
-                                         NULL, &err);
+    cl_mem d_cells = NULL;
+    if (packed != NULL && err == 0) {
+        d_cells = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                 packed->numCells*CELL_FIELDS*sizeof(cl_float),
+                                 NULL, &err);
+    }
     if (err != 0) {
         fprintf(stderr, "Error creating buffers\n");
         exit(-1);
     }
-
+    profileEnd(setupPhase, setupBegin);
 
     // copy data to device
     err  = clEnqueueWriteBuffer(queue, d_pParticles, CL_TRUE, 0,
-                                pParticles_size, h_pParticles, 0,
-                                NULL, NULL);
+                                pseudoSize, pseudoData, 0,
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    if (packed != NULL) {
+        err |= clEnqueueWriteBuffer(queue, d_cells, CL_TRUE, 0,
+                                    packed->numCells*CELL_FIELDS
+                                    *sizeof(cl_float), packed->cells, 0,
+                                    NULL, uploadPhase ? &event : NULL);
+        oclProfile(uploadPhase, event);
+    }
     err |= clEnqueueWriteBuffer(queue, d_tParticles, CL_TRUE, 0,
                                 tParticles_size, h_tParticles, 0,
-                                NULL, NULL);
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
     if (err != 0) {
         fprintf(stderr, "Error copying data to device\n");
         exit(-1);
     }
+    oclProfileCollect();
 
-    // setup kernels
-    cl_kernel kernel_compute = clCreateKernel(program, "compute", &err);
-    cl_kernel kernel_reduce  = clCreateKernel(program, "reduce",  &err);
-    cl_kernel kernel_update  = clCreateKernel(program, "update",  &err);
+    // setup kernel
+    cl_kernel kernel_step = clCreateKernel(program, "step", &err);
     if (err != 0) {
         fprintf(stderr, "Error creating kernels\n");
         exit(-1);
     }
 
-    // set the arguments for kernels
-    err  = clSetKernelArg(kernel_compute, 0, sizeof(cl_mem), &d_tParticles);
-    err |= clSetKernelArg(kernel_compute, 1, sizeof(cl_mem), &d_pParticles);
-
-    if (err != 0) {
-        fprintf(stderr, "Error setting 1  kernel arguments\n");
-        exit(-1);
+    // set the arguments for kernel
+    err  = clSetKernelArg(kernel_step, 0, sizeof(cl_mem), &d_tParticles);
+    err |= clSetKernelArg(kernel_step, 1, sizeof(cl_mem), &d_pParticles);
+    err |= clSetKernelArg(kernel_step, 2, sizeof(int),    &numTParticles);
+    err |= clSetKernelArg(kernel_step, 3, sizeof(int),    &numPParticles);
+    err |= clSetKernelArg(kernel_step, 4, sizeof(float),  &timeStep);
+    err |= clSetKernelArg(kernel_step, 5, localSize[0]*localSize[1]
+                                          *realSize, NULL);
+    if (packed != NULL) {
+        err |= clSetKernelArg(kernel_step, 6, sizeof(cl_mem), &d_cells);
     }
-    err |= clSetKernelArg(kernel_compute, 2, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_compute, 3, sizeof(int),    &numTParticles);
-    err |= clSetKernelArg(kernel_compute, 4, sizeof(int),    &numPParticles);
-
-    err  = clSetKernelArg(kernel_reduce, 0, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_reduce, 1, sizeof(int),    &numTParticles);
-    err |= clSetKernelArg(kernel_reduce, 2, sizeof(int),    &numPParticles);
-    err |= clSetKernelArg(kernel_reduce, 3, localSize[0]*localSize[1]
-                                            *sizeof(cl_float4), NULL);
-
     if (err != 0) {
-        printf("%d", err);
-        fprintf(stderr, "Error setting 2 kernel arguments\n");
-        exit(-1);
-    }
-    err  = clSetKernelArg(kernel_update, 0, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_update, 1, sizeof(cl_mem), &d_tParticles);
-    err |= clSetKernelArg(kernel_update, 2, sizeof(int),    &numTParticles);
-    err |= clSetKernelArg(kernel_update, 3, sizeof(int),    &numPParticles);
-    err |= clSetKernelArg(kernel_update, 4, sizeof(float),  &timeStep);
-
-    if (err != 0) {
-        fprintf(stderr, "Error setting  3 kernel arguments\n");
+        fprintf(stderr, "Error setting kernel arguments\n");
         exit(-1);
     }
 
@@ -134,54 +383,109 @@ int main(int argc, char* argv[])
     // printf("position: (%.12f, %.12f, %.12f)\n",
             // h_tParticles[0].s[0], h_tParticles[1].s[0], h_tParticles[2].s[0]);
 
-    // execute kernels
-    for (int i = 0; i < iterations; i++) {
-        // compute acceleration
-        err = clEnqueueNDRangeKernel(queue, kernel_compute, 2,
-                                     NULL, globalSize, localSize,
-                                     0, NULL, NULL);
-        if (err) {
-            printf("Error executing compute kernel\n");
-        }
-        clFinish(queue);
-
-        // sum acceleration
-        size_t n = (size_t)numPParticles;
-        while (n > 1) {
-            err = clSetKernelArg(kernel_reduce, 2, sizeof(int), &n);
-            err = clEnqueueNDRangeKernel(queue, kernel_reduce, 2,
-                                         NULL, globalSize, localSize,
-                                         0, NULL, NULL);
-        if (err) {
-            printf("Error executing reduce kernel\n");
+    // trajectories are written in the background while the kernels run
+    trajectory_t* trajectory = NULL;
+    if (trajectoryFile != NULL) {
+        int first = 0;
+        int count = numTParticles;
+        if (subsetOption != NULL
+                && sscanf(subsetOption, "%d:%d", &first, &count) != 2) {
+            fprintf(stderr, "--subset requires FIRST:COUNT\n");
+            exit(-1);
         }
-            clFinish(queue);
-
-            n = ceil(n / (float)localSize[0]);
+        trajectory = trajectoryOpen(trajectoryFile, numTParticles,
+                                    strideOption ? atoi(strideOption) : 1,
+                                    first, count, start);
+        // a resumed run records what an uninterrupted run would
+        if (start == 0 || trajectoryDue(trajectory, start)) {
+            recordSnapshot(trajectory, h_tParticles, start);
         }
+    }
 
-        // update position
-        err = clEnqueueNDRangeKernel(queue, kernel_update, 2,
+    // execute kernels. The queue runs the launches in order, so steps are
+    // enqueued back to back and the host only waits for the device every
+    // batch steps or when it reads the particles back.
+    double begin = wallTime();
+    for (int i = start; i < iterations; i++) {
+        // compute acceleration and update position
+        err = clEnqueueNDRangeKernel(queue, kernel_step, 2,
                                      NULL, globalSize, localSize,
-                                     0, NULL, NULL);
+                                     0, NULL, stepPhase ? &event : NULL);
         if (err) {
-            printf("Error executing update kernel\n");
+            printf("Error executing step kernel\n");
+        } else {
+            oclProfile(stepPhase, event);
+        }
+
+        int snapshot = trajectory != NULL && trajectoryDue(trajectory, i + 1);
+        int save = checkpoint != NULL && (i + 1) % checkpointEvery == 0;
+        if (!snapshot && !save && batch > 0 && (i + 1 - start) % batch == 0) {
+            double waitBegin = profileTime(waitPhase);
+            clFinish(queue);
+            profileEnd(waitPhase, waitBegin);
+            oclProfileCollect();
+        }
+        if (snapshot || save) {
+            double waitBegin = profileTime(waitPhase);
+            err = clEnqueueReadBuffer(queue, d_tParticles, CL_TRUE, 0,
+                                      tParticles_size, h_tParticles, 0,
+                                      NULL, readbackPhase ? &event : NULL);
+            if (err != 0) {
+                fprintf(stderr, "error copying data to host\n");
+                exit(-1);
+            }
+            profileEnd(waitPhase, waitBegin);
+            oclProfile(readbackPhase, event);
+            oclProfileCollect();
+        }
+        double outputBegin = profileTime(outputPhase);
+        if (snapshot) {
+            recordSnapshot(trajectory, h_tParticles, i + 1);
+        }
+        if (save) {
+            saveCheckpoint(checkpoint, h_tParticles, numTParticles, i + 1);
+        }
+        if (snapshot || save) {
+            profileEnd(outputPhase, outputBegin);
         }
-        clFinish(queue);
     }
+    double waitBegin = profileTime(waitPhase);
+    clFinish(queue);
+    profileEnd(waitPhase, waitBegin);
+    double seconds = wallTime() - begin;
+    oclProfileCollect();
+    double outputBegin = profileTime(outputPhase);
+    if (trajectory != NULL) {
+        trajectoryClose(trajectory);
+    }
+    if (checkpoint != NULL) {
+        checkpointClose(checkpoint);
+    }
+    profileEnd(outputPhase, outputBegin);
 
     // copy data from device to host
     err = clEnqueueReadBuffer(queue, d_tParticles, CL_TRUE, 0,
                               tParticles_size, h_tParticles, 0,
-                              NULL, NULL);    if (err != 0) {
-    fprintf(stderr, "error copying data to host\n");
+                              NULL, readbackPhase ? &event : NULL);
+    if (err != 0) {
+        fprintf(stderr, "error copying data to host\n");
         exit(-1);
     }
+    oclProfile(readbackPhase, event);
+    oclProfileCollect();
 
 
     // print final position of first test particle
     printf("position: (%.12f, %.12f, %.12f)\n",
             h_tParticles[0].s[0], h_tParticles[0].s[1], h_tParticles[0].s[2]);
+    double interactions = (double)numTParticles*numPParticles
+                          *(iterations - start);
+    printf("time: %.3f s, %.3e interactions/s (opencl, %s, %s)\n", seconds,
+           interactions / seconds, precision, integratorName);
+    profileReport(profile, stdout);
+    if (packed != NULL) {
+        packFree(packed);
+    }
 
     // print final x positions of first 3 test particles
     // printf("position: (%.12f, %.12f, %.12f)\n",
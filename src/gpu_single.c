@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <Cl/opencl.h>
+#include <string.h>
+#include <math.h>
+#include <CL/opencl.h>
 
 #include "oclSetup.h"
+#include "options.h"
+#include "dataset.h"
+#include "timer.h"
+#include "profile.h"
+#include "packed.h"
 
 /*
  * Creates a number of "pseudo-particles" which have an x-, y-, and z-coordiate
@@ -12,19 +19,108 @@
  */
 int main(int argc, char* argv[])
 {
+    // options
+    ocl_options_t oclOptions;
+    takeOclOptions(&argc, argv, &oclOptions);
+    char* inputFile = takeOption(&argc, argv, "--input");
+    char* batchOption = takeOption(&argc, argv, "--batch");
+    const int batch = batchOption ? atoi(batchOption) : 1;
+    const int generic = takeFlag(&argc, argv, "--generic");
+    char* unrollOption = takeOption(&argc, argv, "--unroll");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    const int profileFlag = takeFlag(&argc, argv, "--profile");
+    char* traceFile = takeOption(&argc, argv, "--trace");
+
     if (argc != 5) {
         fprintf(stderr, "requires 4 command line arguments:\n");
         fprintf(stderr, "\tlocal work group size\n\t#pseudo-particles\n");
         fprintf(stderr, "\t#iterations\n\tsize of time step\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--platform P\tOpenCL platform, by index or name\n");
+        fprintf(stderr, "\t--device-type T\tgpu (default if there is one), cpu, accelerator or all\n");
+        fprintf(stderr, "\t--device D\tindex of the device of that type\n");
+        fprintf(stderr, "\t--cache DIR\treuse the compiled kernels from earlier runs\n");
+        fprintf(stderr, "\t--generic\tdo not compile the problem size into the kernel\n");
+        fprintf(stderr, "\t--unroll U\tunroll factor of the kernel loop (default 4)\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+        fprintf(stderr, "\t--batch K\twait for the device every K steps (default 1, 0 = only for output)\n");
+        fprintf(stderr, "\t--profile\tprint the time spent in each phase\n");
+        fprintf(stderr, "\t--trace FILE\twrite the phases as a Chrome trace\n");
         exit(-1);
     }
 
+    // time spent in each phase of the run; the device phases are measured
+    // by the command queue and wait is the time the host waits for them
+    profile_t* profile = profileCreate(profileFlag, traceFile);
+    phase_t* setupPhase = profilePhase(profile, "setup");
+    phase_t* uploadPhase = profilePhase(profile, "upload");
+    phase_t* stepPhase = profilePhase(profile, "step");
+    phase_t* reducePhase = profilePhase(profile, "reduce");
+    phase_t* waitPhase = profilePhase(profile, "wait");
+    phase_t* readbackPhase = profilePhase(profile, "readback");
+    oclOptions.profiling = profile != NULL;
+    double setupBegin = profileTime(setupPhase);
+    cl_event event;
+
     const int numParticles = atoi(argv[2]);
     const int iterations = atoi(argv[3]);
     const float timeStep = (float)atof(argv[4]);
 
+    // each work-item sums over several pseudo-particles if there are more
+    // than localSize^2, so finish only adds up localSize sums
     size_t localSize = atoi(argv[1]);
-    size_t globalSize = ceil(numParticles / (float)localSize) * localSize;
+    size_t numGroups = ceil(numParticles / (float)localSize);
+    if (numGroups > localSize) {
+        numGroups = localSize;
+    }
+    if (numGroups < 1) {
+        numGroups = 1;
+    }
+    size_t globalSize = numGroups * localSize;
+
+    const char* precision = precisionOption ? precisionOption : "float";
+    const int useKahan = strcmp(precision, "kahan") == 0;
+    const int useDouble = strcmp(precision, "double") == 0;
+    if (!useKahan && !useDouble && strcmp(precision, "float") != 0) {
+        fprintf(stderr, "Unknown precision %s\n", precision);
+        exit(-1);
+    }
+    const int storage = storageOption ? parseStorage(storageOption)
+                                      : STORAGE_FLOAT;
+    if (storage < 0) {
+        fprintf(stderr, "Unknown storage %s\n", storageOption);
+        exit(-1);
+    }
+    if (storage != STORAGE_FLOAT && (useKahan || useDouble)) {
+        fprintf(stderr, "--storage requires --precision float\n");
+        exit(-1);
+    }
+
+    // in the order of the INTEGRATOR_ constants in oclNBody_single.cl
+    const char* integrators[] = {"euler", "leapfrog", "rk4", "adaptive"};
+    const char* integratorName = integratorOption ? integratorOption : "euler";
+    int integrator = 0;
+    while (integrator < 4
+            && strcmp(integratorName, integrators[integrator]) != 0) {
+        integrator++;
+    }
+    if (integrator == 4) {
+        fprintf(stderr, "Unknown integrator %s\n", integratorName);
+        exit(-1);
+    }
+    const float tolerance = toleranceOption ? (float)atof(toleranceOption)
+                                            : 1e-6f;
+    // rk4 evaluates the accelerations in four launches per step, adaptive
+    // in as many as it takes
+    const int adaptive = integrator == 3;
+    const int launchesPerStep = integrator == 2 ? 4 : 1;
 
     cl_int err;
     cl_platform_id cpPlatform;
@@ -33,71 +129,175 @@ int main(int argc, char* argv[])
     cl_command_queue queue;
     cl_program program;
 
+    // compile the problem constants into the kernel (see oclNBody_single.cl)
+    char buildOptions[512];
+    int len = snprintf(buildOptions, sizeof(buildOptions),
+                       "-DUNROLL=%d%s%s -DINTEGRATOR=%d -DTOLERANCE=%af",
+                       unrollOption ? atoi(unrollOption) : 4,
+                       useDouble ? " -DUSE_DOUBLE" : "",
+                       useKahan ? " -DUSE_KAHAN" : "", integrator, tolerance);
+    if (storage != STORAGE_FLOAT) {
+        len += snprintf(buildOptions + len, sizeof(buildOptions) - len,
+                        " -DSTORAGE=%d -DCELL_SIZE=%d", storage, CELL_SIZE);
+    }
+    if (!generic) {
+        snprintf(buildOptions + len, sizeof(buildOptions) - len,
+                 " -DNUM_PSEUDO=%du -DTIME_STEP=%af -DLOCAL_SIZE=%u"
+                 " -DNUM_GROUPS=%uu", numParticles, timeStep,
+                 (unsigned)localSize, (unsigned)numGroups);
+    }
+    // size of the partial sums in the kernel
+    const size_t realSize = useDouble ? 4*sizeof(cl_double)
+                                      : 4*sizeof(cl_float);
+
     oclSetup(&cpPlatform, &device_id, &context, &queue,
-             &program, "oclNBody_single.cl");
+             &program, "oclNBody_single.cl", buildOptions, &oclOptions);
 
     // initialize data
     size_t particles_size = numParticles*sizeof(cl_float4);
     cl_float4* h_particles = (cl_float4*)malloc(particles_size);
-    for (int i = 0; i < numParticles; i++) {
-        cl_float4 temp = {{rand(), rand(), rand(), rand()}};
-        h_particles[i] = temp;
+    cl_float8 h_particle;
+    if (inputFile != NULL) {
+        dataset_t* input = readDataset(inputFile);
+        if (numParticles > input->numPParticles || input->numTParticles < 1) {
+            fprintf(stderr, "%s only has %d test particles and %d "
+                    "pseudo-particles\n", inputFile, input->numTParticles,
+                    input->numPParticles);
+            exit(-1);
+        }
+        for (int i = 0; i < numParticles; i++) {
+            cl_float4 temp = {{input->x[i], input->y[i],
+                               input->z[i], input->m[i]}};
+            h_particles[i] = temp;
+        }
+        cl_float8 temp = {{input->tx[0],  input->ty[0],  input->tz[0],
+                           input->tm[0],  input->tvx[0], input->tvy[0],
+                           input->tvz[0], 0.0f                         }};
+        h_particle = temp;
+        freeDataset(input);
+    } else {
+        for (int i = 0; i < numParticles; i++) {
+            cl_float4 temp = {{rand(), rand(), rand(), rand()}};
+            h_particles[i] = temp;
+        }
+
+        cl_float8 temp = {{rand(),   rand(),   rand(),   rand()%500,
+                           rand()%5, rand()%5, rand()%5, 0.0f       }};
+        h_particle = temp;
     }
 
-    cl_float8 h_particle = {{rand(),   rand(),   rand(),   rand()%500,
-                             rand()%5, rand()%5, rand()%5, 0.0f       }};
+    // with 16-bit storage the device gets the packed pseudo-particles and
+    // their cells instead (see packed.h)
+    packed_t* packed = NULL;
+    const void* pseudoData = h_particles;
+    size_t pseudoSize = particles_size;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(&h_particles[0].s[0], &h_particles[0].s[1],
+                            &h_particles[0].s[2], &h_particles[0].s[3], 4,
+                            numParticles, storage);
+        pseudoData = packed->data;
+        pseudoSize = 4*(size_t)numParticles*sizeof(cl_ushort);
 
+        // how far the 16-bit storage moves the acceleration
+        double maxError, rmsError;
+        packError(packed, &h_particles[0].s[0], &h_particles[0].s[1],
+                  &h_particles[0].s[2], &h_particles[0].s[3], 4,
+                  &h_particle.s[0], &h_particle.s[1], &h_particle.s[2], 8, 1,
+                  &maxError, &rmsError);
+        printf("storage: %s, relative error of the acceleration: "
+               "max %.3e, rms %.3e\n", storageName(storage), maxError,
+               rmsError);
+    }
 
     // create buffers
     cl_mem d_particles = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                        particles_size, NULL, &err);
+                                        pseudoSize, NULL, &err);
     cl_mem d_particle  = clCreateBuffer(context, CL_MEM_READ_WRITE,
                                         sizeof(cl_float8), NULL, &err);
-    cl_mem d_accel     = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                        particles_size, NULL, &err);
+    cl_mem d_partial   = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                        numGroups*realSize, NULL, &err);
+    cl_mem d_count     = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                        2*sizeof(cl_uint), NULL, &err);
+    cl_mem d_state     = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                        7*realSize, NULL, &err);
+    cl_mem d_cells = NULL;
+    if (packed != NULL && err == 0) {
+        d_cells = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                                 packed->numCells*CELL_FIELDS*sizeof(cl_float),
+                                 NULL, &err);
+    }
     if (err != 0) {
         fprintf(stderr, "Error creating buffers\n");
         exit(-1);
     }
 
+    profileEnd(setupPhase, setupBegin);
+
     // copy data to device
     err  = clEnqueueWriteBuffer(queue, d_particles, CL_TRUE, 0,
-                                particles_size, h_particles, 0,
-                                NULL, NULL);
+                                pseudoSize, pseudoData, 0,
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    if (packed != NULL) {
+        err |= clEnqueueWriteBuffer(queue, d_cells, CL_TRUE, 0,
+                                    packed->numCells*CELL_FIELDS
+                                    *sizeof(cl_float), packed->cells, 0,
+                                    NULL, uploadPhase ? &event : NULL);
+        oclProfile(uploadPhase, event);
+    }
     err |= clEnqueueWriteBuffer(queue, d_particle, CL_TRUE, 0,
                                 sizeof(cl_float8), &h_particle, 0,
-                                NULL, NULL);
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
+    // stage and finished steps (see the kernel)
+    cl_uint zero[2] = {0, 0};
+    err |= clEnqueueWriteBuffer(queue, d_count, CL_TRUE, 0,
+                                sizeof(zero), zero, 0,
+                                NULL, uploadPhase ? &event : NULL);
+    oclProfile(uploadPhase, event);
     if (err != 0) {
         fprintf(stderr, "Error setting kernel arguments\n");
         exit(-1);
     }
+    oclProfileCollect();
 
 
 
 
     // setup kernels
-    cl_kernel kernel_compute = clCreateKernel(program, "compute", &err);
-    cl_kernel kernel_reduce  = clCreateKernel(program, "reduce",  &err);
-    cl_kernel kernel_update  = clCreateKernel(program, "update",  &err);
+    cl_kernel kernel_step = clCreateKernel(program, "step", &err);
+    cl_kernel kernel_finish = NULL;
+    if (err == 0) {
+        kernel_finish = clCreateKernel(program, "finish", &err);
+    }
     if (err != 0) {
         fprintf(stderr, "Error creating kernels\n");
         exit(-1);
     }
 
 
-    // set the arguments for kernels
-    err  = clSetKernelArg(kernel_compute, 0, sizeof(cl_mem), &d_particles);
-    err |= clSetKernelArg(kernel_compute, 1, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_compute, 2, sizeof(int),    &numParticles);
-    err |= clSetKernelArg(kernel_compute, 3, sizeof(cl_mem), &d_particle);
-
-    err  = clSetKernelArg(kernel_reduce, 0, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_reduce, 1, sizeof(int),    &numParticles);
-    err |= clSetKernelArg(kernel_reduce, 2, localSize*sizeof(cl_float4), NULL);
-
-    err  = clSetKernelArg(kernel_update, 0, sizeof(cl_mem), &d_accel);
-    err |= clSetKernelArg(kernel_update, 1, sizeof(cl_mem), &d_particle);
-    err |= clSetKernelArg(kernel_update, 2, sizeof(int),    &timeStep);
+    // set the arguments for kernel
+    err  = clSetKernelArg(kernel_step, 0, sizeof(cl_mem), &d_particles);
+    err |= clSetKernelArg(kernel_step, 1, sizeof(int),    &numParticles);
+    err |= clSetKernelArg(kernel_step, 2, sizeof(cl_mem), &d_particle);
+    err |= clSetKernelArg(kernel_step, 3, sizeof(cl_mem), &d_partial);
+    err |= clSetKernelArg(kernel_step, 4, sizeof(cl_mem), &d_count);
+    err |= clSetKernelArg(kernel_step, 5, sizeof(cl_mem), &d_state);
+    err |= clSetKernelArg(kernel_step, 6, sizeof(int),    &iterations);
+    err |= clSetKernelArg(kernel_step, 7, sizeof(float),  &timeStep);
+    err |= clSetKernelArg(kernel_step, 8, localSize*realSize, NULL);
+    if (packed != NULL) {
+        err |= clSetKernelArg(kernel_step, 9, sizeof(cl_mem), &d_cells);
+    }
+    cl_uint groups = (cl_uint)numGroups;
+    err |= clSetKernelArg(kernel_finish, 0, sizeof(cl_mem), &d_particle);
+    err |= clSetKernelArg(kernel_finish, 1, sizeof(cl_mem), &d_partial);
+    err |= clSetKernelArg(kernel_finish, 2, sizeof(cl_uint), &groups);
+    err |= clSetKernelArg(kernel_finish, 3, sizeof(cl_mem), &d_count);
+    err |= clSetKernelArg(kernel_finish, 4, sizeof(cl_mem), &d_state);
+    err |= clSetKernelArg(kernel_finish, 5, sizeof(int),    &iterations);
+    err |= clSetKernelArg(kernel_finish, 6, sizeof(float),  &timeStep);
+    err |= clSetKernelArg(kernel_finish, 7, localSize*realSize, NULL);
 
     if (err != 0) {
         fprintf(stderr, "Error setting kernel arguments\n");
@@ -109,35 +309,65 @@ int main(int argc, char* argv[])
     printf("position: (%.12f, %.12f, %.12f)\n",
            h_particle.s[0], h_particle.s[1], h_particle.s[2]);
 
-    // execute kernel
-    for (int i = 0; i < iterations; i++) {
-        // compute acceleration
-        err = clEnqueueNDRangeKernel(queue, kernel_compute, 1,
+    // execute kernels; step computes the partial sums and finish adds them
+    // up and updates the test particle in a single work-group. The queue
+    // runs the launches in order, so a batch of steps is enqueued back to
+    // back without waiting for each of them.
+    double begin = wallTime();
+    for (int i = 0; !adaptive && i < iterations*launchesPerStep; i++) {
+        err = clEnqueueNDRangeKernel(queue, kernel_step, 1,
                                      NULL, &globalSize, &localSize,
-                                     0, NULL, NULL);
-        clFinish(queue);
-
-        // sum acceleration
-        size_t n = (size_t)numParticles;
-        // may require multiple reductions
-        do {
-            err = clSetKernelArg(kernel_reduce, 1, sizeof(int), &n);
-            err = clEnqueueNDRangeKernel(queue, kernel_reduce, 1,
-                                         NULL, &globalSize, &localSize,
-                                         0, NULL, NULL);
+                                     0, NULL, stepPhase ? &event : NULL);
+        if (err == 0) {
+            oclProfile(stepPhase, event);
+            err = clEnqueueNDRangeKernel(queue, kernel_finish, 1,
+                                         NULL, &localSize, &localSize,
+                                         0, NULL,
+                                         reducePhase ? &event : NULL);
+        }
+        if (err != 0) {
+            break;
+        }
+        oclProfile(reducePhase, event);
+        if (batch > 0 && (i + 1) % (batch*launchesPerStep) == 0) {
+            double waitBegin = profileTime(waitPhase);
             clFinish(queue);
-
-            // after executing a reduction, the partial sums should be
-            // in the first n (calculated below) array elements
-            n = ceil(n / (float)localSize);
-        } while(n > 1);
-
-        // update position
-        err = clEnqueueNDRangeKernel(queue, kernel_update, 1,
-                                     NULL, &globalSize, &localSize,
-                                     0, NULL, NULL);
-        clFinish(queue);
+            profileEnd(waitPhase, waitBegin);
+            oclProfileCollect();
+        }
+    }
+    // the adaptive method takes a varying number of launches per step, so
+    // the finished steps are read back after every batch of launches until
+    // there are enough; the launches after the last step do nothing
+    cl_uint done = 0;
+    while (adaptive && done < (cl_uint)iterations) {
+        for (int i = 0; i < (batch > 0 ? batch : 64); i++) {
+            err |= clEnqueueNDRangeKernel(queue, kernel_step, 1,
+                                          NULL, &globalSize, &localSize,
+                                          0, NULL,
+                                          stepPhase ? &event : NULL);
+            oclProfile(stepPhase, event);
+            err |= clEnqueueNDRangeKernel(queue, kernel_finish, 1,
+                                          NULL, &localSize, &localSize,
+                                          0, NULL,
+                                          reducePhase ? &event : NULL);
+            oclProfile(reducePhase, event);
+        }
+        double waitBegin = profileTime(waitPhase);
+        err |= clEnqueueReadBuffer(queue, d_count, CL_TRUE,
+                                   sizeof(cl_uint), sizeof(cl_uint), &done,
+                                   0, NULL, NULL);
+        profileEnd(waitPhase, waitBegin);
+        oclProfileCollect();
+        if (err != 0) {
+            break;
+        }
     }
+    double waitBegin = profileTime(waitPhase);
+    clFinish(queue);
+    profileEnd(waitPhase, waitBegin);
+    double seconds = wallTime() - begin;
+    oclProfileCollect();
 
     if (err != 0) {
         fprintf(stderr, "Error executing kernels\n");
@@ -146,14 +376,22 @@ int main(int argc, char* argv[])
     // copy data from device to host
     err = clEnqueueReadBuffer(queue, d_particle, CL_TRUE, 0,
                               sizeof(cl_float8), &h_particle, 0,
-                              NULL, NULL);    if (err != 0) {
-    fprintf(stderr, "Error copying data to host\n");
+                              NULL, readbackPhase ? &event : NULL);
+    if (err != 0) {
+        fprintf(stderr, "Error copying data to host\n");
         exit(-1);
     }
+    oclProfile(readbackPhase, event);
+    oclProfileCollect();
 
     // print final position of test particle
     printf("position: (%.12f, %.12f, %.12f)\n",
            h_particle.s[0], h_particle.s[1], h_particle.s[2]);
 
+    printf("time: %.3f s, %.3e interactions/s (opencl, %s, %s)\n", seconds,
+           (double)numParticles*iterations / seconds, precision,
+           integratorName);
+    profileReport(profile, stdout);
+
 
 }
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "grid.h"
+
+// names of the INTERP_ constants
+static const char* interpNames[] = {"linear", "cubic"};
+
+typedef struct {
+    grid_t* grid;
+    const field_t* field;
+    int firstSlice;
+    int lastSlice;
+} sampler_t;
+
+/*
+ * Samples the field for the z-slices from firstSlice to lastSlice-1.
+ */
+static void* sampleSlices(void* arg)
+{
+    sampler_t* s = (sampler_t*)arg;
+    grid_t* g = s->grid;
+    int res = g->res;
+
+    for (int k = s->firstSlice; k < s->lastSlice; k++) {
+        for (int j = 0; j < res; j++) {
+            for (int i = 0; i < res; i++) {
+                float px = g->min[0] + i * g->spacing;
+                float py = g->min[1] + j * g->spacing;
+                float pz = g->min[2] + k * g->spacing;
+                float* sample = g->samples + 4*(((size_t)k*res + j)*res + i);
+
+                fieldAcceleration(s->field, px, py, pz, sample);
+                sample[3] = (float)fieldPotential(s->field, px, py, pz);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the INTERP_ constant for "linear" or "cubic", or -1 if name is
+ * neither of them.
+ */
+int parseInterp(const char* name)
+{
+    for (int i = 0; i < 2; i++) {
+        if (strcmp(name, interpNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the name of an INTERP_ constant.
+ */
+const char* interpName(int interp)
+{
+    return interpNames[interp];
+}
+
+/*
+ * Samples the acceleration and potential of the field on a grid with res
+ * points along each axis. The field is evaluated with its octree if it has
+ * one, otherwise by direct summation, using the given number of threads.
+ */
+grid_t* gridBuild(const field_t* field, int res, int interp, int numThreads)
+{
+    if (res < 2) {
+        fprintf(stderr, "Grid requires at least 2 samples per axis\n");
+        exit(-1);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+
+    grid_t* g = (grid_t*)malloc(sizeof(grid_t));
+    float* samples = (float*)malloc(4*(size_t)res*res*res*sizeof(float));
+    if (g == NULL || samples == NULL) {
+        fprintf(stderr, "Error allocating memory for grid\n");
+        exit(-1);
+    }
+    g->samples = samples;
+    g->map = NULL;
+    g->res = res;
+    g->interp = interp;
+
+    // bounding cube of the pseudo-particles
+    float min[3] = {0.0, 0.0, 0.0};
+    float max[3] = {0.0, 0.0, 0.0};
+    for (int i = 0; i < field->n; i++) {
+        float p[3] = {field->x[i], field->y[i], field->z[i]};
+        for (int k = 0; k < 3; k++) {
+            if (i == 0 || p[k] < min[k]) {
+                min[k] = p[k];
+            }
+            if (i == 0 || p[k] > max[k]) {
+                max[k] = p[k];
+            }
+        }
+    }
+    float size = 0.0;
+    for (int k = 0; k < 3; k++) {
+        if (max[k] - min[k] > size) {
+            size = max[k] - min[k];
+        }
+    }
+    size = size * (1 + 2*GRID_MARGIN) + 1.0f;
+    g->spacing = size / (res - 1);
+    for (int k = 0; k < 3; k++) {
+        g->min[k] = (min[k] + max[k]) / 2 - size / 2;
+    }
+
+    // the samples themselves are calculated without the grid
+    field_t direct = *field;
+    direct.grid = NULL;
+
+    pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+    sampler_t* samplers = (sampler_t*)malloc(numThreads*sizeof(sampler_t));
+    for (int i = 0; i < numThreads; i++) {
+        samplers[i].grid = g;
+        samplers[i].field = &direct;
+        samplers[i].firstSlice = res * i / numThreads;
+        samplers[i].lastSlice = res * (i + 1) / numThreads;
+        if (i > 0 && pthread_create(&threads[i], NULL, sampleSlices,
+                                    &samplers[i]) != 0) {
+            fprintf(stderr, "Error creating grid thread\n");
+            exit(-1);
+        }
+    }
+    sampleSlices(&samplers[0]);
+    for (int i = 1; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(samplers);
+
+    return g;
+}
+
+/*
+ * Catmull-Rom weights for the 4 samples around a point at fraction t
+ * between the second and third sample.
+ */
+static void cubicWeights(float t, float* w)
+{
+    float t2 = t*t;
+    float t3 = t2*t;
+    w[0] = 0.5f * (-t3 + 2*t2 - t);
+    w[1] = 0.5f * (3*t3 - 5*t2 + 2);
+    w[2] = 0.5f * (-3*t3 + 4*t2 + t);
+    w[3] = 0.5f * (t3 - t2);
+}
+
+static int clamp(int i, int res)
+{
+    return i < 0 ? 0 : (i >= res ? res - 1 : i);
+}
+
+/*
+ * Interpolates the samples around (px, py, pz) and stores the result in
+ * out[0..3]. Returns 0 if the point is outside of the grid.
+ */
+static int interpolate(const grid_t* g, float px, float py, float pz,
+                       float* out)
+{
+    const int res = g->res;
+    float p[3] = {px, py, pz};
+    int idx[3];
+    float frac[3];
+
+    for (int k = 0; k < 3; k++) {
+        float u = (p[k] - g->min[k]) / g->spacing;
+        if (!(u >= 0.0f && u < res - 1)) {
+            return 0;
+        }
+        idx[k] = (int)u;
+        frac[k] = u - idx[k];
+    }
+
+    out[0] = 0.0;
+    out[1] = 0.0;
+    out[2] = 0.0;
+    out[3] = 0.0;
+
+    if (g->interp == INTERP_CUBIC) {
+        float w[3][4];
+        for (int k = 0; k < 3; k++) {
+            cubicWeights(frac[k], w[k]);
+        }
+        for (int c = 0; c < 4; c++) {
+            int kk = clamp(idx[2] - 1 + c, res);
+            for (int b = 0; b < 4; b++) {
+                int jj = clamp(idx[1] - 1 + b, res);
+                float wzy = w[2][c] * w[1][b];
+                for (int a = 0; a < 4; a++) {
+                    int ii = clamp(idx[0] - 1 + a, res);
+                    const float* s = g->samples
+                                   + 4*(((size_t)kk*res + jj)*res + ii);
+                    float weight = wzy * w[0][a];
+                    out[0] += weight * s[0];
+                    out[1] += weight * s[1];
+                    out[2] += weight * s[2];
+                    out[3] += weight * s[3];
+                }
+            }
+        }
+    } else {
+        for (int c = 0; c < 2; c++) {
+            for (int b = 0; b < 2; b++) {
+                for (int a = 0; a < 2; a++) {
+                    const float* s = g->samples
+                                   + 4*(((size_t)(idx[2] + c)*res
+                                         + idx[1] + b)*res + idx[0] + a);
+                    float weight = (c ? frac[2] : 1 - frac[2])
+                                 * (b ? frac[1] : 1 - frac[1])
+                                 * (a ? frac[0] : 1 - frac[0]);
+                    out[0] += weight * s[0];
+                    out[1] += weight * s[1];
+                    out[2] += weight * s[2];
+                    out[3] += weight * s[3];
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Stores the interpolated acceleration at (px, py, pz) in a[0], a[1] and
+ * a[2]. Returns 0 (and leaves a unchanged) if the point is outside of the
+ * grid.
+ */
+int gridAcceleration(const grid_t* g, float px, float py, float pz, float* a)
+{
+    float out[4];
+    if (!interpolate(g, px, py, pz, out)) {
+        return 0;
+    }
+    a[0] = out[0];
+    a[1] = out[1];
+    a[2] = out[2];
+    return 1;
+}
+
+/*
+ * Stores the interpolated potential at (px, py, pz) in phi.
+ * Returns 0 if the point is outside of the grid.
+ */
+int gridPotential(const grid_t* g, float px, float py, float pz, float* phi)
+{
+    float out[4];
+    if (!interpolate(g, px, py, pz, out)) {
+        return 0;
+    }
+    *phi = out[3];
+    return 1;
+}
+
+/*
+ * Compares the interpolated acceleration and potential of the grid to the
+ * exact sums over the pseudo-particles of field, for up to
+ * GRID_ERROR_SAMPLES of the count test particles at (px[i*tstride],
+ * py[i*tstride], pz[i*tstride]). Stores the largest and the root mean
+ * square relative error of each. Test particles outside of the grid, for
+ * which the exact sum is used anyway, are skipped. Returns the number of
+ * test particles compared.
+ */
+int gridError(const grid_t* g, const field_t* field, const float* px,
+              const float* py, const float* pz, int tstride, int count,
+              double* maxError, double* rmsError, double* maxPotential,
+              double* rmsPotential)
+{
+    int samples = count < GRID_ERROR_SAMPLES ? count : GRID_ERROR_SAMPLES;
+    int compared = 0;
+    double sum = 0.0;
+    double sumPotential = 0.0;
+    *maxError = 0.0;
+    *maxPotential = 0.0;
+    for (int s = 0; s < samples; s++) {
+        int t = (int)((long long)s*count / samples)*tstride;
+        float a[3];
+        float gridPhi;
+        if (!gridAcceleration(g, px[t], py[t], pz[t], a)
+                || !gridPotential(g, px[t], py[t], pz[t], &gridPhi)) {
+            continue;
+        }
+
+        double ref[3] = {0.0, 0.0, 0.0};
+        double phi = 0.0;
+        for (int i = 0; i < field->n; i++) {
+            double d[3] = {field->x[i] - (double)px[t],
+                           field->y[i] - (double)py[t],
+                           field->z[i] - (double)pz[t]};
+            double invr = 1.0 / sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]
+                                     + EPSILON);
+            double f = field->m[i]*invr*invr*invr;
+            for (int k = 0; k < 3; k++) {
+                ref[k] += f*d[k];
+            }
+            phi -= field->m[i]*invr;
+        }
+
+        double norm = sqrt(ref[0]*ref[0] + ref[1]*ref[1] + ref[2]*ref[2]);
+        double diff = sqrt((a[0] - ref[0])*(a[0] - ref[0])
+                           + (a[1] - ref[1])*(a[1] - ref[1])
+                           + (a[2] - ref[2])*(a[2] - ref[2]));
+        double error = norm > 0.0 ? diff / norm : diff;
+        double potential = phi != 0.0 ? fabs((gridPhi - phi) / phi)
+                                      : fabs(gridPhi);
+        sum += error*error;
+        sumPotential += potential*potential;
+        *maxError = fmax(*maxError, error);
+        *maxPotential = fmax(*maxPotential, potential);
+        compared++;
+    }
+    *rmsError = compared > 0 ? sqrt(sum / compared) : 0.0;
+    *rmsPotential = compared > 0 ? sqrt(sumPotential / compared) : 0.0;
+    return compared;
+}
+
+void gridFree(grid_t* g)
+{
+    if (g->map != NULL) {
+        unmapFile(g->map);
+        free(g);
+        return;
+    }
+    free(g->samples);
+    free(g);
+}
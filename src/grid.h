@@ -0,0 +1,40 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "particle.h"
+#include "mapfile.h"
+
+#define INTERP_LINEAR 0
+#define INTERP_CUBIC  1
+
+// fraction of the extent of the pseudo-particles which is added on each
+// side of the grid, so test particles near the edge are still covered
+#define GRID_MARGIN 0.25f
+
+// test particles sampled by gridError()
+#define GRID_ERROR_SAMPLES 64
+
+/*
+ * Acceleration and potential of the pseudo-particles sampled on a regular
+ * grid of res*res*res points which covers the pseudo-particles. Each sample
+ * stores (ax, ay, az, potential), so an interpolation reads whole samples.
+ */
+typedef struct grid {
+    int res;
+    float min[3];       // position of the first sample
+    float spacing;      // distance between samples
+    int interp;         // INTERP_LINEAR or INTERP_CUBIC
+    float* samples;     // 4*res^3 floats, x varies fastest
+    mapfile_t* map;     // if not NULL, samples point into this cache file
+} grid_t;
+
+int parseInterp(const char*);
+const char* interpName(int);
+grid_t* gridBuild(const field_t*, int, int, int);
+int gridAcceleration(const grid_t*, float, float, float, float*);
+int gridPotential(const grid_t*, float, float, float, float*);
+int gridError(const grid_t*, const field_t*, const float*, const float*,
+              const float*, int, int, double*, double*, double*, double*);
+void gridFree(grid_t*);
+
+#endif
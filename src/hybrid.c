@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <CL/opencl.h>
+
+#include "oclSetup.h"
+#include "particle.h"
+#include "engine.h"
+#include "dataset.h"
+#include "options.h"
+#include "timer.h"
+
+// most OpenCL devices of a run
+#define MAX_DEVICES 16
+// weight of the last step in the measured throughput of a worker
+#define SMOOTHING 0.25
+// fraction of the test particles a boundary has to move by at least before
+// the test particles are redistributed, so noise does not move them back
+// and forth
+#define MIN_MOVE 0.01
+
+/*
+ * A part of the machine which updates a range of the test particles on
+ * every step: the threaded CPU engine or an OpenCL device. The buffer of a
+ * device holds all test particles at the same indices as on the host, but
+ * only its own range is up to date, and the kernel is launched with a
+ * global offset so it only updates that range.
+ */
+typedef struct {
+    char name[128];
+    int begin;              // range of test particles
+    int end;
+    double rate;            // test particles per second, 0 until measured
+    double seconds;         // time spent on steps
+    double updated;         // test particles updated
+
+    // NULL for the CPU
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem d_tParticles;
+    cl_mem d_pParticles;
+    cl_event event;
+} worker_t;
+
+/*
+ * Copies the test particles begin to end from the device of w to the host.
+ * staging has room for all test particles.
+ */
+static void download(worker_t* w, tparticles_t* ps, cl_float8* staging,
+                     int begin, int end)
+{
+    if (begin >= end) {
+        return;
+    }
+    cl_int err = clEnqueueReadBuffer(w->queue, w->d_tParticles, CL_TRUE,
+                                     begin*sizeof(cl_float8),
+                                     (end - begin)*sizeof(cl_float8),
+                                     staging + begin, 0, NULL, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Error copying data to host\n");
+        exit(-1);
+    }
+    for (int i = begin; i < end; i++) {
+        const float* s = staging[i].s;
+        ps->x[i] = s[0];
+        ps->y[i] = s[1];
+        ps->z[i] = s[2];
+        ps->m[i] = s[3];
+        ps->vx[i] = s[4];
+        ps->vy[i] = s[5];
+        ps->vz[i] = s[6];
+        ps->h[i] = s[7];
+    }
+}
+
+/*
+ * Copies the test particles begin to end from the host to the device of w.
+ */
+static void upload(worker_t* w, const tparticles_t* ps, cl_float8* staging,
+                   int begin, int end)
+{
+    if (begin >= end) {
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        cl_float8 temp = {{ps->x[i],  ps->y[i],  ps->z[i],  ps->m[i],
+                           ps->vx[i], ps->vy[i], ps->vz[i], ps->h[i]}};
+        staging[i] = temp;
+    }
+    cl_int err = clEnqueueWriteBuffer(w->queue, w->d_tParticles, CL_TRUE,
+                                      begin*sizeof(cl_float8),
+                                      (end - begin)*sizeof(cl_float8),
+                                      staging + begin, 0, NULL, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Error copying data to device\n");
+        exit(-1);
+    }
+}
+
+/*
+ * Splits n test particles into a range per worker, with a share
+ * proportional to its rate. The boundaries are multiples of granularity, so
+ * the ranges of the devices start on a work-group, and the last worker
+ * takes the rest. Returns 0 if no worker has a rate yet.
+ */
+static int partition(const worker_t* workers, int numWorkers, int n,
+                     int granularity, int* begin, int* end)
+{
+    double total = 0.0;
+    for (int w = 0; w < numWorkers; w++) {
+        total += workers[w].rate;
+    }
+    if (total <= 0.0) {
+        return 0;
+    }
+    double sum = 0.0;
+    begin[0] = 0;
+    for (int w = 0; w < numWorkers - 1; w++) {
+        sum += workers[w].rate;
+        int boundary = (int)floor(n*sum / total / granularity + 0.5)
+                       *granularity;
+        boundary = boundary < begin[w] ? begin[w] : boundary;
+        boundary = boundary > n ? n : boundary;
+        end[w] = boundary;
+        begin[w + 1] = boundary;
+    }
+    end[numWorkers - 1] = n;
+    return 1;
+}
+
+/*
+ * Moves the boundaries between the ranges of the workers so each gets a
+ * share of the test particles proportional to its measured throughput
+ * (see partition()). Only the test particles which change hands are
+ * copied: first from the devices which give them up to the host, then from
+ * the host to the devices which take them over. Returns the number of test
+ * particles which were moved.
+ */
+static int rebalance(worker_t* workers, int numWorkers, tparticles_t* ps,
+                     cl_float8* staging, int granularity)
+{
+    int begin[MAX_DEVICES + 1];
+    int end[MAX_DEVICES + 1];
+    if (!partition(workers, numWorkers, ps->n, granularity, begin, end)) {
+        return 0;
+    }
+    int shift = 0;
+    for (int w = 0; w < numWorkers; w++) {
+        int move = abs(end[w] - workers[w].end);
+        shift = move > shift ? move : shift;
+    }
+    int threshold = (int)(MIN_MOVE*ps->n);
+    if (shift == 0 || shift < (threshold > granularity ? threshold
+                                                       : granularity)) {
+        return 0;
+    }
+
+    int moved = 0;
+    for (int w = 0; w < numWorkers; w++) {
+        worker_t* wk = &workers[w];
+        int lostEnd = wk->end < begin[w] ? wk->end : begin[w];
+        int lostBegin = wk->begin > end[w] ? wk->begin : end[w];
+        if (wk->queue != NULL) {
+            download(wk, ps, staging, wk->begin, lostEnd);
+            download(wk, ps, staging, lostBegin, wk->end);
+        }
+        moved += (lostEnd > wk->begin ? lostEnd - wk->begin : 0)
+                 + (wk->end > lostBegin ? wk->end - lostBegin : 0);
+    }
+    for (int w = 0; w < numWorkers; w++) {
+        worker_t* wk = &workers[w];
+        if (wk->queue != NULL) {
+            int gainedEnd = end[w] < wk->begin ? end[w] : wk->begin;
+            int gainedBegin = begin[w] > wk->end ? begin[w] : wk->end;
+            upload(wk, ps, staging, begin[w], gainedEnd);
+            upload(wk, ps, staging, gainedBegin, end[w]);
+        }
+        wk->begin = begin[w];
+        wk->end = end[w];
+    }
+    return moved;
+}
+
+/*
+ * Updates the test particles on the CPU and on one or more OpenCL devices
+ * at the same time. The test particles are split into a range per device
+ * and the rest for the CPU, and the split follows the throughput of each
+ * of them on the last steps. The pseudo-particles are copied to every
+ * device once, so only test particles which move to another worker are
+ * copied during the run.
+ */
+int main(int argc, char* argv[])
+{
+    // options
+    ocl_options_t oclOptions;
+    takeOclOptions(&argc, argv, &oclOptions);
+    char* threadsOption = takeOption(&argc, argv, "--threads");
+    const int numThreads = threadsOption ? atoi(threadsOption) : 1;
+    char* kernelOption = takeOption(&argc, argv, "--kernel");
+    const int fastRsqrt = takeFlag(&argc, argv, "--fast-rsqrt");
+    char* unrollOption = takeOption(&argc, argv, "--unroll");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    char* splitOption = takeOption(&argc, argv, "--split");
+    const int fixedSplit = takeFlag(&argc, argv, "--static");
+    char* inputFile = takeOption(&argc, argv, "--input");
+
+    if (argc != 7) {
+        fprintf(stderr, "requires 6 command line arguments:\n");
+        fprintf(stderr, "\tlocal work group size (test particles, work-items per test particle)\n");
+        fprintf(stderr, "\t#test particles\n\t#pseudo-particles\n");
+        fprintf(stderr, "\t#iterations\n\tsize of time step\n");
+        fprintf(stderr, "options:\n");
+        fprintf(stderr, "\t--devices LIST\tOpenCL devices as PLATFORM:DEVICE,... (default one device)\n");
+        fprintf(stderr, "\t--platform P\tOpenCL platform, by index or name\n");
+        fprintf(stderr, "\t--device-type T\tgpu (default if there is one), cpu, accelerator or all\n");
+        fprintf(stderr, "\t--device D\tindex of the device of that type\n");
+        fprintf(stderr, "\t--cache DIR\treuse the compiled kernels from earlier runs\n");
+        fprintf(stderr, "\t--threads N\tnumber of CPU threads (default 1, 0 = only the devices)\n");
+        fprintf(stderr, "\t--kernel K\tauto, avx512, avx2, sse or scalar\n");
+        fprintf(stderr, "\t--fast-rsqrt\tuse an approximate 1/sqrt on the CPU\n");
+        fprintf(stderr, "\t--unroll U\tunroll factor of the kernel loop (default 4)\n");
+        fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+        fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+        fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive (default 1e-6)\n");
+        fprintf(stderr, "\t--split F\tfraction of the test particles to start with on the CPU\n");
+        fprintf(stderr, "\t--static\tkeep the initial split\n");
+        fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+        exit(-1);
+    }
+
+    const int numTParticles = atoi(argv[3]);
+    const int numPParticles = atoi(argv[4]);
+    const int iterations = atoi(argv[5]);
+    const float timeStep = (float)atof(argv[6]);
+
+    // localSize[0] test particles per work-group, localSize[1] work-items
+    // per test particle, as in gpu_multiple
+    size_t localSize[2] = {atoi(argv[1]), atoi(argv[2])};
+    if (localSize[0] < 1 || localSize[1] < 1) {
+        fprintf(stderr, "Invalid local work group size\n");
+        exit(-1);
+    }
+
+    int precision = PRECISION_FLOAT;
+    if (precisionOption != NULL) {
+        precision = parsePrecision(precisionOption);
+        if (precision < 0) {
+            fprintf(stderr, "Unknown precision %s\n", precisionOption);
+            exit(-1);
+        }
+    }
+    if (!selectKernel(kernelOption, fastRsqrt, precision)) {
+        fprintf(stderr, "Kernel %s is not supported\n", kernelOption);
+        exit(-1);
+    }
+    int integrator = INTEGRATOR_EULER;
+    if (integratorOption != NULL) {
+        integrator = parseIntegrator(integratorOption);
+        if (integrator < 0) {
+            fprintf(stderr, "Unknown integrator %s\n", integratorOption);
+            exit(-1);
+        }
+    }
+    const float tolerance = toleranceOption ? (float)atof(toleranceOption)
+                                            : 1e-6f;
+    selectIntegrator(integrator, tolerance);
+
+    // the devices come first and the CPU, which takes any number of test
+    // particles, last
+    const int numDevices = oclNumDevices(&oclOptions);
+    if (numDevices > MAX_DEVICES) {
+        fprintf(stderr, "At most %d devices are supported\n", MAX_DEVICES);
+        exit(-1);
+    }
+    const int useCpu = numThreads > 0;
+    const int numWorkers = numDevices + useCpu;
+    worker_t* workers = (worker_t*)calloc(numWorkers, sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Error allocating memory for workers\n");
+        exit(-1);
+    }
+
+    // the same kernel as gpu_multiple, except that the number of test
+    // particles changes with the split (see oclNBody_multiple.cl)
+    char buildOptions[512];
+    snprintf(buildOptions, sizeof(buildOptions),
+             "-DUNROLL=%d%s%s -DINTEGRATOR=%d -DTOLERANCE=%af"
+             " -DNUM_PSEUDO=%du -DTIME_STEP=%af"
+             " -DLOCAL_SIZE_0=%u -DLOCAL_SIZE_1=%u",
+             unrollOption ? atoi(unrollOption) : 4,
+             precision == PRECISION_DOUBLE ? " -DUSE_DOUBLE" : "",
+             precision == PRECISION_KAHAN ? " -DUSE_KAHAN" : "",
+             integrator, tolerance, numPParticles, timeStep,
+             (unsigned)localSize[0], (unsigned)localSize[1]);
+    // size of an element of the tile in the kernel
+    const size_t realSize = precision == PRECISION_DOUBLE
+                            ? 4*sizeof(cl_double) : 4*sizeof(cl_float);
+
+    // the queues time the kernels, which gives the throughput of the devices
+    oclOptions.profiling = 1;
+    for (int d = 0; d < numDevices; d++) {
+        worker_t* w = &workers[d];
+        cl_platform_id platform;
+        cl_device_id device;
+        oclSetupDevice(d, &platform, &device, &w->context, &w->queue,
+                       &w->program, "oclNBody_multiple.cl", buildOptions,
+                       &oclOptions);
+        char deviceName[96] = "";
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1,
+                        deviceName, NULL);
+        snprintf(w->name, sizeof(w->name), "device %d (%s)", d, deviceName);
+    }
+    if (useCpu) {
+        snprintf(workers[numDevices].name, sizeof(workers[0].name),
+                 "cpu (%s, %d threads)", kernelName(), numThreads);
+    }
+
+    // particles read from a file, instead of random ones
+    dataset_t* input = NULL;
+    if (inputFile != NULL) {
+        input = readDataset(inputFile);
+        if (numTParticles > input->numTParticles
+                || numPParticles > input->numPParticles) {
+            fprintf(stderr, "%s only has %d test particles and %d "
+                    "pseudo-particles\n", inputFile, input->numTParticles,
+                    input->numPParticles);
+            exit(-1);
+        }
+    }
+
+    // initialize pseudo-particles
+    float* x = (float*)malloc(numPParticles*sizeof(float));
+    float* y = (float*)malloc(numPParticles*sizeof(float));
+    float* z = (float*)malloc(numPParticles*sizeof(float));
+    float* m = (float*)malloc(numPParticles*sizeof(float));
+    size_t pParticles_size = numPParticles*sizeof(cl_float4);
+    cl_float4* h_pParticles = (cl_float4*)malloc(pParticles_size);
+    if (x == NULL || y == NULL || z == NULL || m == NULL
+            || h_pParticles == NULL) {
+        fprintf(stderr, "Error allocating memory for pseudo-particles\n");
+        exit(-1);
+    }
+    for (int i = 0; i < numPParticles; i++) {
+        if (input != NULL) {
+            x[i] = input->x[i];
+            y[i] = input->y[i];
+            z[i] = input->z[i];
+            m[i] = input->m[i];
+        } else {
+            x[i] = rand();
+            y[i] = rand();
+            z[i] = rand();
+            m[i] = rand();
+        }
+        cl_float4 temp = {{x[i], y[i], z[i], m[i]}};
+        h_pParticles[i] = temp;
+    }
+    field_t field = {x, y, z, m, numPParticles, NULL, NULL};
+
+    // initialize test particles
+    tparticles_t* tParticles = createTParticles(numTParticles);
+    for (int i = 0; i < numTParticles; i++) {
+        if (input != NULL) {
+            tParticles->x[i] = input->tx[i];
+            tParticles->y[i] = input->ty[i];
+            tParticles->z[i] = input->tz[i];
+            tParticles->m[i] = input->tm[i];
+            tParticles->vx[i] = input->tvx[i];
+            tParticles->vy[i] = input->tvy[i];
+            tParticles->vz[i] = input->tvz[i];
+        } else {
+            tParticles->x[i] = rand();
+            tParticles->y[i] = rand();
+            tParticles->z[i] = rand();
+            tParticles->m[i] = rand() % 500;
+            tParticles->vx[i] = rand() % 5;
+            tParticles->vy[i] = rand() % 5;
+            tParticles->vz[i] = rand() % 5;
+        }
+    }
+    if (input != NULL) {
+        freeDataset(input);
+    }
+    cl_float8* staging = (cl_float8*)malloc((numTParticles > 0
+                                             ? numTParticles : 1)
+                                            *sizeof(cl_float8));
+    if (staging == NULL) {
+        fprintf(stderr, "Error allocating memory for test particles\n");
+        exit(-1);
+    }
+
+    // the initial split: --split F on the CPU and the rest evenly on the
+    // devices, or evenly on all of them. Starting from an even split, the
+    // first step measures every worker.
+    const float cpuShare = useCpu ? (splitOption ? (float)atof(splitOption)
+                                                 : 1.0f / numWorkers)
+                                  : 0.0f;
+    for (int w = 0; w < numWorkers; w++) {
+        workers[w].rate = w < numDevices
+                          ? (1.0 - cpuShare) / numDevices : cpuShare;
+    }
+    int split[2][MAX_DEVICES + 1];
+    partition(workers, numWorkers, numTParticles, localSize[0], split[0],
+              split[1]);
+    for (int w = 0; w < numWorkers; w++) {
+        workers[w].begin = split[0][w];
+        workers[w].end = split[1][w];
+        workers[w].rate = 0.0;
+    }
+
+    // copy data to the devices
+    cl_uint len2 = numPParticles;
+    for (int d = 0; d < numDevices; d++) {
+        worker_t* w = &workers[d];
+        cl_int err;
+        w->d_pParticles = clCreateBuffer(w->context, CL_MEM_READ_ONLY,
+                                         pParticles_size > 0
+                                         ? pParticles_size : 1, NULL, &err);
+        w->d_tParticles = clCreateBuffer(w->context, CL_MEM_READ_WRITE,
+                                         (numTParticles > 0 ? numTParticles
+                                                            : 1)
+                                         *sizeof(cl_float8), NULL, &err);
+        if (err != 0) {
+            fprintf(stderr, "Error creating buffers\n");
+            exit(-1);
+        }
+        if (numPParticles > 0) {
+            err = clEnqueueWriteBuffer(w->queue, w->d_pParticles, CL_TRUE, 0,
+                                       pParticles_size, h_pParticles, 0,
+                                       NULL, NULL);
+        }
+        if (err != 0) {
+            fprintf(stderr, "Error copying data to device\n");
+            exit(-1);
+        }
+        upload(w, tParticles, staging, w->begin, w->end);
+
+        w->kernel = clCreateKernel(w->program, "step", &err);
+        if (err != 0) {
+            fprintf(stderr, "Error creating kernels\n");
+            exit(-1);
+        }
+        // argument 2, the end of the range, is set before every launch
+        err  = clSetKernelArg(w->kernel, 0, sizeof(cl_mem), &w->d_tParticles);
+        err |= clSetKernelArg(w->kernel, 1, sizeof(cl_mem), &w->d_pParticles);
+        err |= clSetKernelArg(w->kernel, 3, sizeof(cl_uint), &len2);
+        err |= clSetKernelArg(w->kernel, 4, sizeof(float), &timeStep);
+        err |= clSetKernelArg(w->kernel, 5, localSize[0]*localSize[1]
+                                            *realSize, NULL);
+        if (err != 0) {
+            fprintf(stderr, "Error setting kernel arguments\n");
+            exit(-1);
+        }
+    }
+    free(h_pParticles);
+
+    // print initial position of first test particle
+    printf("position: (%.12f, %.12f, %.12f)\n",
+            tParticles->x[0], tParticles->y[0], tParticles->z[0]);
+
+    // each step starts the devices, updates the range of the CPU while they
+    // run and then waits for them
+    engine_t* engine = useCpu ? engineCreate(numThreads) : NULL;
+    int rebalances = 0;
+    double moved = 0.0;
+    double begin = wallTime();
+    for (int i = 0; i < iterations; i++) {
+        for (int d = 0; d < numDevices; d++) {
+            worker_t* w = &workers[d];
+            if (w->begin == w->end) {
+                continue;
+            }
+            cl_uint len1 = w->end;
+            size_t offset[2] = {w->begin, 0};
+            size_t globalSize[2] = {(w->end - w->begin + localSize[0] - 1)
+                                    / localSize[0]*localSize[0],
+                                    localSize[1]};
+            cl_int err = clSetKernelArg(w->kernel, 2, sizeof(cl_uint), &len1);
+            err |= clEnqueueNDRangeKernel(w->queue, w->kernel, 2, offset,
+                                          globalSize, localSize, 0, NULL,
+                                          &w->event);
+            if (err != 0) {
+                fprintf(stderr, "Error executing step kernel\n");
+                exit(-1);
+            }
+            clFlush(w->queue);
+        }
+
+        if (useCpu) {
+            worker_t* w = &workers[numDevices];
+            if (w->begin < w->end) {
+                double stepBegin = wallTime();
+                tparticles_t slice = sliceTParticles(tParticles, w->begin,
+                                                     w->end - w->begin);
+                engineStep(engine, &slice, &field, timeStep);
+                double seconds = wallTime() - stepBegin;
+                w->seconds += seconds;
+                w->updated += w->end - w->begin;
+                double rate = (w->end - w->begin) / seconds;
+                w->rate = w->rate > 0.0 ? (1.0 - SMOOTHING)*w->rate
+                                          + SMOOTHING*rate
+                                        : rate;
+            }
+        }
+
+        // from the time the kernel was enqueued, so the launch latency
+        // counts against the device
+        for (int d = 0; d < numDevices; d++) {
+            worker_t* w = &workers[d];
+            if (w->begin == w->end) {
+                continue;
+            }
+            clWaitForEvents(1, &w->event);
+            cl_ulong queued = 0;
+            cl_ulong end = 0;
+            clGetEventProfilingInfo(w->event, CL_PROFILING_COMMAND_QUEUED,
+                                    sizeof(cl_ulong), &queued, NULL);
+            clGetEventProfilingInfo(w->event, CL_PROFILING_COMMAND_END,
+                                    sizeof(cl_ulong), &end, NULL);
+            clReleaseEvent(w->event);
+            double seconds = (end - queued)*1e-9;
+            w->seconds += seconds;
+            w->updated += w->end - w->begin;
+            if (seconds > 0.0) {
+                double rate = (w->end - w->begin) / seconds;
+                w->rate = w->rate > 0.0 ? (1.0 - SMOOTHING)*w->rate
+                                          + SMOOTHING*rate
+                                        : rate;
+            }
+        }
+
+        if (!fixedSplit && i + 1 < iterations) {
+            int count = rebalance(workers, numWorkers, tParticles, staging,
+                                  localSize[0]);
+            if (count > 0) {
+                rebalances++;
+                moved += count;
+            }
+        }
+    }
+    double seconds = wallTime() - begin;
+    if (engine != NULL) {
+        engineDestroy(engine);
+    }
+
+    // copy the ranges of the devices back to the host
+    for (int d = 0; d < numDevices; d++) {
+        worker_t* w = &workers[d];
+        download(w, tParticles, staging, w->begin, w->end);
+        clReleaseKernel(w->kernel);
+        clReleaseMemObject(w->d_tParticles);
+        clReleaseMemObject(w->d_pParticles);
+        clReleaseProgram(w->program);
+        clReleaseCommandQueue(w->queue);
+        clReleaseContext(w->context);
+    }
+
+    // print final position of first test particle
+    printf("position: (%.12f, %.12f, %.12f)\n",
+            tParticles->x[0], tParticles->y[0], tParticles->z[0]);
+    double interactions = (double)numTParticles*numPParticles*iterations;
+    printf("time: %.3f s, %.3e interactions/s (hybrid, %s, %s)\n", seconds,
+           interactions / seconds, precisionName(), integratorName());
+
+    // the final split and the throughput of every worker on its own
+    for (int w = 0; w < numWorkers; w++) {
+        const worker_t* wk = &workers[w];
+        printf("%s: %d test particles (%.1f%%), %.3e interactions/s\n",
+               wk->name, wk->end - wk->begin,
+               numTParticles > 0 ? 100.0*(wk->end - wk->begin)
+                                   / numTParticles : 0.0,
+               wk->seconds > 0.0 ? wk->updated*numPParticles / wk->seconds
+                                 : 0.0);
+    }
+    printf("rebalanced %d times, moving %.0f test particles\n", rebalances,
+           moved);
+
+    freeTParticles(tParticles);
+    free(staging);
+    free(workers);
+    free(x);
+    free(y);
+    free(z);
+    free(m);
+}
@@ -0,0 +1,704 @@
+#include <math.h>
+
+#include "particle.h"
+#include "kernels.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar kernels. If fast is zero, 1/r is calculated in double precision,
+ * exactly as the original version of updateParticle(). Otherwise it is
+ * calculated in single precision, which avoids the conversions to and
+ * from double.
+ */
+static inline void accelScalarBody(float px, float py, float pz,
+                                   const float* x, const float* y,
+                                   const float* z, const float* m, int n,
+                                   float* a, const int fast)
+{
+    float ax = a[0];
+    float ay = a[1];
+    float az = a[2];
+
+    for (int i = 0; i < n; i++) {
+        float dx = x[i] - px;
+        float dy = y[i] - py;
+        float dz = z[i] - pz;
+
+        float invr;
+        if (fast) {
+            invr = 1.0f / sqrtf(dx*dx + dy*dy + dz*dz + (float)EPSILON);
+        } else {
+            invr = 1.0 / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
+        }
+        float invr3 = invr*invr*invr;
+        float f = m[i] * invr3;
+
+        ax += f * dx;
+        ay += f * dy;
+        az += f * dz;
+    }
+
+    a[0] = ax;
+    a[1] = ay;
+    a[2] = az;
+}
+
+/*
+ * Reference kernel.
+ */
+void accelScalar(float px, float py, float pz,
+                 const float* x, const float* y, const float* z,
+                 const float* m, int n, float* a)
+{
+    accelScalarBody(px, py, pz, x, y, z, m, n, a, 0);
+}
+
+void accelScalarFast(float px, float py, float pz,
+                     const float* x, const float* y, const float* z,
+                     const float* m, int n, float* a)
+{
+    accelScalarBody(px, py, pz, x, y, z, m, n, a, 1);
+}
+
+/*
+ * Adds v to sum, keeping the rounding error in c (Kahan summation).
+ * The true sum is sum - c.
+ */
+static inline void kahanAdd(float* sum, float* c, float v)
+{
+    float y = v - *c;
+    float t = *sum + y;
+    *c = (t - *sum) - y;
+    *sum = t;
+}
+
+/*
+ * Reference kernel with compensated (Kahan) summation, so the error of the
+ * sum does not grow with the number of pseudo-particles.
+ */
+void accelScalarKahan(float px, float py, float pz,
+                      const float* x, const float* y, const float* z,
+                      const float* m, int n, float* a)
+{
+    float ax = a[0], cx = 0.0f;
+    float ay = a[1], cy = 0.0f;
+    float az = a[2], cz = 0.0f;
+
+    for (int i = 0; i < n; i++) {
+        float dx = x[i] - px;
+        float dy = y[i] - py;
+        float dz = z[i] - pz;
+
+        float invr = 1.0 / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
+        float invr3 = invr*invr*invr;
+        float f = m[i] * invr3;
+
+        kahanAdd(&ax, &cx, f * dx);
+        kahanAdd(&ay, &cy, f * dy);
+        kahanAdd(&az, &cz, f * dz);
+    }
+
+    a[0] = ax - cx;
+    a[1] = ay - cy;
+    a[2] = az - cz;
+}
+
+/*
+ * Adds the accelerations caused by n pseudo-particles, calculated in double
+ * precision, to sum[0], sum[1] and sum[2].
+ */
+static inline void accelScalarDoubleSum(float px, float py, float pz,
+                                        const float* x, const float* y,
+                                        const float* z, const float* m,
+                                        int n, double* sum)
+{
+    for (int i = 0; i < n; i++) {
+        double dx = (double)x[i] - px;
+        double dy = (double)y[i] - py;
+        double dz = (double)z[i] - pz;
+
+        double invr = 1.0 / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
+        double f = m[i] * (invr*invr*invr);
+
+        sum[0] += f * dx;
+        sum[1] += f * dy;
+        sum[2] += f * dz;
+    }
+}
+
+/*
+ * Reference kernel in double precision. The sum is only rounded to single
+ * precision once it is added to a.
+ */
+void accelScalarDouble(float px, float py, float pz,
+                       const float* x, const float* y, const float* z,
+                       const float* m, int n, float* a)
+{
+    double sum[3] = {0.0, 0.0, 0.0};
+    accelScalarDoubleSum(px, py, pz, x, y, z, m, n, sum);
+    a[0] = (float)(a[0] + sum[0]);
+    a[1] = (float)(a[1] + sum[1]);
+    a[2] = (float)(a[2] + sum[2]);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * SSE, 4 pseudo-particles at a time.
+ */
+__attribute__((target("sse2")))
+static inline void accelSseBody(float px, float py, float pz,
+                                const float* x, const float* y,
+                                const float* z, const float* m, int n,
+                                float* a, const int fast)
+{
+    const __m128 vpx = _mm_set1_ps(px);
+    const __m128 vpy = _mm_set1_ps(py);
+    const __m128 vpz = _mm_set1_ps(pz);
+    const __m128 eps = _mm_set1_ps((float)EPSILON);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threeHalves = _mm_set1_ps(1.5f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 ax = _mm_setzero_ps();
+    __m128 ay = _mm_setzero_ps();
+    __m128 az = _mm_setzero_ps();
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), vpx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), vpy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + i), vpz);
+
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                          _mm_mul_ps(dy, dy)),
+                               _mm_add_ps(_mm_mul_ps(dz, dz), eps));
+        __m128 invr;
+        if (fast) {
+            // y' = y * (1.5 - 0.5 * r2 * y * y)
+            invr = _mm_rsqrt_ps(r2);
+            invr = _mm_mul_ps(invr, _mm_sub_ps(threeHalves,
+                       _mm_mul_ps(_mm_mul_ps(half, r2),
+                                  _mm_mul_ps(invr, invr))));
+        } else {
+            invr = _mm_div_ps(one, _mm_sqrt_ps(r2));
+        }
+        __m128 invr3 = _mm_mul_ps(_mm_mul_ps(invr, invr), invr);
+        __m128 f = _mm_mul_ps(_mm_loadu_ps(m + i), invr3);
+
+        ax = _mm_add_ps(ax, _mm_mul_ps(f, dx));
+        ay = _mm_add_ps(ay, _mm_mul_ps(f, dy));
+        az = _mm_add_ps(az, _mm_mul_ps(f, dz));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, ax);
+    a[0] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm_storeu_ps(lanes, ay);
+    a[1] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm_storeu_ps(lanes, az);
+    a[2] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    accelScalarFast(px, py, pz, x + i, y + i, z + i, m + i, n - i, a);
+}
+
+/*
+ * AVX2 and FMA, 8 pseudo-particles at a time.
+ */
+__attribute__((target("avx2,fma")))
+static inline void accelAvx2Body(float px, float py, float pz,
+                                 const float* x, const float* y,
+                                 const float* z, const float* m, int n,
+                                 float* a, const int fast)
+{
+    const __m256 vpx = _mm256_set1_ps(px);
+    const __m256 vpy = _mm256_set1_ps(py);
+    const __m256 vpz = _mm256_set1_ps(pz);
+    const __m256 eps = _mm256_set1_ps((float)EPSILON);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 ax = _mm256_setzero_ps();
+    __m256 ay = _mm256_setzero_ps();
+    __m256 az = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vpx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vpy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), vpz);
+
+        __m256 r2 = _mm256_fmadd_ps(dx, dx, eps);
+        r2 = _mm256_fmadd_ps(dy, dy, r2);
+        r2 = _mm256_fmadd_ps(dz, dz, r2);
+
+        __m256 invr;
+        if (fast) {
+            invr = _mm256_rsqrt_ps(r2);
+            invr = _mm256_mul_ps(invr, _mm256_fnmadd_ps(
+                       _mm256_mul_ps(half, r2), _mm256_mul_ps(invr, invr),
+                       threeHalves));
+        } else {
+            invr = _mm256_div_ps(one, _mm256_sqrt_ps(r2));
+        }
+        __m256 invr3 = _mm256_mul_ps(_mm256_mul_ps(invr, invr), invr);
+        __m256 f = _mm256_mul_ps(_mm256_loadu_ps(m + i), invr3);
+
+        ax = _mm256_fmadd_ps(f, dx, ax);
+        ay = _mm256_fmadd_ps(f, dy, ay);
+        az = _mm256_fmadd_ps(f, dz, az);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, ax);
+    a[0] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+          + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    _mm256_storeu_ps(lanes, ay);
+    a[1] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+          + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    _mm256_storeu_ps(lanes, az);
+    a[2] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+          + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+
+    accelScalarFast(px, py, pz, x + i, y + i, z + i, m + i, n - i, a);
+}
+
+/*
+ * AVX-512, 16 pseudo-particles at a time. The remainder is handled with
+ * masked loads instead of a scalar loop.
+ */
+__attribute__((target("avx512f")))
+static inline void accelAvx512Body(float px, float py, float pz,
+                                   const float* x, const float* y,
+                                   const float* z, const float* m, int n,
+                                   float* a, const int fast)
+{
+    const __m512 vpx = _mm512_set1_ps(px);
+    const __m512 vpy = _mm512_set1_ps(py);
+    const __m512 vpz = _mm512_set1_ps(pz);
+    const __m512 eps = _mm512_set1_ps((float)EPSILON);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 threeHalves = _mm512_set1_ps(1.5f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 ax = _mm512_setzero_ps();
+    __m512 ay = _mm512_setzero_ps();
+    __m512 az = _mm512_setzero_ps();
+
+    for (int i = 0; i < n; i += 16) {
+        // lanes past the end load a mass of zero and contribute nothing
+        __mmask16 k = n - i >= 16 ? (__mmask16)0xFFFF
+                                  : (__mmask16)((1u << (n - i)) - 1);
+        __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, x + i), vpx);
+        __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, y + i), vpy);
+        __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, z + i), vpz);
+
+        __m512 r2 = _mm512_fmadd_ps(dx, dx, eps);
+        r2 = _mm512_fmadd_ps(dy, dy, r2);
+        r2 = _mm512_fmadd_ps(dz, dz, r2);
+
+        __m512 invr;
+        if (fast) {
+            invr = _mm512_rsqrt14_ps(r2);
+            invr = _mm512_mul_ps(invr, _mm512_fnmadd_ps(
+                       _mm512_mul_ps(half, r2), _mm512_mul_ps(invr, invr),
+                       threeHalves));
+        } else {
+            invr = _mm512_div_ps(one, _mm512_sqrt_ps(r2));
+        }
+        __m512 invr3 = _mm512_mul_ps(_mm512_mul_ps(invr, invr), invr);
+        __m512 f = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, m + i), invr3);
+
+        ax = _mm512_fmadd_ps(f, dx, ax);
+        ay = _mm512_fmadd_ps(f, dy, ay);
+        az = _mm512_fmadd_ps(f, dz, az);
+    }
+
+    a[0] += _mm512_reduce_add_ps(ax);
+    a[1] += _mm512_reduce_add_ps(ay);
+    a[2] += _mm512_reduce_add_ps(az);
+}
+
+/*
+ * SSE with compensated summation in each lane.
+ */
+__attribute__((target("sse2")))
+void accelSseKahan(float px, float py, float pz, const float* x,
+                   const float* y, const float* z, const float* m, int n,
+                   float* a)
+{
+    const __m128 vpx = _mm_set1_ps(px);
+    const __m128 vpy = _mm_set1_ps(py);
+    const __m128 vpz = _mm_set1_ps(pz);
+    const __m128 eps = _mm_set1_ps((float)EPSILON);
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 sum[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+    __m128 c[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d[3];
+        d[0] = _mm_sub_ps(_mm_loadu_ps(x + i), vpx);
+        d[1] = _mm_sub_ps(_mm_loadu_ps(y + i), vpy);
+        d[2] = _mm_sub_ps(_mm_loadu_ps(z + i), vpz);
+
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], d[0]),
+                                          _mm_mul_ps(d[1], d[1])),
+                               _mm_add_ps(_mm_mul_ps(d[2], d[2]), eps));
+        __m128 invr = _mm_div_ps(one, _mm_sqrt_ps(r2));
+        __m128 invr3 = _mm_mul_ps(_mm_mul_ps(invr, invr), invr);
+        __m128 f = _mm_mul_ps(_mm_loadu_ps(m + i), invr3);
+
+        for (int k = 0; k < 3; k++) {
+            __m128 v = _mm_sub_ps(_mm_mul_ps(f, d[k]), c[k]);
+            __m128 t = _mm_add_ps(sum[k], v);
+            c[k] = _mm_sub_ps(_mm_sub_ps(t, sum[k]), v);
+            sum[k] = t;
+        }
+    }
+
+    float lanes[4];
+    float comp[4];
+    for (int k = 0; k < 3; k++) {
+        _mm_storeu_ps(lanes, sum[k]);
+        _mm_storeu_ps(comp, c[k]);
+        a[k] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+              - ((comp[0] + comp[1]) + (comp[2] + comp[3]));
+    }
+
+    accelScalarKahan(px, py, pz, x + i, y + i, z + i, m + i, n - i, a);
+}
+
+/*
+ * SSE in double precision, 2 pseudo-particles per register.
+ */
+__attribute__((target("sse2")))
+void accelSseDouble(float px, float py, float pz, const float* x,
+                    const float* y, const float* z, const float* m, int n,
+                    float* a)
+{
+    const __m128d vp[3] = {_mm_set1_pd(px), _mm_set1_pd(py),
+                           _mm_set1_pd(pz)};
+    const __m128d eps = _mm_set1_pd(EPSILON);
+    const __m128d one = _mm_set1_pd(1.0);
+    __m128d sum[3] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd()};
+    const float* coords[3] = {x, y, z};
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // lower and upper half of 4 pseudo-particles
+        for (int h = 0; h < 2; h++) {
+            __m128d d[3];
+            for (int k = 0; k < 3; k++) {
+                __m128 v = _mm_loadu_ps(coords[k] + i);
+                v = h ? _mm_movehl_ps(v, v) : v;
+                d[k] = _mm_sub_pd(_mm_cvtps_pd(v), vp[k]);
+            }
+            __m128 mv = _mm_loadu_ps(m + i);
+            __m128d mass = _mm_cvtps_pd(h ? _mm_movehl_ps(mv, mv) : mv);
+
+            __m128d r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(d[0], d[0]),
+                                               _mm_mul_pd(d[1], d[1])),
+                                    _mm_add_pd(_mm_mul_pd(d[2], d[2]), eps));
+            __m128d invr = _mm_div_pd(one, _mm_sqrt_pd(r2));
+            __m128d invr3 = _mm_mul_pd(_mm_mul_pd(invr, invr), invr);
+            __m128d f = _mm_mul_pd(mass, invr3);
+
+            for (int k = 0; k < 3; k++) {
+                sum[k] = _mm_add_pd(sum[k], _mm_mul_pd(f, d[k]));
+            }
+        }
+    }
+
+    double total[3];
+    double lanes[2];
+    for (int k = 0; k < 3; k++) {
+        _mm_storeu_pd(lanes, sum[k]);
+        total[k] = lanes[0] + lanes[1];
+    }
+    accelScalarDoubleSum(px, py, pz, x + i, y + i, z + i, m + i, n - i,
+                         total);
+    for (int k = 0; k < 3; k++) {
+        a[k] = (float)(a[k] + total[k]);
+    }
+}
+
+/*
+ * AVX2 with compensated summation in each lane. The products are not
+ * fused into the additions, since that would defeat the compensation.
+ */
+__attribute__((target("avx2,fma")))
+void accelAvx2Kahan(float px, float py, float pz, const float* x,
+                    const float* y, const float* z, const float* m, int n,
+                    float* a)
+{
+    const __m256 vpx = _mm256_set1_ps(px);
+    const __m256 vpy = _mm256_set1_ps(py);
+    const __m256 vpz = _mm256_set1_ps(pz);
+    const __m256 eps = _mm256_set1_ps((float)EPSILON);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 sum[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps()};
+    __m256 c[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                   _mm256_setzero_ps()};
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d[3];
+        d[0] = _mm256_sub_ps(_mm256_loadu_ps(x + i), vpx);
+        d[1] = _mm256_sub_ps(_mm256_loadu_ps(y + i), vpy);
+        d[2] = _mm256_sub_ps(_mm256_loadu_ps(z + i), vpz);
+
+        __m256 r2 = _mm256_fmadd_ps(d[0], d[0], eps);
+        r2 = _mm256_fmadd_ps(d[1], d[1], r2);
+        r2 = _mm256_fmadd_ps(d[2], d[2], r2);
+        __m256 invr = _mm256_div_ps(one, _mm256_sqrt_ps(r2));
+        __m256 invr3 = _mm256_mul_ps(_mm256_mul_ps(invr, invr), invr);
+        __m256 f = _mm256_mul_ps(_mm256_loadu_ps(m + i), invr3);
+
+        for (int k = 0; k < 3; k++) {
+            __m256 v = _mm256_fmsub_ps(f, d[k], c[k]);
+            __m256 t = _mm256_add_ps(sum[k], v);
+            c[k] = _mm256_sub_ps(_mm256_sub_ps(t, sum[k]), v);
+            sum[k] = t;
+        }
+    }
+
+    float lanes[8];
+    float comp[8];
+    for (int k = 0; k < 3; k++) {
+        _mm256_storeu_ps(lanes, sum[k]);
+        _mm256_storeu_ps(comp, c[k]);
+        a[k] += (((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]))
+                 + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])))
+              - (((comp[0] + comp[1]) + (comp[2] + comp[3]))
+                 + ((comp[4] + comp[5]) + (comp[6] + comp[7])));
+    }
+
+    accelScalarKahan(px, py, pz, x + i, y + i, z + i, m + i, n - i, a);
+}
+
+/*
+ * AVX2 and FMA in double precision, 4 pseudo-particles at a time.
+ */
+__attribute__((target("avx2,fma")))
+void accelAvx2Double(float px, float py, float pz, const float* x,
+                     const float* y, const float* z, const float* m, int n,
+                     float* a)
+{
+    const __m256d vpx = _mm256_set1_pd(px);
+    const __m256d vpy = _mm256_set1_pd(py);
+    const __m256d vpz = _mm256_set1_pd(pz);
+    const __m256d eps = _mm256_set1_pd(EPSILON);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d ax = _mm256_setzero_pd();
+    __m256d ay = _mm256_setzero_pd();
+    __m256d az = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i)), vpx);
+        __m256d dy = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(y + i)), vpy);
+        __m256d dz = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(z + i)), vpz);
+
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, eps);
+        r2 = _mm256_fmadd_pd(dy, dy, r2);
+        r2 = _mm256_fmadd_pd(dz, dz, r2);
+        __m256d invr = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+        __m256d invr3 = _mm256_mul_pd(_mm256_mul_pd(invr, invr), invr);
+        __m256d f = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(m + i)),
+                                  invr3);
+
+        ax = _mm256_fmadd_pd(f, dx, ax);
+        ay = _mm256_fmadd_pd(f, dy, ay);
+        az = _mm256_fmadd_pd(f, dz, az);
+    }
+
+    double total[3];
+    double lanes[4];
+    _mm256_storeu_pd(lanes, ax);
+    total[0] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm256_storeu_pd(lanes, ay);
+    total[1] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    _mm256_storeu_pd(lanes, az);
+    total[2] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    accelScalarDoubleSum(px, py, pz, x + i, y + i, z + i, m + i, n - i,
+                         total);
+    for (int k = 0; k < 3; k++) {
+        a[k] = (float)(a[k] + total[k]);
+    }
+}
+
+/*
+ * AVX-512 with compensated summation in each lane. Lanes past the end
+ * load a mass of zero and add nothing.
+ */
+__attribute__((target("avx512f")))
+void accelAvx512Kahan(float px, float py, float pz, const float* x,
+                      const float* y, const float* z, const float* m, int n,
+                      float* a)
+{
+    const __m512 vpx = _mm512_set1_ps(px);
+    const __m512 vpy = _mm512_set1_ps(py);
+    const __m512 vpz = _mm512_set1_ps(pz);
+    const __m512 eps = _mm512_set1_ps((float)EPSILON);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 sum[3] = {_mm512_setzero_ps(), _mm512_setzero_ps(),
+                     _mm512_setzero_ps()};
+    __m512 c[3] = {_mm512_setzero_ps(), _mm512_setzero_ps(),
+                   _mm512_setzero_ps()};
+
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 k = n - i >= 16 ? (__mmask16)0xFFFF
+                                  : (__mmask16)((1u << (n - i)) - 1);
+        __m512 d[3];
+        d[0] = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, x + i), vpx);
+        d[1] = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, y + i), vpy);
+        d[2] = _mm512_sub_ps(_mm512_maskz_loadu_ps(k, z + i), vpz);
+
+        __m512 r2 = _mm512_fmadd_ps(d[0], d[0], eps);
+        r2 = _mm512_fmadd_ps(d[1], d[1], r2);
+        r2 = _mm512_fmadd_ps(d[2], d[2], r2);
+        __m512 invr = _mm512_div_ps(one, _mm512_sqrt_ps(r2));
+        __m512 invr3 = _mm512_mul_ps(_mm512_mul_ps(invr, invr), invr);
+        __m512 f = _mm512_mul_ps(_mm512_maskz_loadu_ps(k, m + i), invr3);
+
+        for (int j = 0; j < 3; j++) {
+            __m512 v = _mm512_fmsub_ps(f, d[j], c[j]);
+            __m512 t = _mm512_add_ps(sum[j], v);
+            c[j] = _mm512_sub_ps(_mm512_sub_ps(t, sum[j]), v);
+            sum[j] = t;
+        }
+    }
+
+    for (int j = 0; j < 3; j++) {
+        a[j] += _mm512_reduce_add_ps(sum[j]) - _mm512_reduce_add_ps(c[j]);
+    }
+}
+
+/*
+ * AVX-512 in double precision, 8 pseudo-particles at a time.
+ */
+__attribute__((target("avx512f")))
+void accelAvx512Double(float px, float py, float pz, const float* x,
+                       const float* y, const float* z, const float* m, int n,
+                       float* a)
+{
+    const __m512d vpx = _mm512_set1_pd(px);
+    const __m512d vpy = _mm512_set1_pd(py);
+    const __m512d vpz = _mm512_set1_pd(pz);
+    const __m512d eps = _mm512_set1_pd(EPSILON);
+    const __m512d one = _mm512_set1_pd(1.0);
+    __m512d ax = _mm512_setzero_pd();
+    __m512d ay = _mm512_setzero_pd();
+    __m512d az = _mm512_setzero_pd();
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d dx = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x + i)),
+                                   vpx);
+        __m512d dy = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(y + i)),
+                                   vpy);
+        __m512d dz = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(z + i)),
+                                   vpz);
+
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, eps);
+        r2 = _mm512_fmadd_pd(dy, dy, r2);
+        r2 = _mm512_fmadd_pd(dz, dz, r2);
+        __m512d invr = _mm512_div_pd(one, _mm512_sqrt_pd(r2));
+        __m512d invr3 = _mm512_mul_pd(_mm512_mul_pd(invr, invr), invr);
+        __m512d f = _mm512_mul_pd(_mm512_cvtps_pd(_mm256_loadu_ps(m + i)),
+                                  invr3);
+
+        ax = _mm512_fmadd_pd(f, dx, ax);
+        ay = _mm512_fmadd_pd(f, dy, ay);
+        az = _mm512_fmadd_pd(f, dz, az);
+    }
+
+    double total[3] = {_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay),
+                       _mm512_reduce_add_pd(az)};
+    accelScalarDoubleSum(px, py, pz, x + i, y + i, z + i, m + i, n - i,
+                         total);
+    for (int k = 0; k < 3; k++) {
+        a[k] = (float)(a[k] + total[k]);
+    }
+}
+
+__attribute__((target("sse2")))
+void accelSse(float px, float py, float pz, const float* x, const float* y,
+              const float* z, const float* m, int n, float* a)
+{
+    accelSseBody(px, py, pz, x, y, z, m, n, a, 0);
+}
+
+__attribute__((target("sse2")))
+void accelSseFast(float px, float py, float pz, const float* x,
+                  const float* y, const float* z, const float* m, int n,
+                  float* a)
+{
+    accelSseBody(px, py, pz, x, y, z, m, n, a, 1);
+}
+
+__attribute__((target("avx2,fma")))
+void accelAvx2(float px, float py, float pz, const float* x, const float* y,
+               const float* z, const float* m, int n, float* a)
+{
+    accelAvx2Body(px, py, pz, x, y, z, m, n, a, 0);
+}
+
+__attribute__((target("avx2,fma")))
+void accelAvx2Fast(float px, float py, float pz, const float* x,
+                   const float* y, const float* z, const float* m, int n,
+                   float* a)
+{
+    accelAvx2Body(px, py, pz, x, y, z, m, n, a, 1);
+}
+
+__attribute__((target("avx512f")))
+void accelAvx512(float px, float py, float pz, const float* x,
+                 const float* y, const float* z, const float* m, int n,
+                 float* a)
+{
+    accelAvx512Body(px, py, pz, x, y, z, m, n, a, 0);
+}
+
+__attribute__((target("avx512f")))
+void accelAvx512Fast(float px, float py, float pz, const float* x,
+                     const float* y, const float* z, const float* m, int n,
+                     float* a)
+{
+    accelAvx512Body(px, py, pz, x, y, z, m, n, a, 1);
+}
+
+#endif
+
+/*
+ * Generates the exact and fast versions of a kernel for a whole tile of
+ * TILE_SIZE pseudo-particles. Since n is a constant, the compiler can
+ * unroll the loops and drop the code for the remainder.
+ */
+#define DEFINE_TILE_KERNELS(name, body, attributes)                         \
+    attributes void name##Tile(float px, float py, float pz,                \
+                               const float* x, const float* y,              \
+                               const float* z, const float* m, float* a)    \
+    {                                                                       \
+        body(px, py, pz, x, y, z, m, TILE_SIZE, a, 0);                      \
+    }                                                                       \
+    attributes void name##FastTile(float px, float py, float pz,            \
+                                   const float* x, const float* y,          \
+                                   const float* z, const float* m,          \
+                                   float* a)                                \
+    {                                                                       \
+        body(px, py, pz, x, y, z, m, TILE_SIZE, a, 1);                      \
+    }
+
+DEFINE_TILE_KERNELS(accelScalar, accelScalarBody, )
+#ifdef HAVE_X86_KERNELS
+DEFINE_TILE_KERNELS(accelSse, accelSseBody, __attribute__((target("sse2"))))
+DEFINE_TILE_KERNELS(accelAvx2, accelAvx2Body,
+                    __attribute__((target("avx2,fma"))))
+DEFINE_TILE_KERNELS(accelAvx512, accelAvx512Body,
+                    __attribute__((target("avx512f"))))
+#endif
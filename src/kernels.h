@@ -0,0 +1,70 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/*
+ * Kernels which add the acceleration caused by n pseudo-particles on a test
+ * particle at (px, py, pz) to a[0], a[1] and a[2].
+ * The "Fast" versions use an approximate reciprocal square root refined with
+ * one Newton-Raphson iteration instead of an exact square root and division.
+ * The "Kahan" versions use compensated summation and the "Double" versions
+ * calculate and sum in double precision.
+ */
+typedef void (*accel_kernel_t)(float, float, float,
+                               const float*, const float*, const float*,
+                               const float*, int, float*);
+
+/*
+ * The same kernels, specialized for n == TILE_SIZE ("Tile" versions).
+ */
+typedef void (*tile_kernel_t)(float, float, float,
+                              const float*, const float*, const float*,
+                              const float*, float*);
+
+#define DECLARE_TILE_KERNELS(name)                                          \
+    void name##Tile(float, float, float, const float*, const float*,        \
+                    const float*, const float*, float*);                    \
+    void name##FastTile(float, float, float, const float*, const float*,    \
+                        const float*, const float*, float*);
+
+void accelScalar(float, float, float, const float*, const float*,
+                 const float*, const float*, int, float*);
+void accelScalarFast(float, float, float, const float*, const float*,
+                     const float*, const float*, int, float*);
+void accelScalarKahan(float, float, float, const float*, const float*,
+                      const float*, const float*, int, float*);
+void accelScalarDouble(float, float, float, const float*, const float*,
+                       const float*, const float*, int, float*);
+DECLARE_TILE_KERNELS(accelScalar)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+void accelSse(float, float, float, const float*, const float*,
+              const float*, const float*, int, float*);
+void accelSseFast(float, float, float, const float*, const float*,
+                  const float*, const float*, int, float*);
+void accelAvx2(float, float, float, const float*, const float*,
+               const float*, const float*, int, float*);
+void accelAvx2Fast(float, float, float, const float*, const float*,
+                   const float*, const float*, int, float*);
+void accelAvx512(float, float, float, const float*, const float*,
+                 const float*, const float*, int, float*);
+void accelAvx512Fast(float, float, float, const float*, const float*,
+                     const float*, const float*, int, float*);
+void accelSseKahan(float, float, float, const float*, const float*,
+                   const float*, const float*, int, float*);
+void accelSseDouble(float, float, float, const float*, const float*,
+                    const float*, const float*, int, float*);
+DECLARE_TILE_KERNELS(accelSse)
+void accelAvx2Kahan(float, float, float, const float*, const float*,
+                    const float*, const float*, int, float*);
+void accelAvx2Double(float, float, float, const float*, const float*,
+                     const float*, const float*, int, float*);
+DECLARE_TILE_KERNELS(accelAvx2)
+void accelAvx512Kahan(float, float, float, const float*, const float*,
+                      const float*, const float*, int, float*);
+void accelAvx512Double(float, float, float, const float*, const float*,
+                       const float*, const float*, int, float*);
+DECLARE_TILE_KERNELS(accelAvx512)
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapfile.h"
+
+/*
+ * Maps a whole file into memory (read-only).
+ * Returns NULL if the file does not exist or cannot be mapped.
+ */
+mapfile_t* mapFile(const char* filename)
+{
+    mapfile_t* map = (mapfile_t*)calloc(1, sizeof(mapfile_t));
+    if (map == NULL) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        free(map);
+        return NULL;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+                         : NULL;
+    if (data == NULL) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        free(map);
+        return NULL;
+    }
+    map->file = file;
+    map->mapping = mapping;
+    map->size = (size_t)size.QuadPart;
+    map->data = data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        free(map);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        free(map);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        free(map);
+        return NULL;
+    }
+    map->size = st.st_size;
+    map->data = data;
+#endif
+
+    return map;
+}
+
+void unmapFile(mapfile_t* map)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap(map->data, map->size);
+#endif
+    free(map);
+}
+
+/*
+ * Replaces the file at path with the file at tmpPath. On POSIX systems
+ * rename() does this atomically, so readers see either the old or the new
+ * file but never a partially written one.
+ * Returns 0 on success.
+ */
+int replaceFile(const char* tmpPath, const char* path)
+{
+#ifdef _WIN32
+    return MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(tmpPath, path);
+#endif
+}
+
+/*
+ * Rounds an offset up to the next multiple of MAP_ALIGN.
+ */
+size_t alignOffset(size_t offset)
+{
+    return (offset + MAP_ALIGN - 1) / MAP_ALIGN * MAP_ALIGN;
+}
+
+/*
+ * Writes size bytes followed by zeros up to the next multiple of MAP_ALIGN,
+ * so the next section starts aligned. Returns the number of bytes written.
+ */
+size_t writePadded(FILE* fp, const void* data, size_t size)
+{
+    static const char zeros[MAP_ALIGN] = {0};
+    size_t written = fwrite(data, 1, size, fp);
+    written += fwrite(zeros, 1, alignOffset(size) - size, fp);
+    return written;
+}
+
+/*
+ * Flushes a file and waits until its contents have reached the disk.
+ * Returns 0 on success.
+ */
+int syncFile(FILE* fp)
+{
+    if (fflush(fp) != 0) {
+        return -1;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(fp));
+#else
+    return fsync(fileno(fp));
+#endif
+}
+
+/*
+ * 64-bit FNV-1a hash of size bytes, continuing from hash h (HASH_SEED for
+ * a new hash).
+ */
+uint64_t hashBytes(uint64_t h, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
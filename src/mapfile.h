@@ -0,0 +1,34 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// sections of the binary files which are mapped start at multiples of this
+#define MAP_ALIGN 64
+
+// initial value for hashBytes()
+#define HASH_SEED 14695981039346656037ULL
+
+/*
+ * A read-only memory-mapped file.
+ */
+typedef struct {
+    void* data;
+    size_t size;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#endif
+} mapfile_t;
+
+mapfile_t* mapFile(const char*);
+void unmapFile(mapfile_t*);
+int replaceFile(const char*, const char*);
+size_t alignOffset(size_t);
+size_t writePadded(FILE*, const void*, size_t);
+int syncFile(FILE*);
+uint64_t hashBytes(uint64_t, const void*, size_t);
+
+#endif
@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "particle.h"
+#include "octree.h"
+#include "grid.h"
+#include "packed.h"
+#include "cache.h"
+#include "dataset.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "engine.h"
+#include "blockstep.h"
+#include "mapfile.h"
+#include "options.h"
+#include "timer.h"
+
+// fraction of the test particles a boundary between two ranks has to move
+// by at least before the test particles are redistributed
+#define MIN_MOVE 0.01
+
+/*
+ * Returns the arrays of the test particles in the order of a checkpoint:
+ * x, y, z, m, vx, vy, vz, h.
+ */
+static void tparticleArrays(const tparticles_t* ps,
+                            float* arrays[CHECKPOINT_FIELDS])
+{
+    arrays[0] = ps->x;
+    arrays[1] = ps->y;
+    arrays[2] = ps->z;
+    arrays[3] = ps->m;
+    arrays[4] = ps->vx;
+    arrays[5] = ps->vy;
+    arrays[6] = ps->vz;
+    arrays[7] = ps->h;
+}
+
+/*
+ * Copies the test particles of every rank into all, on the root. Rank r
+ * holds counts[r] test particles starting at displs[r].
+ */
+static void gatherTParticles(tparticles_t* all, const tparticles_t* local,
+                             int* counts, int* displs, int rank)
+{
+    float* localArrays[CHECKPOINT_FIELDS];
+    float* allArrays[CHECKPOINT_FIELDS] = {NULL};
+    tparticleArrays(local, localArrays);
+    if (rank == 0) {
+        tparticleArrays(all, allArrays);
+    }
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        MPI_Gatherv(localArrays[k], local->n, MPI_FLOAT, allArrays[k],
+                    counts, displs, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    }
+}
+
+/*
+ * Copies the test particles of every rank from all, on the root, into
+ * local, which has room for counts[rank] test particles.
+ */
+static void scatterTParticles(const tparticles_t* all, tparticles_t* local,
+                              int* counts, int* displs, int rank)
+{
+    float* localArrays[CHECKPOINT_FIELDS];
+    float* allArrays[CHECKPOINT_FIELDS] = {NULL};
+    tparticleArrays(local, localArrays);
+    if (rank == 0) {
+        tparticleArrays(all, allArrays);
+    }
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        MPI_Scatterv(allArrays[k], counts, displs, MPI_FLOAT, localArrays[k],
+                     local->n, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    }
+}
+
+/*
+ * Splits n test particles into consecutive ranges, one per rank, with a
+ * share proportional to the weight of the rank. The boundaries are
+ * multiples of BLOCK_SIZE, so the ranks update whole blocks, unless there
+ * are fewer test particles than that per rank.
+ */
+static void partition(int n, int numRanks, const double* weights,
+                      int* counts, int* displs)
+{
+    const int granularity = n >= numRanks*BLOCK_SIZE ? BLOCK_SIZE : 1;
+    double total = 0.0;
+    for (int r = 0; r < numRanks; r++) {
+        total += weights[r];
+    }
+    double sum = 0.0;
+    int begin = 0;
+    for (int r = 0; r < numRanks; r++) {
+        sum += weights[r];
+        int end = n;
+        if (r < numRanks - 1) {
+            end = (int)floor(n*sum / total / granularity + 0.5)*granularity;
+            end = end < begin ? begin : end;
+            end = end > n ? n : end;
+        }
+        displs[r] = begin;
+        counts[r] = end - begin;
+        begin = end;
+    }
+}
+
+/*
+ * Copies the state of the recorded test particles into the next trajectory
+ * snapshot.
+ */
+static void recordSnapshot(trajectory_t* tr, const tparticles_t* tParticles,
+                           int iteration)
+{
+    int first = trajectoryFirst(tr);
+    size_t size = trajectoryCount(tr)*sizeof(float);
+    float* snapshot = trajectoryBegin(tr);
+    const float* arrays[6] = {tParticles->x, tParticles->y, tParticles->z,
+                              tParticles->vx, tParticles->vy, tParticles->vz};
+    for (int k = 0; k < 6; k++) {
+        memcpy((char*)snapshot + k*size, arrays[k] + first, size);
+    }
+    trajectoryCommit(tr, iteration);
+}
+
+/*
+ * Copies the state of all test particles into the next checkpoint.
+ */
+static void saveCheckpoint(checkpoint_t* ck, const tparticles_t* tParticles,
+                           int iteration)
+{
+    size_t size = tParticles->n*sizeof(float);
+    float* state = checkpointBegin(ck);
+    float* arrays[CHECKPOINT_FIELDS];
+    tparticleArrays(tParticles, arrays);
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        memcpy((char*)state + k*size, arrays[k], size);
+    }
+    checkpointCommit(ck, iteration);
+}
+
+/*
+ * Restores the state of all test particles from a checkpoint.
+ */
+static void restoreCheckpoint(const float* state, tparticles_t* tParticles)
+{
+    size_t size = tParticles->n*sizeof(float);
+    float* arrays[CHECKPOINT_FIELDS];
+    tparticleArrays(tParticles, arrays);
+    for (int k = 0; k < CHECKPOINT_FIELDS; k++) {
+        memcpy(arrays[k], (const char*)state + k*size, size);
+    }
+}
+
+/*
+ * Hashes the pseudo-particles and the options which change the results, in
+ * the same way as cpu_multiple, whose checkpoints can be resumed here and
+ * the other way around.
+ */
+static uint64_t hashRun(const field_t* field, const char** options,
+                        int numOptions)
+{
+    size_t size = field->n*sizeof(float);
+    uint64_t h = HASH_SEED;
+    h = hashBytes(h, field->x, size);
+    h = hashBytes(h, field->y, size);
+    h = hashBytes(h, field->z, size);
+    h = hashBytes(h, field->m, size);
+    for (int i = 0; i < numOptions; i++) {
+        // the terminating zero separates the options
+        const char* option = options[i] ? options[i] : "";
+        h = hashBytes(h, option, strlen(option) + 1);
+    }
+    return h;
+}
+
+/*
+ * The CPU version with multiple test particles, on several processes (MPI
+ * ranks). Every rank holds all pseudo-particles, which the root reads or
+ * creates and broadcasts once, and updates its own range of the test
+ * particles with the threaded engine. Since the test particles do not act
+ * on each other, the ranks only communicate when the root needs all test
+ * particles for a trajectory snapshot or a checkpoint, and when the ranges
+ * are rebalanced. A test particle ends up in the same state as with
+ * cpu_multiple, whichever rank updates it.
+ */
+int main(int argc, char** argv)
+{
+    MPI_Init(&argc, &argv);
+    int rank;
+    int numRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+
+    // options
+    char* threadsOption = takeOption(&argc, argv, "--threads");
+    const int numThreads = threadsOption ? atoi(threadsOption) : 1;
+    char* kernelOption = takeOption(&argc, argv, "--kernel");
+    const int fastRsqrt = takeFlag(&argc, argv, "--fast-rsqrt");
+    char* precisionOption = takeOption(&argc, argv, "--precision");
+    char* storageOption = takeOption(&argc, argv, "--storage");
+    char* integratorOption = takeOption(&argc, argv, "--integrator");
+    char* toleranceOption = takeOption(&argc, argv, "--tolerance");
+    char* levelsOption = takeOption(&argc, argv, "--levels");
+    char* etaOption = takeOption(&argc, argv, "--eta");
+    char* thetaOption = takeOption(&argc, argv, "--theta");
+    char* gridOption = takeOption(&argc, argv, "--grid");
+    char* interpOption = takeOption(&argc, argv, "--interp");
+    char* cacheDir = takeOption(&argc, argv, "--cache");
+    char* rebalanceOption = takeOption(&argc, argv, "--rebalance");
+    char* inputFile = takeOption(&argc, argv, "--input");
+    char* trajectoryFile = takeOption(&argc, argv, "--trajectory");
+    char* strideOption = takeOption(&argc, argv, "--stride");
+    char* subsetOption = takeOption(&argc, argv, "--subset");
+    char* checkpointFile = takeOption(&argc, argv, "--checkpoint");
+    char* everyOption = takeOption(&argc, argv, "--checkpoint-every");
+    const int resume = takeFlag(&argc, argv, "--resume");
+
+    if (argc != 5) {
+        if (rank == 0) {
+            fprintf(stderr, "requires 4 command line arguments:\n");
+            fprintf(stderr, "\t#test particles\n\t#pseudo-particles\n");
+            fprintf(stderr, "\t#iterations\n\tsize of time step\n");
+            fprintf(stderr, "options:\n");
+            fprintf(stderr, "\t--threads N\tnumber of threads per rank (default 1)\n");
+            fprintf(stderr, "\t--rebalance K\tbalance the ranks every K iterations "
+                    "(default 100, 0 = never)\n");
+            fprintf(stderr, "\t--kernel K\tauto, avx512, avx2, sse or scalar\n");
+            fprintf(stderr, "\t--fast-rsqrt\tuse an approximate 1/sqrt\n");
+            fprintf(stderr, "\t--precision P\tfloat (default), kahan or double sums\n");
+            fprintf(stderr, "\t--storage S\tfloat (default), half or bf16 pseudo-particles\n");
+            fprintf(stderr, "\t--integrator I\teuler (default), leapfrog, rk4 or adaptive\n");
+            fprintf(stderr, "\t--tolerance E\trelative error per step with adaptive "
+                    "(default 1e-6)\n");
+            fprintf(stderr, "\t--levels L\tsplit time steps into up to 2^L block "
+                    "steps per test particle\n");
+            fprintf(stderr, "\t--eta E\tfraction of the velocity a block step may "
+                    "change (default 0.01)\n");
+            fprintf(stderr, "\t--theta T\tuse a Barnes-Hut octree with opening angle T\n");
+            fprintf(stderr, "\t--grid N\tinterpolate from N^3 precomputed samples\n");
+            fprintf(stderr, "\t--interp I\tlinear (default) or cubic interpolation\n");
+            fprintf(stderr, "\t--cache DIR\treuse the octree and grid from earlier runs\n");
+            fprintf(stderr, "\t--input FILE\tread the particles from a dataset file\n");
+            fprintf(stderr, "\t--trajectory FILE\twrite the trajectories of the test particles\n");
+            fprintf(stderr, "\t--stride K\trecord every K iterations (default 1)\n");
+            fprintf(stderr, "\t--subset FIRST:COUNT\trecord only COUNT test particles\n");
+            fprintf(stderr, "\t--checkpoint FILE\tsave the test particles periodically\n");
+            fprintf(stderr, "\t--checkpoint-every K\tsave every K iterations (default 100)\n");
+            fprintf(stderr, "\t--resume\tcontinue from the checkpoint, if there is one\n");
+        }
+        exit(-1);
+    }
+    if (resume && checkpointFile == NULL) {
+        fprintf(stderr, "--resume requires --checkpoint\n");
+        exit(-1);
+    }
+
+    int precision = PRECISION_FLOAT;
+    if (precisionOption != NULL) {
+        precision = parsePrecision(precisionOption);
+        if (precision < 0) {
+            fprintf(stderr, "Unknown precision %s\n", precisionOption);
+            exit(-1);
+        }
+    }
+    int storage = STORAGE_FLOAT;
+    if (storageOption != NULL) {
+        storage = parseStorage(storageOption);
+        if (storage < 0) {
+            fprintf(stderr, "Unknown storage %s\n", storageOption);
+            exit(-1);
+        }
+        if (storage != STORAGE_FLOAT && precision != PRECISION_FLOAT) {
+            fprintf(stderr, "--storage requires --precision float\n");
+            exit(-1);
+        }
+    }
+    if (!selectKernel(kernelOption, fastRsqrt, precision)) {
+        fprintf(stderr, "Kernel %s is not supported\n", kernelOption);
+        exit(-1);
+    }
+    int interp = INTERP_LINEAR;
+    if (interpOption != NULL) {
+        interp = parseInterp(interpOption);
+        if (interp < 0) {
+            fprintf(stderr, "Unknown interpolation %s\n", interpOption);
+            exit(-1);
+        }
+    }
+    int integrator = INTEGRATOR_EULER;
+    if (integratorOption != NULL) {
+        integrator = parseIntegrator(integratorOption);
+        if (integrator < 0) {
+            fprintf(stderr, "Unknown integrator %s\n", integratorOption);
+            exit(-1);
+        }
+    }
+    selectIntegrator(integrator,
+                     toleranceOption ? (float)atof(toleranceOption) : 1e-6f);
+    if (levelsOption != NULL && integrator == INTEGRATOR_ADAPTIVE) {
+        fprintf(stderr, "--levels requires a fixed step integrator\n");
+        exit(-1);
+    }
+
+    const int numTParticles = atoi(argv[1]);
+    const int numPParticles = atoi(argv[2]);
+    const int iterations = atoi(argv[3]);
+    const float timeStep = (float)atof(argv[4]);
+    const int rebalanceEvery = rebalanceOption ? atoi(rebalanceOption) : 100;
+    const int stride = strideOption ? atoi(strideOption) : 1;
+    const int checkpointEvery = everyOption ? atoi(everyOption) : 100;
+    if (checkpointFile != NULL && checkpointEvery < 1) {
+        fprintf(stderr, "Invalid checkpoint interval\n");
+        exit(-1);
+    }
+
+    // positions and masses of pseudo-particles, on every rank
+    float* x = (float*)malloc(numPParticles*sizeof(float));
+    float* y = (float*)malloc(numPParticles*sizeof(float));
+    float* z = (float*)malloc(numPParticles*sizeof(float));
+    float* m = (float*)malloc(numPParticles*sizeof(float));
+    if (numPParticles > 0 && (x == NULL || y == NULL || z == NULL
+                              || m == NULL)) {
+        fprintf(stderr, "Error allocating memory for pseudo-particles\n");
+        exit(-1);
+    }
+
+    // all test particles, on the root only
+    tparticles_t* tParticles = NULL;
+    if (rank == 0) {
+        // particles read from a file, instead of random ones
+        dataset_t* input = NULL;
+        if (inputFile != NULL) {
+            input = readDataset(inputFile);
+            if (numTParticles > input->numTParticles
+                    || numPParticles > input->numPParticles) {
+                fprintf(stderr, "%s only has %d test particles and %d "
+                        "pseudo-particles\n", inputFile, input->numTParticles,
+                        input->numPParticles);
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            }
+        }
+
+        // in the same order as cpu_multiple, so the random particles are
+        // the same
+        size_t size = numPParticles*sizeof(float);
+        if (input != NULL) {
+            memcpy(x, input->x, size);
+            memcpy(y, input->y, size);
+            memcpy(z, input->z, size);
+            memcpy(m, input->m, size);
+        } else {
+            for (int i = 0; i < numPParticles; i++) {
+                x[i] = rand();
+                y[i] = rand();
+                z[i] = rand();
+                m[i] = rand();
+            }
+        }
+
+        tParticles = createTParticles(numTParticles);
+        if (input != NULL) {
+            size = numTParticles*sizeof(float);
+            memcpy(tParticles->x, input->tx, size);
+            memcpy(tParticles->y, input->ty, size);
+            memcpy(tParticles->z, input->tz, size);
+            memcpy(tParticles->m, input->tm, size);
+            memcpy(tParticles->vx, input->tvx, size);
+            memcpy(tParticles->vy, input->tvy, size);
+            memcpy(tParticles->vz, input->tvz, size);
+            freeDataset(input);
+        } else {
+            for (int i = 0; i < numTParticles; i++) {
+                tParticles->x[i] = rand();
+                tParticles->y[i] = rand();
+                tParticles->z[i] = rand();
+                tParticles->m[i] = rand() % 500;
+                tParticles->vx[i] = rand() % 5;
+                tParticles->vy[i] = rand() % 5;
+                tParticles->vz[i] = rand() % 5;
+            }
+        }
+    }
+    MPI_Bcast(x, numPParticles, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(y, numPParticles, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(z, numPParticles, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(m, numPParticles, MPI_FLOAT, 0, MPI_COMM_WORLD);
+
+    // pseudo-particles acting on the test particles. With --cache the root
+    // builds the octree and the grid first and the other ranks load them.
+    field_t field = {x, y, z, m, numPParticles, NULL, NULL};
+    octree_t* tree = NULL;
+    grid_t* grid = NULL;
+    for (int turn = 0; turn < 2; turn++) {
+        if ((turn == 0) == (rank == 0) && (thetaOption || gridOption)) {
+            if (thetaOption != NULL) {
+                tree = loadOctree(cacheDir, &field, (float)atof(thetaOption));
+                field.tree = tree;
+            }
+            if (gridOption != NULL) {
+                grid = loadGrid(cacheDir, &field, atoi(gridOption), interp,
+                                numThreads);
+                field.grid = grid;
+            }
+        }
+        if (turn == 0 && cacheDir != NULL) {
+            MPI_Barrier(MPI_COMM_WORLD);
+        }
+    }
+    packed_t* packed = NULL;
+    if (storage != STORAGE_FLOAT) {
+        packed = packCreate(x, y, z, m, 1, numPParticles, storage);
+        field.packed = packed;
+    }
+
+    // continue where an earlier run of the same simulation stopped
+    checkpoint_t* checkpoint = NULL;
+    int start = 0;
+    if (checkpointFile != NULL && rank == 0) {
+        const char* options[] = {kernelName(), precisionName(),
+                                 fastRsqrt ? "fast-rsqrt" : NULL,
+                                 thetaOption, gridOption, interpOption,
+                                 integratorName(), toleranceOption,
+                                 levelsOption, etaOption,
+                                 storageName(storage)};
+        uint64_t runHash = hashRun(&field, options, 11);
+        if (resume) {
+            float* state = readCheckpoint(checkpointFile, numTParticles,
+                                          numPParticles, timeStep, runHash,
+                                          &start);
+            if (state != NULL) {
+                restoreCheckpoint(state, tParticles);
+                free(state);
+                printf("resuming after iteration %d\n", start);
+            }
+        }
+        checkpoint = checkpointOpen(checkpointFile, numTParticles,
+                                    numPParticles, timeStep, runHash);
+    }
+    MPI_Bcast(&start, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    trajectory_t* trajectory = NULL;
+    if (rank == 0) {
+        // how far the 16-bit storage moves the accelerations
+        if (packed != NULL) {
+            double maxError, rmsError;
+            packError(packed, x, y, z, m, 1, tParticles->x, tParticles->y,
+                      tParticles->z, 1, numTParticles, &maxError, &rmsError);
+            printf("storage: %s, relative error of the acceleration: "
+                   "max %.3e, rms %.3e\n", storageName(storage), maxError,
+                   rmsError);
+        }
+
+        // how far the interpolation moves the accelerations and the potential
+        if (grid != NULL) {
+            double maxError, rmsError, maxPotential, rmsPotential;
+            gridError(grid, &field, tParticles->x, tParticles->y, tParticles->z, 1,
+                      numTParticles, &maxError, &rmsError, &maxPotential,
+                      &rmsPotential);
+            printf("grid: %s, relative error of the acceleration: max %.3e, "
+                   "rms %.3e, of the potential: max %.3e, rms %.3e\n",
+                   interpName(interp), maxError, rmsError, maxPotential,
+                   rmsPotential);
+        }
+
+        // print the initial position of the first test particle
+        printf("position: (%.12f, %.12f, %.12f)\n",
+                tParticles->x[0], tParticles->y[0], tParticles->z[0]);
+
+        if (trajectoryFile != NULL) {
+            int first = 0;
+            int count = numTParticles;
+            if (subsetOption != NULL
+                    && sscanf(subsetOption, "%d:%d", &first, &count) != 2) {
+                fprintf(stderr, "--subset requires FIRST:COUNT\n");
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            }
+            trajectory = trajectoryOpen(trajectoryFile, numTParticles, stride,
+                                        first, count, start);
+            // a resumed run records what an uninterrupted run would
+            if (start == 0 || trajectoryDue(trajectory, start)) {
+                recordSnapshot(trajectory, tParticles, start);
+            }
+        }
+    }
+
+    // the range of test particles of each rank, evenly at first
+    int* counts = (int*)malloc(numRanks*sizeof(int));
+    int* displs = (int*)malloc(numRanks*sizeof(int));
+    int* newCounts = (int*)malloc(numRanks*sizeof(int));
+    int* newDispls = (int*)malloc(numRanks*sizeof(int));
+    double* rates = (double*)malloc(numRanks*sizeof(double));
+    double* measured = (double*)malloc(numRanks*sizeof(double));
+    if (counts == NULL || displs == NULL || newCounts == NULL
+            || newDispls == NULL || rates == NULL || measured == NULL) {
+        fprintf(stderr, "Error allocating memory for the ranks\n");
+        exit(-1);
+    }
+    for (int r = 0; r < numRanks; r++) {
+        rates[r] = 1.0;
+    }
+    partition(numTParticles, numRanks, rates, counts, displs);
+    tparticles_t* local = createTParticles(counts[rank]);
+    scatterTParticles(tParticles, local, counts, displs, rank);
+
+    // update particles over a number of iterations
+    engine_t* engine = engineCreate(numThreads);
+    blockstep_t* blocksteps = NULL;
+    const float eta = etaOption ? (float)atof(etaOption) : 0.01f;
+    if (levelsOption != NULL) {
+        blocksteps = blockstepCreate(counts[rank], atoi(levelsOption), eta);
+    }
+    double blockCount = 0.0;    // steps of the block steps freed so far
+    double busy = 0.0;          // time spent on steps since the last balance
+    double totalBusy = 0.0;
+    int stepped = 0;            // iterations since the last balance
+    int rebalances = 0;
+    MPI_Barrier(MPI_COMM_WORLD);
+    double begin = wallTime();
+    for (int i = start; i < iterations; i++) {
+        double stepBegin = wallTime();
+        if (blocksteps != NULL) {
+            blockstepRun(blocksteps, engine, local, &field, timeStep);
+        } else {
+            engineStep(engine, local, &field, timeStep);
+        }
+        busy += wallTime() - stepBegin;
+        stepped++;
+
+        // every rank takes the same decision from the same rates
+        int repartition = 0;
+        if (rebalanceEvery > 0 && (i + 1 - start) % rebalanceEvery == 0
+                && i + 1 < iterations) {
+            double rate = busy > 0.0 ? (double)local->n*stepped / busy : 0.0;
+            MPI_Allgather(&rate, 1, MPI_DOUBLE, measured, 1, MPI_DOUBLE,
+                          MPI_COMM_WORLD);
+            // a rank without test particles keeps its last rate
+            for (int r = 0; r < numRanks; r++) {
+                if (measured[r] > 0.0) {
+                    rates[r] = measured[r];
+                }
+            }
+            partition(numTParticles, numRanks, rates, newCounts, newDispls);
+            int shift = 0;
+            for (int r = 0; r < numRanks; r++) {
+                int move = abs(newDispls[r] - displs[r]);
+                shift = move > shift ? move : shift;
+            }
+            repartition = shift > 0 && shift >= MIN_MOVE*numTParticles;
+            totalBusy += busy;
+            busy = 0.0;
+            stepped = 0;
+
+            if (repartition) {
+                gatherTParticles(tParticles, local, counts, displs, rank);
+                memcpy(counts, newCounts, numRanks*sizeof(int));
+                memcpy(displs, newDispls, numRanks*sizeof(int));
+                freeTParticles(local);
+                local = createTParticles(counts[rank]);
+                scatterTParticles(tParticles, local, counts, displs, rank);
+                // the levels of the block steps follow from h
+                if (blocksteps != NULL) {
+                    blockCount += blockstepCount(blocksteps);
+                    blockstepFree(blocksteps);
+                    blocksteps = blockstepCreate(counts[rank],
+                                                 atoi(levelsOption), eta);
+                }
+                rebalances++;
+            }
+        }
+
+        // the root needs all test particles for the output
+        int snapshot = trajectoryFile != NULL && (i + 1) % stride == 0;
+        int save = checkpointFile != NULL && (i + 1) % checkpointEvery == 0;
+        if ((snapshot || save) && !repartition) {
+            gatherTParticles(tParticles, local, counts, displs, rank);
+        }
+        if (rank == 0) {
+            // waits if the background writers are still busy with the last
+            // snapshot or checkpoint
+            if (snapshot) {
+                recordSnapshot(trajectory, tParticles, i + 1);
+            }
+            if (save) {
+                saveCheckpoint(checkpoint, tParticles, i + 1);
+            }
+        }
+    }
+    totalBusy += busy;
+    gatherTParticles(tParticles, local, counts, displs, rank);
+    double seconds = wallTime() - begin;
+    engineDestroy(engine);
+
+    // how evenly the time was spread: the mean busy time of the ranks
+    // relative to the longest
+    double sumBusy = 0.0;
+    double maxBusy = 0.0;
+    MPI_Reduce(&totalBusy, &sumBusy, 1, MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&totalBusy, &maxBusy, 1, MPI_DOUBLE, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    if (blocksteps != NULL) {
+        double count = blockCount + blockstepCount(blocksteps);
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &count, &count, 1, MPI_DOUBLE,
+                   MPI_SUM, 0, MPI_COMM_WORLD);
+        blockCount = count;
+        blockstepFree(blocksteps);
+    }
+    freeTParticles(local);
+    if (grid != NULL) {
+        gridFree(grid);
+    }
+    if (tree != NULL) {
+        octreeFree(tree);
+    }
+    if (packed != NULL) {
+        packFree(packed);
+    }
+
+    if (rank == 0) {
+        // waits for the last snapshot and checkpoint to be written
+        if (checkpoint != NULL) {
+            checkpointClose(checkpoint);
+        }
+        if (trajectory != NULL) {
+            trajectoryClose(trajectory);
+        }
+
+        // print the final position of the first test particle
+        printf("position: (%.12f, %.12f, %.12f)\n",
+                tParticles->x[0], tParticles->y[0], tParticles->z[0]);
+
+        // pairs of particles per second, as if every pair was summed
+        // directly
+        double interactions = (double)numTParticles*numPParticles
+                              *(iterations - start);
+        printf("time: %.3f s, %.3e interactions/s (%s, %s, %s)\n", seconds,
+               interactions / seconds, kernelName(), precisionName(),
+               integratorName());
+        printf("ranks: %d with %d threads each, %.1f%% balanced, "
+               "rebalanced %d times\n", numRanks, numThreads,
+               maxBusy > 0.0 ? 100.0*sumBusy / numRanks / maxBusy : 100.0,
+               rebalances);
+        if (levelsOption != NULL) {
+            // compared to 2^L steps of every test particle with the finest
+            // step
+            double steps = blockCount
+                           / ((double)numTParticles*(iterations - start));
+            printf("block steps: %.2f per test particle and iteration, "
+                   "%.1fx fewer than with the finest step\n", steps,
+                   (1 << atoi(levelsOption)) / steps);
+        }
+        freeTParticles(tParticles);
+    }
+    free(counts);
+    free(displs);
+    free(newCounts);
+    free(newDispls);
+    free(rates);
+    free(measured);
+    free(x);
+    free(y);
+    free(z);
+    free(m);
+
+    MPI_Finalize();
+    return 0;
+}
@@ -1,115 +1,372 @@
-#define INDEX(i, j, w) i*w+j
 #define EPSILON 0.000000001
 
 /*
- * Compute the acceleration on the test particles (tParticles) cause by
- * each pseduo-particle (pParticles).
- * The accelerations are stored such that the acceleration caused by
- * pParticles[4] on tParticles[10] is stored in accel[10][4].
- *
- * get_global_id(0) == which test particle to operate on
- * get_global_id(1) == which pseduo-particle to operate on
- * len1 == number of particles
- * len2 == number of pseduo-particles
+ * Build options. gpu_multiple.c passes the problem constants as -D defines,
+ * so the compiler can fold them into the kernel; without them the kernel
+ * arguments and work group queries are used.
+ *   NUM_TEST     number of test particles (len1)
+ *   NUM_PSEUDO   number of pseudo-particles (len2)
+ *   TIME_STEP    size of the time step (t)
+ *   LOCAL_SIZE_0 test particles per work-group
+ *   LOCAL_SIZE_1 work-items per test particle
+ *   UNROLL       unroll factor of the loop over a tile
+ *   USE_DOUBLE   calculate and sum the accelerations in double precision
+ *   USE_KAHAN    sum the accelerations with compensated summation
+ *   INTEGRATOR   method of the update, one of the INTEGRATOR_ constants
+ *   TOLERANCE    relative error per step with INTEGRATOR_ADAPTIVE
+ *   STORAGE      storage of the pseudo-particles, one of the STORAGE_
+ *                constants
+ *   CELL_SIZE    pseudo-particles per cell, with 16-bit storage
+ *   PARTICLE_STEPS  read the time step of each test particle from
+ *                timeSteps instead of using t, e.g. for an ensemble
  */
-__kernel void compute(__global float8* tParticles,
-                      __global float4* pParticles,
-                      __global float4* accel,
-                      const unsigned int len1,
-                      const unsigned int len2)
-{
-    unsigned int i = get_global_id(0);
-    unsigned int j = get_global_id(1);
+#ifdef NUM_TEST
+#define LEN1 NUM_TEST
+#else
+#define LEN1 len1
+#endif
 
-    if (i < len1 && j < len2) {
-        float4 d = pParticles[j] - tParticles[i].lo;
+#ifdef NUM_PSEUDO
+#define LEN2 NUM_PSEUDO
+#else
+#define LEN2 len2
+#endif
 
-        float invr = rsqrt(d.x*d.x + d.y*d.y + d.z*d.z + EPSILON);
-        float invr3 = invr*invr*invr;
-        float f = pParticles[j].s3 * invr3;    // s3 = mass
+#if defined(PARTICLE_STEPS)
+#define T dt
+#define STEPS_PARAM , __global const float* timeSteps
+#elif defined(TIME_STEP)
+#define T TIME_STEP
+#else
+#define T t
+#endif
 
-        // accel[INDEX(i, j, len2)] = (float4)(f*d.x, f*d.y, f*d.z, 0.0);
-        accel[i*len2 +j] = (float4)(f*d.x, f*d.y, f*d.z, 0.0);
-        // accel[idx] = f*d;
-    }
-}
+#ifndef PARTICLE_STEPS
+#define STEPS_PARAM
+#endif
+
+#if defined(LOCAL_SIZE_0) && defined(LOCAL_SIZE_1)
+#define GROUP_SIZE_0 LOCAL_SIZE_0
+#define GROUP_SIZE_1 LOCAL_SIZE_1
+#define REQD_GROUP_SIZE \
+    __attribute__((reqd_work_group_size(LOCAL_SIZE_0, LOCAL_SIZE_1, 1)))
+#else
+#define GROUP_SIZE_0 get_local_size(0)
+#define GROUP_SIZE_1 get_local_size(1)
+#define REQD_GROUP_SIZE
+#endif
+
+// methods of the update, the same as in particle.h
+#define INTEGRATOR_EULER 0      // x += v t + a t^2 / 2, v += a t
+#define INTEGRATOR_LEAPFROG 1   // drift-kick-drift leapfrog
+#define INTEGRATOR_RK4 2        // classic 4th order Runge-Kutta
+#define INTEGRATOR_ADAPTIVE 3   // Bogacki-Shampine 3(2) with error control
+
+#ifndef INTEGRATOR
+#define INTEGRATOR INTEGRATOR_EULER
+#endif
+
+#ifndef TOLERANCE
+#define TOLERANCE 1e-6f
+#endif
+
+// smallest step of INTEGRATOR_ADAPTIVE, as a fraction of the time step.
+// Steps this small are accepted whatever their error.
+#define MIN_STEP 1e-6f
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL_HINT(n) PRAGMA(unroll n)
+#ifdef UNROLL
+#define UNROLL_LOOP UNROLL_HINT(UNROLL)
+#else
+#define UNROLL_LOOP
+#endif
+
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double4 real4;
+#define convert_real4 convert_double4
+#define REAL_MIN DBL_MIN
+#else
+typedef float real;
+typedef float4 real4;
+#define convert_real4 convert_float4
+#define REAL_MIN FLT_MIN
+#endif
+
+// adds v to sum, keeping the rounding error in c if USE_KAHAN is defined.
+// Contracting the additions into FMAs would defeat the compensation.
+#ifdef USE_KAHAN
+#pragma OPENCL FP_CONTRACT OFF
+#define ACCUMULATE(sum, c, v) \
+    { real4 y_ = (v) - c; real4 t_ = sum + y_; c = (t_ - sum) - y_; sum = t_; }
+#else
+#define ACCUMULATE(sum, c, v) sum += (v)
+#endif
+
+// storage of the pseudo-particles, the same as in packed.h
+#define STORAGE_FLOAT 0
+#define STORAGE_HALF 1
+#define STORAGE_BF16 2
 
+#ifndef STORAGE
+#define STORAGE STORAGE_FLOAT
+#endif
 
 /*
- * Sum up the accelerations calculated in the compute() kernel.
- * The final sum is stored such that the acceleration on tParticles[10]
- * is stored in accel[10][0].
- *
- * Adapted from NVIDIA's tutorial on reductions in CUDA.
- * The tutorial can be found here:
- * http://docs.nvidia.com/cuda/samples/6_Advanced/reduction/doc/reduction.pdf
+ * With STORAGE_HALF or STORAGE_BF16, each pseudo-particle is four 16-bit
+ * values: its position relative to the center of its cell in units of the
+ * radius of the cell, and its mass relative to the largest mass in the
+ * cell. Every CELL_SIZE consecutive pseudo-particles share a cell, which
+ * holds the center (s0-s2), radius (s3) and largest mass (s4). The kernel
+ * takes the cells as an extra last argument and PSEUDO passes both buffers
+ * on. Loads are decoded to single precision, so the arithmetic is the same
+ * as with STORAGE_FLOAT.
  */
-__kernel void reduce(__global float4* accel,
-                     const unsigned int len1,
-                     const unsigned int len2,
-                     __local float4* sdata)
+#if STORAGE == STORAGE_FLOAT
+#define PSEUDO_BUFFER __global const float4*
+#define CELLS_PARAM
+#define PSEUDO pParticles
+#define LOAD_PSEUDO(i) pParticles[i]
+#else
+#define PSEUDO_BUFFER __global const ushort*
+#define CELLS_PARAM , __global const float8* cells
+#define PSEUDO pParticles, cells
+#define LOAD_PSEUDO(i) loadPseudo(pParticles, cells, i)
+
+float4 loadPseudo(__global const ushort* pParticles,
+                  __global const float8* cells, unsigned int i)
 {
-    unsigned int global_i = get_global_id(0);
-    unsigned int global_j = get_global_id(1);
-    // unsigned int gid = INDEX(global_i, global_j, len2);
-    unsigned int gid = global_i*len2 + global_j;
+#if STORAGE == STORAGE_HALF
+    float4 q = vload_half4(i, (__global const half*)pParticles);
+#else
+    // a bfloat16 is the upper half of a float
+    float4 q = as_float4(convert_uint4(vload4(i, pParticles)) << 16);
+#endif
+    float8 c = cells[i / CELL_SIZE];
+    return (float4)(c.s012 + c.s3*q.xyz, c.s4*q.w);
+}
+#endif
 
+/*
+ * Returns the acceleration on a test particle at p caused by all
+ * pseduo-particles (pParticles), to every work-item of the test particle.
+ * Based on the tiled N-body kernel from GPU Gems 3, chapter 31.
+ *
+ * A work-group holds get_local_size(0) test particles and
+ * get_local_size(1) work-items per test particle. The work-group copies the
+ * pseudo-particles into local memory (tile), one tile at a time, and each
+ * work-item sums the accelerations of every get_local_size(1)-th
+ * pseudo-particle of the tile in registers. At the end the work-items of a
+ * test particle add up their sums in local memory. It must be called by all
+ * work-items of the work-group, since they share the tiles.
+ */
+real4 acceleration(real4 p,
+                   PSEUDO_BUFFER pParticles CELLS_PARAM,
+                   const unsigned int len2,
+                   __local real4* tile)
+{
     unsigned int local_i = get_local_id(0);
     unsigned int local_j = get_local_id(1);
+    unsigned int width = GROUP_SIZE_1;
+    unsigned int tileSize = GROUP_SIZE_0*width;
     // local index
-    // unsigned int tid = INDEX(local_i, local_j, get_local_size(1));
-    unsigned int tid = local_i*get_local_size(1) + local_j;
-
-    // write data to shared memory
-    if (global_i < len1 && global_j < len2) {
-        sdata[tid] = accel[gid];
-    } else {
-        sdata[tid] = (float4)(0.0, 0.0, 0.0, 0.0);
-    }
+    unsigned int tid = local_i*width + local_j;
 
-    barrier(CLK_LOCAL_MEM_FENCE);
+    real4 a = 0;
+    real4 c = 0;    // compensation of a, with USE_KAHAN
+
+    for (unsigned int base = 0; base < LEN2; base += tileSize) {
+        unsigned int n = min(tileSize, LEN2 - base);
+        if (tid < n) {
+            tile[tid] = convert_real4(LOAD_PSEUDO(base + tid));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    // do reduction in shared mem
-    for(unsigned int s=get_local_size(1)/2; s>0; s>>=1) {
-        if (local_j < s &&  local_j + s < get_local_size(1)) {
-            sdata[tid] += sdata[tid + s];
+        UNROLL_LOOP
+        for (unsigned int j = local_j; j < n; j += width) {
+            real4 d = tile[j] - p;
+
+            real invr = rsqrt(d.x*d.x + d.y*d.y + d.z*d.z + (real)EPSILON);
+            real invr3 = invr*invr*invr;
+            real f = tile[j].s3 * invr3;    // s3 = mass
+
+            ACCUMULATE(a, c, ((real4)(f*d.x, f*d.y, f*d.z, (real)0)));
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    // write result for this block to global mem
-    if (local_j == 0) {
-        unsigned int idx = get_group_id(0)*get_num_groups(1) + get_group_id(1);
-        accel[idx] = sdata[local_j];
+    // add up the sums of the work-items of each test particle
+    tile[tid] = a - c;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (unsigned int s = width/2; s > 0; s >>= 1) {
+        if (local_j < s) {
+            tile[tid] += tile[tid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-}
+    a = tile[local_i*width];
 
+    // the tile is overwritten by the next call
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return a;
+}
 
 /*
- * Update the position and velocity of each test particle (tParticles).
+ * Advance each test particle (tParticles) by one time step with the method
+ * selected by INTEGRATOR, using the accelerations caused by all
+ * pseduo-particles (pParticles). Every work-item of a test particle keeps
+ * a copy of its state in registers and the first one writes it back.
+ * With INTEGRATOR_ADAPTIVE, s7 of each test particle holds the size of its
+ * next step, or 0 before the first step; the work-group keeps going until
+ * all of its test particles have reached the end of the time step.
+ *
+ * get_global_id(0) == which test particle to operate on
+ * get_global_size(1) == get_local_size(1), which must be a power of two
+ * len1 == number of particles
+ * len2 == number of pseduo-particles
+ * tile == get_local_size(0)*get_local_size(1) real4s
+ * timeSteps == the time step of each test particle, only with
+ *              PARTICLE_STEPS
+ * cells == the cells of the pseudo-particles, only with 16-bit storage
  */
-__kernel void update(__global float4* accel,
-                     __global float8* tParticles,
-                     const int len1,
-                     const int len2,
-                     const float t)
+__kernel REQD_GROUP_SIZE
+void step(__global float8* tParticles,
+          PSEUDO_BUFFER pParticles,
+          const unsigned int len1,
+          const unsigned int len2,
+          const float t,
+          __local real4* tile
+          STEPS_PARAM
+          CELLS_PARAM)
 {
-    int i = get_global_id(0);
+    unsigned int i = get_global_id(0);
+    unsigned int local_j = get_local_id(1);
 
-    if (get_global_id(1) == 0 && i < len1) {
-    // particles[i].s0 = 3;
-        //update position
-        float4 v = tParticles[i].hi;
+    // work-items past the last test particle still help loading the tiles
+    float8 s = 0;
+    if (i < LEN1) {
+        s = tParticles[i];
+    }
+    real4 x = convert_real4((float4)(s.s012, 0.0f));
+    real4 v = convert_real4((float4)(s.s456, 0.0f));
+#ifdef PARTICLE_STEPS
+    const float dt = i < LEN1 ? timeSteps[i] : 0.0f;
+#endif
+
+#if INTEGRATOR == INTEGRATOR_EULER
+    real4 a = acceleration(x, PSEUDO, len2, tile);
 
-        // int idx = INDEX(i, 0, len2);
-        int idx = i*len2 + 0;
-        tParticles[i].s0 += v.x * t + 0.5 * accel[idx].x * t*t;
-        tParticles[i].s1 += v.y * t + 0.5 * accel[idx].y * t*t;
-        tParticles[i].s2 += v.z * t + 0.5 * accel[idx].z * t*t;
+    if (local_j == 0 && i < LEN1) {
+        //update position
+        tParticles[i].s0 += v.x * T + 0.5 * a.x * T*T;
+        tParticles[i].s1 += v.y * T + 0.5 * a.y * T*T;
+        tParticles[i].s2 += v.z * T + 0.5 * a.z * T*T;
 
         // update velocity
-        tParticles[i].s4 += accel[idx].x * t;
-        tParticles[i].s5 += accel[idx].y * t;
-        tParticles[i].s6 += accel[idx].z * t;
+        tParticles[i].s4 += a.x * T;
+        tParticles[i].s5 += a.y * T;
+        tParticles[i].s6 += a.z * T;
+    }
+#elif INTEGRATOR == INTEGRATOR_LEAPFROG
+    const real half = (real)0.5 * T;
+
+    // drift to the middle of the step, kick, drift to the end of the step
+    x += v * half;
+    real4 a = acceleration(x, PSEUDO, len2, tile);
+    v += a * T;
+    x += v * half;
+#elif INTEGRATOR == INTEGRATOR_RK4
+    real4 p = x;        // position of the current stage
+    real4 k = v;        // velocity of the current stage
+    real4 sumX = 0;     // weighted sums of the velocities
+    real4 sumV = 0;     // weighted sums of the accelerations
+
+    for (int stage = 0; stage < 4; stage++) {
+        real4 a = acceleration(p, PSEUDO, len2, tile);
+        real weight = stage == 0 || stage == 3 ? 1 : 2;
+        // where the next stage is evaluated, as a fraction of the step
+        real h = (stage < 2 ? (real)0.5 : stage == 2 ? 1 : 0) * T;
+        sumX += weight * k;
+        sumV += weight * a;
+        // the next stage starts from the state at the beginning
+        p = x + h * k;
+        k = v + h * a;
     }
-}
\ No newline at end of file
+    x += T / (real)6 * sumX;
+    v += T / (real)6 * sumV;
+#elif INTEGRATOR == INTEGRATOR_ADAPTIVE
+    // Bogacki-Shampine 3(2), see adaptiveParticle() in particle.c
+    __local int busy;
+    real want = s.s7 > 0.0f && s.s7 < T ? s.s7 : T;
+    real remaining = i < LEN1 ? T : 0;
+    real4 k1 = acceleration(x, PSEUDO, len2, tile);
+
+    for (;;) {
+        // stop once no test particle of the work-group has time left
+        if (get_local_id(0) == 0 && local_j == 0) {
+            busy = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (remaining > 0) {
+            busy = 1;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (!busy) {
+            break;
+        }
+
+        // finished test particles take a step of 0 and discard it
+        real h = max(min(want, remaining), (real)0);
+        real4 v2 = v + (real)0.5*h*k1;
+        real4 k2 = acceleration(x + (real)0.5*h*v, PSEUDO, len2, tile);
+        real4 v3 = v + (real)0.75*h*k2;
+        real4 k3 = acceleration(x + (real)0.75*h*v2, PSEUDO, len2, tile);
+        real4 nextX = x + h*((real)(2.0/9.0)*v + (real)(1.0/3.0)*v2
+                             + (real)(4.0/9.0)*v3);
+        real4 nextV = v + h*((real)(2.0/9.0)*k1 + (real)(1.0/3.0)*k2
+                             + (real)(4.0/9.0)*k3);
+        real4 k4 = acceleration(nextX, PSEUDO, len2, tile);
+
+        // difference to the embedded second order solution
+        real4 errX = h*((real)(-5.0/72.0)*v + (real)(1.0/12.0)*v2
+                        + (real)(1.0/9.0)*v3 - (real)(1.0/8.0)*nextV);
+        real4 errV = h*((real)(-5.0/72.0)*k1 + (real)(1.0/12.0)*k2
+                        + (real)(1.0/9.0)*k3 - (real)(1.0/8.0)*k4);
+        real scaleX = (real)TOLERANCE*(length(x) + h*length(v)) + REAL_MIN;
+        real scaleV = (real)TOLERANCE*(length(v) + h*length(k1)) + REAL_MIN;
+        real ratio = max(length(errX) / scaleX, length(errV) / scaleV);
+
+        // the error of a third order step grows with h^3
+        real factor = ratio > 0 ? (real)0.9*pow(ratio, (real)(-1.0/3.0)) : 5;
+        factor = clamp(factor, (real)0.2, (real)5);
+
+        if (remaining <= 0) {
+            continue;
+        }
+        if (ratio <= 1 || h <= (real)MIN_STEP*T) {
+            x = nextX;
+            v = nextV;
+            k1 = k4;
+            remaining -= h;
+            if (h < want) {
+                // the last step was cut short, which says nothing about
+                // the size of the next one
+                continue;
+            }
+        }
+        want = h*factor;
+    }
+#endif
+
+#if INTEGRATOR != INTEGRATOR_EULER
+    if (local_j == 0 && i < LEN1) {
+        tParticles[i].s012 = convert_float3(x.xyz);
+        tParticles[i].s456 = convert_float3(v.xyz);
+#if INTEGRATOR == INTEGRATOR_ADAPTIVE
+        tParticles[i].s7 = want;
+#endif
+    }
+#endif
+}
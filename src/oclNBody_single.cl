@@ -1,48 +1,376 @@
 #define EPSILON 0.000000001
 
 /*
- * Compute the acceleration on the test particle (tParticle) caused by
- * each pseudo-particle (pParticles).
+ * Build options. gpu_single.c passes the problem constants as -D defines,
+ * so the compiler can fold them into the kernel; without them the kernel
+ * arguments and work group queries are used.
+ *   NUM_PSEUDO   number of pseudo-particles (len)
+ *   TIME_STEP    size of the time step (t)
+ *   LOCAL_SIZE   local work group size
+ *   NUM_GROUPS   number of work-groups
+ *   UNROLL       unroll factor of the loop over the pseudo-particles
+ *   USE_DOUBLE   calculate and sum the accelerations in double precision
+ *   USE_KAHAN    sum the accelerations with compensated summation
+ *   INTEGRATOR   method of the update, one of the INTEGRATOR_ constants
+ *   TOLERANCE    relative error per step with INTEGRATOR_ADAPTIVE
+ *   STORAGE      storage of the pseudo-particles, one of the STORAGE_
+ *                constants
+ *   CELL_SIZE    pseudo-particles per cell, with 16-bit storage
  */
-__kernel void compute(__global float4* pParticles,
-                      __global float4* accel,
-                      const unsigned int len,
-                      __global float8* tParticle)
+#ifdef NUM_PSEUDO
+#define LEN NUM_PSEUDO
+#else
+#define LEN len
+#endif
+
+#ifdef TIME_STEP
+#define T TIME_STEP
+#else
+#define T t
+#endif
+
+#ifdef LOCAL_SIZE
+#define GROUP_SIZE LOCAL_SIZE
+#define REQD_GROUP_SIZE __attribute__((reqd_work_group_size(LOCAL_SIZE, 1, 1)))
+#else
+#define GROUP_SIZE get_local_size(0)
+#define REQD_GROUP_SIZE
+#endif
+
+// finish() runs as a single work-group, so it takes the number of
+// work-groups of step() as an argument
+#ifdef NUM_GROUPS
+#define GROUPS NUM_GROUPS
+#define PARTIALS NUM_GROUPS
+#else
+#define GROUPS get_num_groups(0)
+#define PARTIALS groups
+#endif
+
+// methods of the update, the same as in particle.h
+#define INTEGRATOR_EULER 0      // x += v t + a t^2 / 2, v += a t
+#define INTEGRATOR_LEAPFROG 1   // drift-kick-drift leapfrog
+#define INTEGRATOR_RK4 2        // classic 4th order Runge-Kutta
+#define INTEGRATOR_ADAPTIVE 3   // Bogacki-Shampine 3(2) with error control
+
+#ifndef INTEGRATOR
+#define INTEGRATOR INTEGRATOR_EULER
+#endif
+
+#ifndef TOLERANCE
+#define TOLERANCE 1e-6f
+#endif
+
+// smallest step of INTEGRATOR_ADAPTIVE, as a fraction of the time step.
+// Steps this small are accepted whatever their error.
+#define MIN_STEP 1e-6f
+
+#define PRAGMA(x) _Pragma(#x)
+#define UNROLL_HINT(n) PRAGMA(unroll n)
+#ifdef UNROLL
+#define UNROLL_LOOP UNROLL_HINT(UNROLL)
+#else
+#define UNROLL_LOOP
+#endif
+
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double4 real4;
+#define convert_real4 convert_double4
+#define REAL_MIN DBL_MIN
+#else
+typedef float real;
+typedef float4 real4;
+#define convert_real4 convert_float4
+#define REAL_MIN FLT_MIN
+#endif
+
+// adds v to sum, keeping the rounding error in c if USE_KAHAN is defined.
+// Contracting the additions into FMAs would defeat the compensation.
+#ifdef USE_KAHAN
+#pragma OPENCL FP_CONTRACT OFF
+#define ACCUMULATE(sum, c, v) \
+    { real4 y_ = (v) - c; real4 t_ = sum + y_; c = (t_ - sum) - y_; sum = t_; }
+#else
+#define ACCUMULATE(sum, c, v) sum += (v)
+#endif
+
+// storage of the pseudo-particles, the same as in packed.h
+#define STORAGE_FLOAT 0
+#define STORAGE_HALF 1
+#define STORAGE_BF16 2
+
+#ifndef STORAGE
+#define STORAGE STORAGE_FLOAT
+#endif
+
+/*
+ * With STORAGE_HALF or STORAGE_BF16, each pseudo-particle is four 16-bit
+ * values: its position relative to the center of its cell in units of the
+ * radius of the cell, and its mass relative to the largest mass in the
+ * cell. Every CELL_SIZE consecutive pseudo-particles share a cell, which
+ * holds the center (s0-s2), radius (s3) and largest mass (s4). The kernel
+ * takes the cells as an extra last argument. Loads are decoded to single
+ * precision, so the arithmetic is the same as with STORAGE_FLOAT.
+ */
+#if STORAGE == STORAGE_FLOAT
+#define PSEUDO_BUFFER __global const float4*
+#define CELLS_PARAM
+#define LOAD_PSEUDO(i) pParticles[i]
+#else
+#define PSEUDO_BUFFER __global const ushort*
+#define CELLS_PARAM , __global const float8* cells
+#define LOAD_PSEUDO(i) loadPseudo(pParticles, cells, i)
+
+float4 loadPseudo(__global const ushort* pParticles,
+                  __global const float8* cells, unsigned int i)
 {
-    unsigned int idx = get_global_id(0);
+#if STORAGE == STORAGE_HALF
+    float4 q = vload_half4(i, (__global const half*)pParticles);
+#else
+    // a bfloat16 is the upper half of a float
+    float4 q = as_float4(convert_uint4(vload4(i, pParticles)) << 16);
+#endif
+    float8 c = cells[i / CELL_SIZE];
+    return (float4)(c.s012 + c.s3*q.xyz, c.s4*q.w);
+}
+#endif
 
-    if (idx < len) {
-        float4 d = pParticles[idx] - (*tParticle).lo;
+#if INTEGRATOR == INTEGRATOR_RK4
+/*
+ * Finishes stage count[0] of the classic fourth order Runge-Kutta method,
+ * given the acceleration a at the position of that stage, and sets up the
+ * next stage. The fourth stage advances the test particle by t, so the
+ * next launch starts the next step.
+ *   state[0]  position of the next stage
+ *   state[1]  velocity of the next stage
+ *   state[2]  weighted sum of the velocities
+ *   state[3]  weighted sum of the accelerations
+ */
+void rk4Stage(real4 a,
+              __global float8* tParticle,
+              __global real4* state,
+              __global unsigned int* count,
+              const float t)
+{
+    unsigned int stage = count[0];
+    real4 x = convert_real4((float4)((*tParticle).s012, 0.0f));
+    real4 v = convert_real4((float4)((*tParticle).s456, 0.0f));
+    real4 k = v;
+    real4 sumX = 0;
+    real4 sumV = 0;
+    if (stage > 0) {
+        k = state[1];
+        sumX = state[2];
+        sumV = state[3];
+    }
+    real weight = stage == 0 || stage == 3 ? 1 : 2;
+    sumX += weight * k;
+    sumV += weight * a;
 
-        // EPSILON allows particles to "pass through" each other
-        float invr = rsqrt(d.x*d.x + d.y*d.y + d.z*d.z + EPSILON);
-        float invr3 = invr*invr*invr;
-        float f = pParticles[idx].s3 * invr3;    // s3 = mass
+    if (stage == 3) {
+        x += T / (real)6 * sumX;
+        v += T / (real)6 * sumV;
+        (*tParticle).s012 = convert_float3(x.xyz);
+        (*tParticle).s456 = convert_float3(v.xyz);
+        count[0] = 0;
+        return;
+    }
 
-        accel[idx] = (float4)(f*d.x, f*d.y, f*d.z, 0.0f);
-        // accel[idx] = f*d;
+    // the next stage starts from the state at the beginning
+    real h = (stage < 2 ? (real)0.5 : 1) * T;
+    state[0] = x + h * k;
+    state[1] = v + h * a;
+    state[2] = sumX;
+    state[3] = sumV;
+    count[0] = stage + 1;
+}
+#endif
+
+#if INTEGRATOR == INTEGRATOR_ADAPTIVE
+/*
+ * Finishes stage count[0] of the Bogacki-Shampine 3(2) method, given the
+ * acceleration a at the position of that stage, and sets up the next
+ * stage; see adaptiveParticle() in particle.c. Stage 0 starts a time step
+ * at the position of the test particle and stages 1 to 3 make up one
+ * attempted step of size min(want, remaining), which is accepted or
+ * rejected after stage 3. When the time step is complete the test particle
+ * is updated, count[1] is incremented and s7 holds the size of the next
+ * step.
+ *   state[0]  position of the next stage
+ *   state[1]  position at the start of the attempted step
+ *   state[2]  velocity at the start of the attempted step
+ *   state[3]  acceleration at the start of the attempted step
+ *   state[4]  acceleration of stage 1
+ *   state[5]  acceleration of stage 2
+ *   state[6]  size of the next step and time left in the time step
+ */
+void adaptiveStage(real4 a,
+                   __global float8* tParticle,
+                   __global real4* state,
+                   __global unsigned int* count,
+                   const float t)
+{
+    unsigned int stage = count[0];
+
+    if (stage == 0) {
+        float s7 = (*tParticle).s7;
+        state[1] = convert_real4((float4)((*tParticle).s012, 0.0f));
+        state[2] = convert_real4((float4)((*tParticle).s456, 0.0f));
+        state[3] = a;
+        state[6] = (real4)(s7 > 0.0f && s7 < T ? s7 : T, T, 0, 0);
     }
+
+    real4 y = state[1];
+    real4 yv = state[2];
+    real4 k1 = state[3];
+    real want = state[6].x;
+    real remaining = state[6].y;
+    real h = min(want, remaining);
+
+    if (stage == 0) {
+        state[0] = y + (real)0.5*h*yv;
+        count[0] = 1;
+        return;
+    }
+    real4 v2 = yv + (real)0.5*h*k1;
+    if (stage == 1) {
+        state[4] = a;
+        state[0] = y + (real)0.75*h*v2;
+        count[0] = 2;
+        return;
+    }
+    real4 k2 = state[4];
+    real4 v3 = yv + (real)0.75*h*k2;
+    if (stage == 2) {
+        state[5] = a;
+        state[0] = y + h*((real)(2.0/9.0)*yv + (real)(1.0/3.0)*v2
+                          + (real)(4.0/9.0)*v3);
+        count[0] = 3;
+        return;
+    }
+    real4 k3 = state[5];
+    real4 k4 = a;
+    real4 nextX = state[0];
+    real4 nextV = yv + h*((real)(2.0/9.0)*k1 + (real)(1.0/3.0)*k2
+                          + (real)(4.0/9.0)*k3);
+
+    // difference to the embedded second order solution
+    real4 errX = h*((real)(-5.0/72.0)*yv + (real)(1.0/12.0)*v2
+                    + (real)(1.0/9.0)*v3 - (real)(1.0/8.0)*nextV);
+    real4 errV = h*((real)(-5.0/72.0)*k1 + (real)(1.0/12.0)*k2
+                    + (real)(1.0/9.0)*k3 - (real)(1.0/8.0)*k4);
+    real scaleX = (real)TOLERANCE*(length(y) + h*length(yv)) + REAL_MIN;
+    real scaleV = (real)TOLERANCE*(length(yv) + h*length(k1)) + REAL_MIN;
+    real ratio = max(length(errX) / scaleX, length(errV) / scaleV);
+
+    // the error of a third order step grows with h^3
+    real factor = ratio > 0 ? (real)0.9*pow(ratio, (real)(-1.0/3.0)) : 5;
+    factor = clamp(factor, (real)0.2, (real)5);
+
+    if (ratio <= 1 || h <= (real)MIN_STEP*T) {
+        y = nextX;
+        yv = nextV;
+        k1 = k4;
+        remaining -= h;
+        // a step which was cut short says nothing about the size of the
+        // next one
+        if (h >= want) {
+            want = h*factor;
+        }
+        if (remaining <= 0) {
+            (*tParticle).s012 = convert_float3(y.xyz);
+            (*tParticle).s456 = convert_float3(yv.xyz);
+            (*tParticle).s7 = want;
+            count[0] = 0;
+            count[1]++;
+            return;
+        }
+    } else {
+        want = h*factor;
+    }
+
+    h = min(want, remaining);
+    state[0] = y + (real)0.5*h*yv;
+    state[1] = y;
+    state[2] = yv;
+    state[3] = k1;
+    state[6] = (real4)(want, remaining, 0, 0);
+    count[0] = 1;
 }
+#endif
 
 /*
- * Sum up the accelerations calculated in the compute() kernel.
- * Adapted from NVIDIA's tutorial on reductions in CUDA.
- * The tutorial can be found here:
- * http://docs.nvidia.com/cuda/samples/6_Advanced/reduction/doc/reduction.pdf
+ * Compute the acceleration on the test particle (tParticle) caused by all
+ * pseudo-particles (pParticles). Each work-item sums the accelerations of
+ * every GROUPS*GROUP_SIZE-th pseudo-particle in registers, then each
+ * work-group reduces its sums in local memory (sdata) and writes one
+ * partial sum to partial. finish() adds up the partial sums and updates the
+ * test particle in a second launch: OpenCL does not guarantee that the
+ * writes of one work-group are visible to another within a launch, so the
+ * partial sums are only read after this launch has completed.
+ *
+ * With INTEGRATOR_RK4 and INTEGRATOR_ADAPTIVE a pair of launches only
+ * evaluates the acceleration for one stage of the method, since the stages
+ * depend on each other. The stage is kept in count[0] and the rest of the
+ * method in state (see rk4Stage() and adaptiveStage()). RK4 takes four
+ * pairs per time step, while the adaptive method counts the completed time
+ * steps in count[1] and pairs after the last of steps time steps return
+ * immediately.
+ *
+ * The local work group size must be a power of two, and partial and sdata
+ * must hold one real4 per work-group and per work-item respectively. With
+ * 16-bit storage, the cells of the pseudo-particles are the last argument.
  */
-__kernel void reduce(__global float4* accel,
-                     const unsigned int len,
-                     __local float4* sdata)
+__kernel REQD_GROUP_SIZE
+void step(PSEUDO_BUFFER pParticles,
+          const unsigned int len,
+          __global const float8* tParticle,
+          __global real4* partial,
+          __global const unsigned int* count,
+          __global const real4* state,
+          const unsigned int steps,
+          const float t,
+          __local real4* sdata
+          CELLS_PARAM)
 {
     unsigned int tid = get_local_id(0);
-    unsigned int gid = get_global_id(0);
+#if INTEGRATOR == INTEGRATOR_EULER
+    real4 p = convert_real4((*tParticle).lo);
+#elif INTEGRATOR == INTEGRATOR_LEAPFROG
+    // the acceleration is taken after drifting for half of the step
+    real4 p = convert_real4((*tParticle).lo)
+              + convert_real4((*tParticle).hi) * ((real)0.5 * T);
+#else
+#if INTEGRATOR == INTEGRATOR_ADAPTIVE
+    if (count[1] >= steps) {
+        return;
+    }
+#endif
+    real4 p = count[0] == 0 ? convert_real4((*tParticle).lo) : state[0];
+#endif
+    real4 a = 0;
+    real4 c = 0;    // compensation of a, with USE_KAHAN
 
-    sdata[tid] = (gid < len) ? accel[gid] : 0;
+    UNROLL_LOOP
+    for (unsigned int idx = get_global_id(0); idx < LEN;
+            idx += GROUPS*GROUP_SIZE) {
+        real4 q = convert_real4(LOAD_PSEUDO(idx));
+        real4 d = q - p;
 
+        // EPSILON allows particles to "pass through" each other
+        real invr = rsqrt(d.x*d.x + d.y*d.y + d.z*d.z + (real)EPSILON);
+        real invr3 = invr*invr*invr;
+        real f = q.s3 * invr3;    // s3 = mass
+
+        ACCUMULATE(a, c, ((real4)(f*d.x, f*d.y, f*d.z, (real)0)));
+    }
+    sdata[tid] = a - c;
     barrier(CLK_LOCAL_MEM_FENCE);
 
     // do reduction in shared mem
-    for(unsigned int s=get_local_size(0)/2; s>0; s>>=1) {
+    for (unsigned int s = GROUP_SIZE/2; s > 0; s >>= 1) {
         if (tid < s) {
             sdata[tid] += sdata[tid + s];
         }
@@ -51,28 +379,72 @@ __kernel void reduce(__global float4* accel,
 
     // write result for this block to global mem
     if (tid == 0) {
-        accel[get_group_id(0)] = sdata[0];
+        partial[get_group_id(0)] = sdata[0];
     }
 }
 
 /*
- * Update the position and velocity of the test particle (tParticle).
+ * Adds up the groups partial sums written by step() and updates the test
+ * particle. Launched with a single work-group of the same size as step(),
+ * after it.
  */
-__kernel void update(__global float4* accel,
-                     __global float8* tParticle,
-                     const float t)
+__kernel REQD_GROUP_SIZE
+void finish(__global float8* tParticle,
+            __global const real4* partial,
+            const unsigned int groups,
+            __global unsigned int* count,
+            __global real4* state,
+            const unsigned int steps,
+            const float t,
+            __local real4* sdata)
 {
-    if (get_global_id(0) == 0) {
+    unsigned int tid = get_local_id(0);
+#if INTEGRATOR == INTEGRATOR_ADAPTIVE
+    if (count[1] >= steps) {
+        return;
+    }
+#endif
+
+    real4 a = 0;
+    for (unsigned int i = tid; i < PARTIALS; i += GROUP_SIZE) {
+        a += partial[i];
+    }
+    sdata[tid] = a;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (unsigned int s = GROUP_SIZE/2; s > 0; s >>= 1) {
+        if (tid < s) {
+            sdata[tid] += sdata[tid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
+    if (tid == 0) {
+        a = sdata[0];
+
+#if INTEGRATOR == INTEGRATOR_EULER
         //update position
         float4 v = (*tParticle).hi;
-        (*tParticle).s0 += v.x * t + 0.5 * accel[0].x * t*t;
-        (*tParticle).s1 += v.y * t + 0.5 * accel[0].y * t*t;
-        (*tParticle).s2 += v.z * t + 0.5 * accel[0].z * t*t;
+        (*tParticle).s0 += v.x * T + 0.5 * a.x * T*T;
+        (*tParticle).s1 += v.y * T + 0.5 * a.y * T*T;
+        (*tParticle).s2 += v.z * T + 0.5 * a.z * T*T;
 
         // update velocity
-        (*tParticle).s4 += accel[0].x * t;
-        (*tParticle).s5 += accel[0].y * t;
-        (*tParticle).s6 += accel[0].z * t;
+        (*tParticle).s4 += a.x * T;
+        (*tParticle).s5 += a.y * T;
+        (*tParticle).s6 += a.z * T;
+#elif INTEGRATOR == INTEGRATOR_LEAPFROG
+        // kick, then drift from the middle to the end of the step
+        real4 p = convert_real4((*tParticle).lo)
+                  + convert_real4((*tParticle).hi) * ((real)0.5 * T);
+        real4 v = convert_real4((*tParticle).hi) + a * T;
+        real4 x = p + v * ((real)0.5 * T);
+        (*tParticle).s012 = convert_float3(x.xyz);
+        (*tParticle).s456 = convert_float3(v.xyz);
+#elif INTEGRATOR == INTEGRATOR_RK4
+        rk4Stage(a, tParticle, state, count, t);
+#else
+        adaptiveStage(a, tParticle, state, count, t);
+#endif
     }
-}
\ No newline at end of file
+}
@@ -1,33 +1,344 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "oclSetup.h"
+#include "options.h"
+#include "mapfile.h"
 
 /*
- * Perform basic OpenCL setup and error checking.
+ * Header of a cached program binary, which follows it.
+ */
+typedef struct {
+    char magic[4];          // "PNBP"
+    uint32_t version;       // PROGRAM_CACHE_VERSION
+    uint64_t key;           // hash of the device, driver and source
+    uint64_t size;          // size of the binary
+    char padding[40];
+} program_header_t;
+
+// enqueued commands whose durations are recorded once they have finished
+static cl_event* pendingEvents = NULL;
+static phase_t** pendingPhases = NULL;
+static int numPending = 0;
+static int maxPending = 0;
+
+/*
+ * Takes the options which select the OpenCL device and the program cache
+ * from the command line (see ocl_options_t).
+ */
+void takeOclOptions(int* argc, char** argv, ocl_options_t* options)
+{
+    options->platform = takeOption(argc, argv, "--platform");
+    options->device = takeOption(argc, argv, "--device");
+    options->deviceType = takeOption(argc, argv, "--device-type");
+    options->cacheDir = takeOption(argc, argv, "--cache");
+    options->devices = takeOption(argc, argv, "--devices");
+    options->profiling = 0;
+}
+
+/*
+ * Returns the platform with the given index or with a name containing the
+ * given string.
+ */
+static cl_platform_id selectPlatform(const char* name)
+{
+    cl_uint numPlatforms = 0;
+    cl_platform_id platforms[16];
+    if (clGetPlatformIDs(16, platforms, &numPlatforms) != CL_SUCCESS
+            || numPlatforms == 0) {
+        fprintf(stderr, "Error getting platform ID\n");
+        exit(-1);
+    }
+    if (numPlatforms > 16) {
+        numPlatforms = 16;
+    }
+    if (name == NULL) {
+        return platforms[0];
+    }
+
+    char* end;
+    long index = strtol(name, &end, 10);
+    if (*end == '\0') {
+        if (index < 0 || index >= (long)numPlatforms) {
+            fprintf(stderr, "There are only %u platforms\n", numPlatforms);
+            exit(-1);
+        }
+        return platforms[index];
+    }
+    for (cl_uint i = 0; i < numPlatforms; i++) {
+        char platformName[256] = "";
+        clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME,
+                          sizeof(platformName) - 1, platformName, NULL);
+        if (strstr(platformName, name) != NULL) {
+            return platforms[i];
+        }
+    }
+    fprintf(stderr, "No platform matches %s\n", name);
+    exit(-1);
+}
+
+/*
+ * Returns the device with the given index among the devices of the given
+ * type on a platform. Without a type, GPUs are preferred.
+ */
+static cl_device_id selectDevice(cl_platform_id platform, const char* type,
+                                 const char* index)
+{
+    cl_device_type deviceType = CL_DEVICE_TYPE_GPU;
+    if (type != NULL) {
+        if (strcmp(type, "gpu") == 0) {
+            deviceType = CL_DEVICE_TYPE_GPU;
+        } else if (strcmp(type, "cpu") == 0) {
+            deviceType = CL_DEVICE_TYPE_CPU;
+        } else if (strcmp(type, "accelerator") == 0) {
+            deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+        } else if (strcmp(type, "all") == 0) {
+            deviceType = CL_DEVICE_TYPE_ALL;
+        } else {
+            fprintf(stderr, "Unknown device type: %s\n", type);
+            exit(-1);
+        }
+    }
+
+    cl_uint numDevices = 0;
+    cl_device_id devices[16];
+    cl_int err = clGetDeviceIDs(platform, deviceType, 16, devices,
+                                &numDevices);
+    if (err != CL_SUCCESS && type == NULL) {
+        // no GPU, so fall back to whatever the platform has
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 16, devices,
+                             &numDevices);
+    }
+    if (err != CL_SUCCESS || numDevices == 0) {
+        fprintf(stderr, "Error getting device ID\n");
+        exit(-1);
+    }
+    if (numDevices > 16) {
+        numDevices = 16;
+    }
+
+    int i = index ? atoi(index) : 0;
+    if (i < 0 || i >= (int)numDevices) {
+        fprintf(stderr, "There are only %u devices\n", numDevices);
+        exit(-1);
+    }
+    return devices[i];
+}
+
+/*
+ * Hashes a string returned by clGetDeviceInfo() or clGetPlatformInfo().
+ */
+static uint64_t hashInfo(uint64_t h, cl_platform_id platform,
+                         cl_device_id device, cl_uint param)
+{
+    char info[1024] = "";
+    if (device != NULL) {
+        clGetDeviceInfo(device, param, sizeof(info) - 1, info, NULL);
+    } else {
+        clGetPlatformInfo(platform, param, sizeof(info) - 1, info, NULL);
+    }
+    // the terminating zero separates the strings
+    return hashBytes(h, info, strlen(info) + 1);
+}
+
+/*
+ * Returns the key of a program binary: a hash of the platform, device,
+ * driver version, build options and source.
+ */
+static uint64_t programKey(cl_platform_id platform, cl_device_id device,
+                           const char* source, const char* options)
+{
+    uint64_t h = HASH_SEED;
+    h = hashInfo(h, platform, NULL, CL_PLATFORM_NAME);
+    h = hashInfo(h, platform, NULL, CL_PLATFORM_VERSION);
+    h = hashInfo(h, platform, device, CL_DEVICE_NAME);
+    h = hashInfo(h, platform, device, CL_DEVICE_VERSION);
+    h = hashInfo(h, platform, device, CL_DRIVER_VERSION);
+    h = hashBytes(h, options, strlen(options) + 1);
+    return hashBytes(h, source, strlen(source));
+}
+
+/*
+ * Creates a program from a binary cached by an earlier run.
+ * Returns NULL if there is no usable binary.
+ */
+static cl_program loadProgram(const char* path, uint64_t key,
+                              cl_context context, cl_device_id device)
+{
+    mapfile_t* map = mapFile(path);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    cl_program program = NULL;
+    const program_header_t* header = (const program_header_t*)map->data;
+    if (map->size >= sizeof(program_header_t)
+            && memcmp(header->magic, "PNBP", 4) == 0
+            && header->version == PROGRAM_CACHE_VERSION
+            && header->key == key
+            && map->size - sizeof(program_header_t) >= header->size) {
+        size_t size = (size_t)header->size;
+        const unsigned char* binary = (const unsigned char*)(header + 1);
+        cl_int status;
+        cl_int err;
+        program = clCreateProgramWithBinary(context, 1, &device, &size,
+                                            &binary, &status, &err);
+        if (err != CL_SUCCESS || status != CL_SUCCESS) {
+            program = NULL;
+        }
+    }
+    unmapFile(map);
+    return program;
+}
+
+/*
+ * Stores the binary of a built program in the cache, through a temporary
+ * file so a concurrent run never loads a partially written binary.
+ */
+static void storeProgram(const char* path, uint64_t key, cl_program program)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size),
+                         &size, NULL) != CL_SUCCESS || size == 0) {
+        return;
+    }
+    unsigned char* binary = (unsigned char*)malloc(size);
+    if (binary == NULL
+            || clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                                sizeof(binary), &binary, NULL) != CL_SUCCESS) {
+        free(binary);
+        return;
+    }
+
+    program_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PNBP", 4);
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.size = size;
+
+    char* tmpPath = (char*)malloc(strlen(path) + 5);
+    if (tmpPath == NULL) {
+        free(binary);
+        return;
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error writing cache file: %s\n", tmpPath);
+        free(tmpPath);
+        free(binary);
+        return;
+    }
+    int err = fwrite(&header, sizeof(header), 1, fp) != 1;
+    err |= fwrite(binary, 1, size, fp) != size;
+    err |= fclose(fp);
+    if (err != 0 || replaceFile(tmpPath, path) != 0) {
+        fprintf(stderr, "Error writing cache file: %s\n", path);
+        remove(tmpPath);
+    }
+    free(tmpPath);
+    free(binary);
+}
+
+/*
+ * Returns the number of devices selected by options, which is the number of
+ * entries of options->devices or 1 without a list.
+ */
+int oclNumDevices(const ocl_options_t* options)
+{
+    if (options == NULL || options->devices == NULL) {
+        return 1;
+    }
+    int count = 1;
+    for (const char* c = options->devices; *c != '\0'; c++) {
+        count += *c == ',';
+    }
+    return count;
+}
+
+/*
+ * Perform basic OpenCL setup and error checking. The device is selected
+ * with options, which may be NULL. The program is built from sourceFile
+ * with buildOptions (e.g. "-D" defines), which may be NULL. If
+ * options->cacheDir is set, the program is loaded from a binary compiled by
+ * an earlier run on the same device with the same build options instead.
  */
 void oclSetup(cl_platform_id* cpPlatform,
               cl_device_id* device_id,
               cl_context* context,
               cl_command_queue* queue,
               cl_program* program,
-              char* sourceFile)
+              char* sourceFile,
+              const char* buildOptions,
+              const ocl_options_t* options)
+{
+    oclSetupDevice(0, cpPlatform, device_id, context, queue, program,
+                   sourceFile, buildOptions, options);
+}
+
+/*
+ * Like oclSetup(), for the device with the given index (see
+ * oclNumDevices()). Entries of options->devices are PLATFORM:DEVICE or
+ * just DEVICE, on --platform, with the platform given by index or name and
+ * the device by index among the devices of options->deviceType. Every
+ * device gets its own context, so the devices may be on different
+ * platforms, e.g. a GPU and PoCL on the CPU.
+ */
+void oclSetupDevice(int index,
+                    cl_platform_id* cpPlatform,
+                    cl_device_id* device_id,
+                    cl_context* context,
+                    cl_command_queue* queue,
+                    cl_program* program,
+                    char* sourceFile,
+                    const char* buildOptions,
+                    const ocl_options_t* options)
 {
     cl_int err;
+    ocl_options_t defaults = {NULL, NULL, NULL, NULL, NULL, 0};
+    if (options == NULL) {
+        options = &defaults;
+    }
 
-    // platform
-    err = clGetPlatformIDs(1, cpPlatform, NULL);
-    if (err != 0) {
-        fprintf(stderr, "Error getting platform ID\n");
-        exit(-1);
+    // the platform and device of the entry of the list
+    const char* platformName = options->platform;
+    const char* deviceIndex = options->device;
+    char entry[256];
+    if (options->devices != NULL) {
+        const char* begin = options->devices;
+        for (int i = 0; i < index && begin != NULL; i++) {
+            begin = strchr(begin, ',');
+            begin = begin ? begin + 1 : NULL;
+        }
+        if (begin == NULL) {
+            fprintf(stderr, "There are only %d devices in %s\n",
+                    oclNumDevices(options), options->devices);
+            exit(-1);
+        }
+        size_t length = strcspn(begin, ",");
+        if (length >= sizeof(entry)) {
+            length = sizeof(entry) - 1;
+        }
+        memcpy(entry, begin, length);
+        entry[length] = '\0';
+        char* colon = strrchr(entry, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            platformName = entry;
+            deviceIndex = colon + 1;
+        } else {
+            deviceIndex = entry;
+        }
     }
 
+    // platform
+    *cpPlatform = selectPlatform(platformName);
+
     // device
-    err = clGetDeviceIDs(*cpPlatform, CL_DEVICE_TYPE_GPU, 1, device_id, NULL);
-    if (err != 0) {
-        fprintf(stderr, "Error getting device ID\n");
-        exit(-1);
-    }
+    *device_id = selectDevice(*cpPlatform, options->deviceType, deviceIndex);
 
     // context
     *context = clCreateContext(0, 1, device_id, NULL, NULL, &err);
@@ -37,17 +348,47 @@ void oclSetup(cl_platform_id* cpPlatform,
     }
 
     // command queue
-    *queue = clCreateCommandQueue(*context, *device_id, 0, &err);
+    cl_command_queue_properties properties =
+        options->profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    *queue = clCreateCommandQueue(*context, *device_id, properties, &err);
     if (err != 0) {
         fprintf(stderr, "Error creating command queue\n");
         exit(-1);
     }
 
-    // program
+    // program, from the cache if possible
     char* source = readSourceFile(sourceFile);
+    if (buildOptions == NULL) {
+        buildOptions = "";
+    }
+    char path[4096];
+    uint64_t key = 0;
+    *program = NULL;
+    if (options->cacheDir != NULL) {
+        key = programKey(*cpPlatform, *device_id, source, buildOptions);
+        int length = snprintf(path, sizeof(path), "%s/program-%016llx.bin",
+                              options->cacheDir, (unsigned long long)key);
+        if (length < 0 || (size_t)length >= sizeof(path)) {
+            fprintf(stderr, "Cache directory name too long: %s\n",
+                    options->cacheDir);
+            exit(-1);
+        }
+        *program = loadProgram(path, key, *context, *device_id);
+        if (*program != NULL && clBuildProgram(*program, 1, device_id,
+                                               buildOptions, NULL,
+                                               NULL) != CL_SUCCESS) {
+            clReleaseProgram(*program);
+            *program = NULL;
+        }
+    }
+    if (*program != NULL) {
+        free(source);
+        return;
+    }
+
     *program = clCreateProgramWithSource(*context, 1,
                                          (const char**)&source, NULL, &err);
-    err = clBuildProgram(*program, 0, NULL, NULL, NULL, NULL);
+    err = clBuildProgram(*program, 1, device_id, buildOptions, NULL, NULL);
 
     if (err != CL_SUCCESS) {
         size_t len; char buffer[20480];
@@ -55,7 +396,12 @@ void oclSetup(cl_platform_id* cpPlatform,
                               sizeof(buffer), buffer, &len);
         fprintf(stderr, "Error building program\n");
         fprintf(stderr, "%s\n", buffer);
+        exit(-1);
+    }
+    if (options->cacheDir != NULL) {
+        storeProgram(path, key, *program);
     }
+    free(source);
 }
 
 /*
@@ -98,4 +444,53 @@ char* readSourceFile(const char* filename)
     source[size] = '\0';
 
     return source;
-}
\ No newline at end of file
+}
+
+/*
+ * Records the duration of an enqueued command in phase, once it has
+ * finished, and releases its event (see oclProfileCollect()). The queue
+ * must have been created with profiling. Does nothing if phase is NULL.
+ */
+void oclProfile(phase_t* phase, cl_event event)
+{
+    if (phase == NULL) {
+        return;
+    }
+    if (numPending == maxPending) {
+        maxPending = maxPending > 0 ? 2*maxPending : 256;
+        pendingEvents = (cl_event*)realloc(pendingEvents,
+                                           maxPending*sizeof(cl_event));
+        pendingPhases = (phase_t**)realloc(pendingPhases,
+                                           maxPending*sizeof(phase_t*));
+        if (pendingEvents == NULL || pendingPhases == NULL) {
+            fprintf(stderr, "Error allocating memory for events\n");
+            exit(-1);
+        }
+    }
+    pendingEvents[numPending] = event;
+    pendingPhases[numPending] = phase;
+    numPending++;
+}
+
+/*
+ * Records the commands passed to oclProfile() so far. Waits for them to
+ * finish, so it is meant to be called where the host waits for the device
+ * anyway, e.g. after clFinish().
+ */
+void oclProfileCollect(void)
+{
+    if (numPending > 0) {
+        clWaitForEvents(numPending, pendingEvents);
+    }
+    for (int i = 0; i < numPending; i++) {
+        cl_ulong start = 0;
+        cl_ulong end = 0;
+        clGetEventProfilingInfo(pendingEvents[i], CL_PROFILING_COMMAND_START,
+                                sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(pendingEvents[i], CL_PROFILING_COMMAND_END,
+                                sizeof(cl_ulong), &end, NULL);
+        profileAddDevice(pendingPhases[i], start, end);
+        clReleaseEvent(pendingEvents[i]);
+    }
+    numPending = 0;
+}
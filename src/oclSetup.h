@@ -1,5 +1,43 @@
-#include <Cl/opencl.h>
+#ifndef OCLSETUP_H
+#define OCLSETUP_H
+
+#include <CL/opencl.h>
+
+#include "profile.h"
+
+// increment whenever the layout of a cached program binary changes
+#define PROGRAM_CACHE_VERSION 1
+
+/*
+ * Which OpenCL device to use and where to cache compiled programs.
+ * platform is an index or part of the platform name and device is an index
+ * into the devices of deviceType ("gpu", "cpu", "accelerator" or "all").
+ * NULL picks the first platform, the first device, and a GPU if there is
+ * one. If cacheDir is not NULL, program binaries are stored there and
+ * reused by later runs on the same device and driver. devices is a comma
+ * separated list of devices for versions which use several of them (see
+ * oclSetupDevice()). If profiling is set, the command queue records the
+ * duration of each command (see oclProfile()).
+ */
+typedef struct {
+    const char* platform;
+    const char* device;
+    const char* deviceType;
+    const char* cacheDir;
+    const char* devices;
+    int profiling;
+} ocl_options_t;
 
 char* readSourceFile(const char*);
+void takeOclOptions(int*, char**, ocl_options_t*);
 void oclSetup(cl_platform_id*, cl_device_id*, cl_context*,
-              cl_command_queue*, cl_program*, char*);
+              cl_command_queue*, cl_program*, char*, const char*,
+              const ocl_options_t*);
+int oclNumDevices(const ocl_options_t*);
+void oclSetupDevice(int, cl_platform_id*, cl_device_id*, cl_context*,
+                    cl_command_queue*, cl_program*, char*, const char*,
+                    const ocl_options_t*);
+void oclProfile(phase_t*, cl_event);
+void oclProfileCollect(void);
+
+#endif
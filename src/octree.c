@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "particle.h"
+#include "octree.h"
+
+typedef struct {
+    octree_t* tree;
+    int capacity;
+
+    // scratch space used to reorder pseudo-particles by octant
+    float* sx;
+    float* sy;
+    float* sz;
+    float* sm;
+} builder_t;
+
+static void* allocate(size_t size)
+{
+    void* ptr = malloc(size);
+    if (ptr == NULL && size > 0) {
+        fprintf(stderr, "Error allocating memory for octree\n");
+        exit(-1);
+    }
+    return ptr;
+}
+
+static int addNode(builder_t* b)
+{
+    octree_t* tree = b->tree;
+    if (tree->numNodes == b->capacity) {
+        b->capacity *= 2;
+        tree->nodes = (octnode_t*)realloc(tree->nodes,
+                                          b->capacity*sizeof(octnode_t));
+        if (tree->nodes == NULL) {
+            fprintf(stderr, "Error allocating memory for octree\n");
+            exit(-1);
+        }
+    }
+    return tree->numNodes++;
+}
+
+/*
+ * Returns which octant of a cell centered at (cx, cy, cz) contains a point.
+ */
+static int octant(float x, float y, float z, float cx, float cy, float cz)
+{
+    return (x >= cx) | ((y >= cy) << 1) | ((z >= cz) << 2);
+}
+
+/*
+ * Creates the node for the cell centered at (cx, cy, cz) which contains the
+ * pseudo-particles from first to first+count-1, and recursively creates
+ * nodes for its non-empty octants.
+ */
+static void buildNode(builder_t* b, int first, int count,
+                      float cx, float cy, float cz, float size, int depth)
+{
+    octree_t* tree = b->tree;
+    float* x = tree->x + first;
+    float* y = tree->y + first;
+    float* z = tree->z + first;
+    float* m = tree->m + first;
+    int idx = addNode(b);
+
+    // center of mass and total mass, accumulated in double precision
+    double mx = 0.0, my = 0.0, mz = 0.0, mass = 0.0;
+    for (int i = 0; i < count; i++) {
+        mx += (double)m[i] * x[i];
+        my += (double)m[i] * y[i];
+        mz += (double)m[i] * z[i];
+        mass += m[i];
+    }
+
+    octnode_t node;
+    node.cx = mass > 0.0 ? mx / mass : cx;
+    node.cy = mass > 0.0 ? my / mass : cy;
+    node.cz = mass > 0.0 ? mz / mass : cz;
+    node.m = mass;
+    node.size = size;
+    node.first = first;
+    node.count = count;
+    node.leaf = (count <= LEAF_SIZE || depth >= MAX_DEPTH);
+    tree->nodes[idx] = node;
+
+    if (!node.leaf) {
+        // sort the pseudo-particles of this cell by octant
+        int offsets[9] = {0};
+        for (int i = 0; i < count; i++) {
+            offsets[octant(x[i], y[i], z[i], cx, cy, cz) + 1]++;
+        }
+        for (int k = 0; k < 8; k++) {
+            offsets[k + 1] += offsets[k];
+        }
+        int pos[8];
+        memcpy(pos, offsets, sizeof(pos));
+        for (int i = 0; i < count; i++) {
+            int j = pos[octant(x[i], y[i], z[i], cx, cy, cz)]++;
+            b->sx[j] = x[i];
+            b->sy[j] = y[i];
+            b->sz[j] = z[i];
+            b->sm[j] = m[i];
+        }
+        memcpy(x, b->sx, count*sizeof(float));
+        memcpy(y, b->sy, count*sizeof(float));
+        memcpy(z, b->sz, count*sizeof(float));
+        memcpy(m, b->sm, count*sizeof(float));
+
+        float quarter = size / 4;
+        for (int k = 0; k < 8; k++) {
+            int len = offsets[k + 1] - offsets[k];
+            if (len > 0) {
+                buildNode(b, first + offsets[k], len,
+                          cx + ((k & 1) ? quarter : -quarter),
+                          cy + ((k & 2) ? quarter : -quarter),
+                          cz + ((k & 4) ? quarter : -quarter),
+                          size / 2, depth + 1);
+            }
+        }
+    }
+
+    tree->nodes[idx].next = tree->numNodes;
+}
+
+/*
+ * Builds a Barnes-Hut octree from n pseudo-particles. The pseudo-particles
+ * do not move, so the tree only needs to be built once.
+ */
+octree_t* octreeBuild(const float* x, const float* y, const float* z,
+                      const float* m, int n, float theta)
+{
+    octree_t* tree = (octree_t*)allocate(sizeof(octree_t));
+    tree->n = n;
+    tree->theta = theta;
+    tree->map = NULL;
+    tree->x = (float*)allocate(n*sizeof(float));
+    tree->y = (float*)allocate(n*sizeof(float));
+    tree->z = (float*)allocate(n*sizeof(float));
+    tree->m = (float*)allocate(n*sizeof(float));
+    memcpy(tree->x, x, n*sizeof(float));
+    memcpy(tree->y, y, n*sizeof(float));
+    memcpy(tree->z, z, n*sizeof(float));
+    memcpy(tree->m, m, n*sizeof(float));
+
+    builder_t b;
+    b.tree = tree;
+    b.capacity = 64;
+    tree->nodes = (octnode_t*)allocate(b.capacity*sizeof(octnode_t));
+    tree->numNodes = 0;
+    b.sx = (float*)allocate(n*sizeof(float));
+    b.sy = (float*)allocate(n*sizeof(float));
+    b.sz = (float*)allocate(n*sizeof(float));
+    b.sm = (float*)allocate(n*sizeof(float));
+
+    // bounding cube of the pseudo-particles
+    float min[3] = {0.0, 0.0, 0.0};
+    float max[3] = {0.0, 0.0, 0.0};
+    for (int i = 0; i < n; i++) {
+        float p[3] = {x[i], y[i], z[i]};
+        for (int k = 0; k < 3; k++) {
+            if (i == 0 || p[k] < min[k]) {
+                min[k] = p[k];
+            }
+            if (i == 0 || p[k] > max[k]) {
+                max[k] = p[k];
+            }
+        }
+    }
+    float size = 0.0;
+    for (int k = 0; k < 3; k++) {
+        if (max[k] - min[k] > size) {
+            size = max[k] - min[k];
+        }
+    }
+    // make sure the particles on the upper bounds are inside the cube
+    size = size * 1.0001f + 1.0f;
+
+    if (n > 0) {
+        buildNode(&b, 0, n, (min[0] + max[0]) / 2, (min[1] + max[1]) / 2,
+                  (min[2] + max[2]) / 2, size, 0);
+    }
+
+    free(b.sx);
+    free(b.sy);
+    free(b.sz);
+    free(b.sm);
+
+    return tree;
+}
+
+/*
+ * Stores the acceleration on a test particle at (px, py, pz) in a[0], a[1]
+ * and a[2]. Cells which are far enough away (as determined by theta) are
+ * treated as a single particle at their center of mass; the pseudo-particles
+ * in leaves which are too close are summed directly.
+ */
+void octreeAcceleration(const octree_t* tree, float px, float py, float pz,
+                        float* a)
+{
+    const float theta2 = tree->theta * tree->theta;
+    float ax = 0.0;
+    float ay = 0.0;
+    float az = 0.0;
+
+    a[0] = 0.0;
+    a[1] = 0.0;
+    a[2] = 0.0;
+
+    int i = 0;
+    while (i < tree->numNodes) {
+        const octnode_t* node = &tree->nodes[i];
+        float dx = node->cx - px;
+        float dy = node->cy - py;
+        float dz = node->cz - pz;
+        float r2 = dx*dx + dy*dy + dz*dz;
+
+        if (node->size*node->size < theta2*r2) {
+            // far enough away to use the center of mass
+            float invr = 1.0f / sqrtf(r2 + (float)EPSILON);
+            float f = node->m * invr*invr*invr;
+            ax += f * dx;
+            ay += f * dy;
+            az += f * dz;
+            i = node->next;
+        } else if (node->leaf) {
+            addAcceleration(px, py, pz, tree->x + node->first,
+                            tree->y + node->first, tree->z + node->first,
+                            tree->m + node->first, node->count, a);
+            i = node->next;
+        } else {
+            i++;
+        }
+    }
+
+    a[0] += ax;
+    a[1] += ay;
+    a[2] += az;
+}
+
+/*
+ * Returns the gravitational potential at (px, py, pz), using the same
+ * opening criterion as octreeAcceleration().
+ */
+double octreePotential(const octree_t* tree, float px, float py, float pz)
+{
+    const float theta2 = tree->theta * tree->theta;
+    double phi = 0.0;
+
+    int i = 0;
+    while (i < tree->numNodes) {
+        const octnode_t* node = &tree->nodes[i];
+        double dx = node->cx - px;
+        double dy = node->cy - py;
+        double dz = node->cz - pz;
+        double r2 = dx*dx + dy*dy + dz*dz;
+
+        if (node->size*node->size < theta2*r2) {
+            phi -= node->m / sqrt(r2 + EPSILON);
+            i = node->next;
+        } else if (node->leaf) {
+            for (int j = node->first; j < node->first + node->count; j++) {
+                dx = tree->x[j] - px;
+                dy = tree->y[j] - py;
+                dz = tree->z[j] - pz;
+                phi -= tree->m[j] / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
+            }
+            i = node->next;
+        } else {
+            i++;
+        }
+    }
+    return phi;
+}
+
+void octreeFree(octree_t* tree)
+{
+    if (tree->map != NULL) {
+        unmapFile(tree->map);
+        free(tree);
+        return;
+    }
+    free(tree->nodes);
+    free(tree->x);
+    free(tree->y);
+    free(tree->z);
+    free(tree->m);
+    free(tree);
+}
@@ -0,0 +1,53 @@
+#ifndef OCTREE_H
+#define OCTREE_H
+
+#include "mapfile.h"
+
+// maximum number of pseudo-particles in a leaf
+#define LEAF_SIZE 16
+// cells are not subdivided further than this (e.g. coincident particles)
+#define MAX_DEPTH 32
+
+/*
+ * A cell of the octree. The nodes are stored in depth-first order, so the
+ * first child of a node directly follows it and next is the index of the
+ * node after the whole subtree (the number of nodes for the last subtree).
+ * The pseudo-particles of a cell are stored contiguously starting at first.
+ */
+typedef struct {
+    float cx;       // center of mass
+    float cy;
+    float cz;
+    float m;        // total mass
+    float size;     // side length of the cell
+    int first;
+    int count;
+    int leaf;
+    int next;
+} octnode_t;
+
+typedef struct octree {
+    octnode_t* nodes;
+    int numNodes;
+
+    // copy of the pseudo-particles, ordered by cell
+    float* x;
+    float* y;
+    float* z;
+    float* m;
+    int n;
+
+    // opening angle; a cell is not opened if size/distance < theta
+    float theta;
+
+    // if not NULL, the arrays point into this mapped cache file
+    mapfile_t* map;
+} octree_t;
+
+octree_t* octreeBuild(const float*, const float*, const float*, const float*,
+                      int, float);
+void octreeAcceleration(const octree_t*, float, float, float, float*);
+double octreePotential(const octree_t*, float, float, float);
+void octreeFree(octree_t*);
+
+#endif
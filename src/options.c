@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+/*
+ * Removes the arguments from index i to i+count-1 from argv.
+ */
+static void removeArgs(int* argc, char** argv, int i, int count)
+{
+    for (int j = i; j + count <= *argc; j++) {
+        argv[j] = argv[j + count];
+    }
+    *argc -= count;
+}
+
+/*
+ * Looks for an option of the form "name value" in the command line
+ * arguments. If it is found, both arguments are removed from argv so that
+ * the remaining positional arguments can be parsed as before.
+ * Returns the value of the option or NULL if the option is not present.
+ */
+char* takeOption(int* argc, char** argv, const char* name)
+{
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            if (i + 1 >= *argc) {
+                fprintf(stderr, "option %s requires a value\n", name);
+                exit(-1);
+            }
+            char* value = argv[i + 1];
+            removeArgs(argc, argv, i, 2);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Looks for a flag (an option without a value) in the command line
+ * arguments and removes it from argv.
+ * Returns 1 if the flag is present, 0 otherwise.
+ */
+int takeFlag(int* argc, char** argv, const char* name)
+{
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            removeArgs(argc, argv, i, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+char* takeOption(int*, char**, const char*);
+int takeFlag(int*, char**, const char*);
+
+#endif
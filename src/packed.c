@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "packed.h"
+
+// same softening as particle.h, which the GPU versions do not include
+#define EPSILON 0.000000001
+
+static const char* const storageNames[] = {"float", "half", "bf16"};
+
+/*
+ * Returns the STORAGE_ constant called name, or -1 if there is none.
+ */
+int parseStorage(const char* name)
+{
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, storageNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the name of a STORAGE_ constant.
+ */
+const char* storageName(int storage)
+{
+    return storageNames[storage];
+}
+
+static uint32_t floatBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static float bitsFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+/*
+ * Rounds f to the nearest half precision value, ties to even. Only used
+ * for values between -1 and 1, but correct for all finite values.
+ */
+static uint16_t floatToHalf(float f)
+{
+    uint32_t u = floatBits(f);
+    uint32_t sign = (u >> 16) & 0x8000;
+    uint32_t abs = u & 0x7fffffff;
+    if (abs >= 0x47800000) {
+        // 65536 or more, infinity or NaN
+        return sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00);
+    }
+    if (abs < 0x38800000) {
+        // below 2^-14, a subnormal half in units of 2^-24
+        return sign | (uint16_t)lrintf(bitsFloat(abs) * 16777216.0f);
+    }
+    // rebias the exponent from 127 to 15 and round off 13 bits of the
+    // mantissa; a carry into the exponent is still the right result
+    uint32_t h = (abs - 0x38000000) >> 13;
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        h++;
+    }
+    return sign | h;
+}
+
+/*
+ * Converts a half precision value to single precision. Shifting the bits
+ * into place leaves the exponent 112 too small, which the multiplication
+ * adds back, also for subnormal halves. Infinities and NaNs are never
+ * stored.
+ */
+static float halfToFloat(uint16_t h)
+{
+    uint32_t u = (uint32_t)(h & 0x7fff) << 13 | (uint32_t)(h & 0x8000) << 16;
+    return bitsFloat(u) * 0x1p112f;
+}
+
+/*
+ * Rounds f to the nearest bfloat16 value, the upper half of a float, ties
+ * to even.
+ */
+static uint16_t floatToBf16(float f)
+{
+    uint32_t u = floatBits(f);
+    return (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+static float bf16ToFloat(uint16_t b)
+{
+    return bitsFloat((uint32_t)b << 16);
+}
+
+/*
+ * Spreads the lower 10 bits of v to every third bit.
+ */
+static uint32_t spreadBits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+typedef struct {
+    uint32_t code;
+    int index;
+} morton_t;
+
+static int compareMorton(const void* a, const void* b)
+{
+    const morton_t* ma = (const morton_t*)a;
+    const morton_t* mb = (const morton_t*)b;
+    if (ma->code != mb->code) {
+        return ma->code < mb->code ? -1 : 1;
+    }
+    return ma->index - mb->index;
+}
+
+/*
+ * Returns the pseudo-particles in Morton order of their positions on a
+ * 1024^3 grid over their bounding box.
+ */
+static int* mortonOrder(const float* x, const float* y, const float* z,
+                        int stride, int n)
+{
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < n; i++) {
+        float p[3] = {x[i*stride], y[i*stride], z[i*stride]};
+        for (int k = 0; k < 3; k++) {
+            lo[k] = fminf(lo[k], p[k]);
+            hi[k] = fmaxf(hi[k], p[k]);
+        }
+    }
+
+    morton_t* codes = (morton_t*)malloc(n*sizeof(morton_t));
+    int* order = (int*)malloc(n*sizeof(int));
+    if (codes == NULL || order == NULL) {
+        fprintf(stderr, "Error allocating memory for packed pseudo-particles\n");
+        exit(-1);
+    }
+    for (int i = 0; i < n; i++) {
+        float p[3] = {x[i*stride], y[i*stride], z[i*stride]};
+        uint32_t cell[3];
+        for (int k = 0; k < 3; k++) {
+            float extent = hi[k] - lo[k];
+            cell[k] = extent > 0.0f
+                      ? (uint32_t)((p[k] - lo[k]) / extent * 1023.0f) : 0;
+        }
+        codes[i].code = spreadBits(cell[0]) | spreadBits(cell[1]) << 1
+                        | spreadBits(cell[2]) << 2;
+        codes[i].index = i;
+    }
+    qsort(codes, n, sizeof(morton_t), compareMorton);
+    for (int i = 0; i < n; i++) {
+        order[i] = codes[i].index;
+    }
+    free(codes);
+    return order;
+}
+
+/*
+ * Packs n pseudo-particles with the given storage (STORAGE_HALF or
+ * STORAGE_BF16). Pseudo-particle i is at x[i*stride], y[i*stride],
+ * z[i*stride] with mass m[i*stride], so both separate arrays (stride 1)
+ * and cl_float4 (stride 4) can be packed.
+ */
+packed_t* packCreate(const float* x, const float* y, const float* z,
+                     const float* m, int stride, int n, int storage)
+{
+    packed_t* p = (packed_t*)malloc(sizeof(packed_t));
+    int numCells = (n + CELL_SIZE - 1) / CELL_SIZE;
+    uint16_t* data = (uint16_t*)malloc(4*(size_t)n*sizeof(uint16_t));
+    float* cells = (float*)calloc(CELL_FIELDS*(size_t)numCells,
+                                  sizeof(float));
+    if (p == NULL || data == NULL || cells == NULL) {
+        fprintf(stderr, "Error allocating memory for packed pseudo-particles\n");
+        exit(-1);
+    }
+    p->n = n;
+    p->storage = storage;
+    p->data = data;
+    p->cells = cells;
+    p->numCells = numCells;
+
+    int* order = mortonOrder(x, y, z, stride, n);
+    for (int c = 0; c < numCells; c++) {
+        const int* members = order + c*CELL_SIZE;
+        int count = n - c*CELL_SIZE < CELL_SIZE ? n - c*CELL_SIZE : CELL_SIZE;
+        const float* coords[3] = {x, y, z};
+
+        // the center of the bounding box of the cell and the largest
+        // distance from it along any axis
+        float* cell = cells + CELL_FIELDS*c;
+        float radius = 0.0f;
+        float mass = 0.0f;
+        for (int k = 0; k < 3; k++) {
+            float lo = INFINITY;
+            float hi = -INFINITY;
+            for (int j = 0; j < count; j++) {
+                float v = coords[k][members[j]*stride];
+                lo = fminf(lo, v);
+                hi = fmaxf(hi, v);
+            }
+            cell[k] = 0.5f*(lo + hi);
+            for (int j = 0; j < count; j++) {
+                radius = fmaxf(radius,
+                               fabsf(coords[k][members[j]*stride] - cell[k]));
+            }
+        }
+        for (int j = 0; j < count; j++) {
+            mass = fmaxf(mass, fabsf(m[members[j]*stride]));
+        }
+        cell[3] = radius > 0.0f ? radius : 1.0f;
+        cell[4] = mass > 0.0f ? mass : 1.0f;
+
+        for (int j = 0; j < count; j++) {
+            int i = members[j]*stride;
+            float values[4] = {(x[i] - cell[0]) / cell[3],
+                               (y[i] - cell[1]) / cell[3],
+                               (z[i] - cell[2]) / cell[3],
+                               m[i] / cell[4]};
+            uint16_t* out = data + 4*((size_t)c*CELL_SIZE + j);
+            for (int k = 0; k < 4; k++) {
+                out[k] = storage == STORAGE_HALF ? floatToHalf(values[k])
+                                                 : floatToBf16(values[k]);
+            }
+        }
+    }
+    free(order);
+    return p;
+}
+
+/*
+ * Decodes count packed pseudo-particles starting at first into single
+ * precision arrays. The loops have no branches, so the compiler can
+ * vectorize them.
+ */
+void packDecode(const packed_t* p, int first, int count, float* x, float* y,
+                float* z, float* m)
+{
+    while (count > 0) {
+        int c = first / CELL_SIZE;
+        int len = (c + 1)*CELL_SIZE - first;
+        if (len > count) {
+            len = count;
+        }
+        const float* cell = p->cells + CELL_FIELDS*c;
+        const float cx = cell[0];
+        const float cy = cell[1];
+        const float cz = cell[2];
+        const float r = cell[3];
+        const float mass = cell[4];
+        const uint16_t* in = p->data + 4*(size_t)first;
+
+        if (p->storage == STORAGE_HALF) {
+            for (int j = 0; j < len; j++) {
+                x[j] = cx + r*halfToFloat(in[4*j]);
+                y[j] = cy + r*halfToFloat(in[4*j + 1]);
+                z[j] = cz + r*halfToFloat(in[4*j + 2]);
+                m[j] = mass*halfToFloat(in[4*j + 3]);
+            }
+        } else {
+            for (int j = 0; j < len; j++) {
+                x[j] = cx + r*bf16ToFloat(in[4*j]);
+                y[j] = cy + r*bf16ToFloat(in[4*j + 1]);
+                z[j] = cz + r*bf16ToFloat(in[4*j + 2]);
+                m[j] = mass*bf16ToFloat(in[4*j + 3]);
+            }
+        }
+        first += len;
+        count -= len;
+        x += len;
+        y += len;
+        z += len;
+        m += len;
+    }
+}
+
+/*
+ * Compares the accelerations caused by the packed pseudo-particles to
+ * those caused by the original ones (as passed to packCreate()) at up to
+ * ERROR_SAMPLES of the count test particles at (px, py, pz), spaced
+ * evenly, with test particle i at px[i*tstride]. Both sums are done in
+ * double precision, so only the error of the storage is measured. Stores
+ * the largest and the root mean square error relative to the magnitude of
+ * the acceleration in maxError and rmsError.
+ */
+void packError(const packed_t* p, const float* x, const float* y,
+               const float* z, const float* m, int stride, const float* px,
+               const float* py, const float* pz, int tstride, int count,
+               double* maxError, double* rmsError)
+{
+    float* decoded = (float*)malloc(4*(size_t)p->n*sizeof(float));
+    if (decoded == NULL) {
+        fprintf(stderr, "Error allocating memory for packed pseudo-particles\n");
+        exit(-1);
+    }
+    float* dx = decoded;
+    float* dy = decoded + p->n;
+    float* dz = decoded + 2*(size_t)p->n;
+    float* dm = decoded + 3*(size_t)p->n;
+    packDecode(p, 0, p->n, dx, dy, dz, dm);
+
+    int samples = count < ERROR_SAMPLES ? count : ERROR_SAMPLES;
+    double sum = 0.0;
+    *maxError = 0.0;
+    for (int s = 0; s < samples; s++) {
+        int t = (int)((long long)s*count / samples)*tstride;
+        double ref[3] = {0.0, 0.0, 0.0};
+        double packed[3] = {0.0, 0.0, 0.0};
+        for (int i = 0; i < p->n; i++) {
+            double d[3] = {x[i*stride] - (double)px[t],
+                           y[i*stride] - (double)py[t],
+                           z[i*stride] - (double)pz[t]};
+            double invr = 1.0 / sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]
+                                     + EPSILON);
+            double f = m[i*stride]*invr*invr*invr;
+
+            double e[3] = {dx[i] - (double)px[t], dy[i] - (double)py[t],
+                           dz[i] - (double)pz[t]};
+            double inve = 1.0 / sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]
+                                     + EPSILON);
+            double g = dm[i]*inve*inve*inve;
+            for (int k = 0; k < 3; k++) {
+                ref[k] += f*d[k];
+                packed[k] += g*e[k];
+            }
+        }
+        double norm = sqrt(ref[0]*ref[0] + ref[1]*ref[1] + ref[2]*ref[2]);
+        double diff = sqrt((packed[0] - ref[0])*(packed[0] - ref[0])
+                           + (packed[1] - ref[1])*(packed[1] - ref[1])
+                           + (packed[2] - ref[2])*(packed[2] - ref[2]));
+        double error = norm > 0.0 ? diff / norm : diff;
+        sum += error*error;
+        if (error > *maxError) {
+            *maxError = error;
+        }
+    }
+    *rmsError = samples > 0 ? sqrt(sum / samples) : 0.0;
+    free(decoded);
+}
+
+/*
+ * Frees the packed pseudo-particles.
+ */
+void packFree(packed_t* p)
+{
+    free(p->data);
+    free(p->cells);
+    free(p);
+}
@@ -0,0 +1,47 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include <stdint.h>
+
+// storage of the pseudo-particles, see packCreate()
+#define STORAGE_FLOAT 0     // 4 floats, 16 bytes per pseudo-particle
+#define STORAGE_HALF 1      // 4 IEEE half precision values, 8 bytes
+#define STORAGE_BF16 2      // 4 bfloat16 values, 8 bytes
+
+// number of consecutive pseudo-particles which share a cell
+#define CELL_SIZE 256
+// floats per cell: center (x, y, z), radius, largest mass and padding,
+// so a cell is a float8 on the GPU
+#define CELL_FIELDS 8
+
+// test particles sampled by packError()
+#define ERROR_SAMPLES 64
+
+/*
+ * A copy of the pseudo-particles in 16-bit storage. The pseudo-particles
+ * are sorted along a Morton curve and split into cells of CELL_SIZE, so
+ * the pseudo-particles of a cell are close to each other. Each stores its
+ * position relative to the center of its cell in units of the radius of
+ * the cell, and its mass relative to the largest mass in the cell, so all
+ * values are between -1 and 1. Only the storage is reduced; decoding gives
+ * single precision values for the arithmetic.
+ */
+typedef struct packed {
+    int n;
+    int storage;        // STORAGE_HALF or STORAGE_BF16
+    uint16_t* data;     // x, y, z and m of each pseudo-particle
+    float* cells;       // CELL_FIELDS per cell
+    int numCells;
+} packed_t;
+
+int parseStorage(const char*);
+const char* storageName(int);
+packed_t* packCreate(const float*, const float*, const float*, const float*,
+                     int, int, int);
+void packDecode(const packed_t*, int, int, float*, float*, float*, float*);
+void packError(const packed_t*, const float*, const float*, const float*,
+               const float*, int, const float*, const float*, const float*,
+               int, int, double*, double*);
+void packFree(packed_t*);
+
+#endif
@@ -1,38 +1,690 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
+
 #include "particle.h"
+#include "kernels.h"
+#include "octree.h"
+#include "grid.h"
+#include "packed.h"
+
+typedef struct {
+    const char* name;
+    accel_kernel_t exact;
+    accel_kernel_t fast;
+    tile_kernel_t exactTile;
+    tile_kernel_t fastTile;
+    accel_kernel_t kahan;
+    accel_kernel_t dbl;
+} kernel_info_t;
+
+#define KERNEL_INFO(name, kernel) \
+    {name, kernel, kernel##Fast, kernel##Tile, kernel##FastTile, \
+     kernel##Kahan, kernel##Double}
+
+static const char* const precisionNames[] = {"float", "kahan", "double"};
+static const char* const integratorNames[] = {"euler", "leapfrog", "rk4",
+                                              "adaptive"};
+
+// smallest step of INTEGRATOR_ADAPTIVE, as a fraction of the time step.
+// Steps this small are accepted whatever their error.
+#define MIN_STEP 1e-6
+
+// available kernels, in order of preference
+static const kernel_info_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    KERNEL_INFO("avx512", accelAvx512),
+    KERNEL_INFO("avx2",   accelAvx2),
+    KERNEL_INFO("sse",    accelSse),
+#endif
+    KERNEL_INFO("scalar", accelScalar)
+};
+static const int numKernels = sizeof(kernels) / sizeof(kernels[0]);
+
+static accel_kernel_t currentKernel = accelScalar;
+static tile_kernel_t currentTileKernel = accelScalarTile;
+static const char* currentName = "scalar";
+static int currentPrecision = PRECISION_FLOAT;
+static int currentFast = 0;
+static int currentIntegrator = INTEGRATOR_EULER;
+static double currentTolerance = 1e-6;
+
+/*
+ * Returns 1 if the host CPU can run the given kernel.
+ */
+static int kernelSupported(const kernel_info_t* k)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(k->name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (strcmp(k->name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    if (strcmp(k->name, "sse") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Selects the kernel used to calculate accelerations. name is one of
+ * "avx512", "avx2", "sse", "scalar" or "auto" (or NULL), which picks the
+ * widest kernel supported by the host CPU. precision is one of the
+ * PRECISION_ constants. If fast is non-zero and the precision is
+ * PRECISION_FLOAT, the kernel uses an approximate reciprocal square root
+ * instead of an exact one.
+ * Returns 0 if the kernel is unknown or not supported by the host CPU.
+ */
+int selectKernel(const char* name, int fast, int precision)
+{
+    int automatic = (name == NULL || strcmp(name, "auto") == 0);
+
+    for (int i = 0; i < numKernels; i++) {
+        if ((automatic || strcmp(name, kernels[i].name) == 0)
+                && kernelSupported(&kernels[i])) {
+            if (precision == PRECISION_KAHAN) {
+                currentKernel = kernels[i].kahan;
+                currentTileKernel = NULL;
+            } else if (precision == PRECISION_DOUBLE) {
+                currentKernel = kernels[i].dbl;
+                currentTileKernel = NULL;
+            } else {
+                currentKernel = fast ? kernels[i].fast : kernels[i].exact;
+                currentTileKernel = fast ? kernels[i].fastTile
+                                         : kernels[i].exactTile;
+            }
+            currentName = kernels[i].name;
+            currentPrecision = precision;
+            currentFast = fast && precision == PRECISION_FLOAT;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the name of the selected kernel.
+ */
+const char* kernelName(void)
+{
+    return currentName;
+}
+
+/*
+ * Returns 1 if the selected kernel uses the approximate reciprocal square
+ * root.
+ */
+int kernelFast(void)
+{
+    return currentFast;
+}
+
+/*
+ * Returns the PRECISION_ constant for "float", "kahan" or "double", or -1
+ * if name is none of them.
+ */
+int parsePrecision(const char* name)
+{
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, precisionNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the name of the precision of the selected kernel.
+ */
+const char* precisionName(void)
+{
+    return precisionNames[currentPrecision];
+}
+
+/*
+ * Selects the method used by updateParticles() to advance the test
+ * particles, one of the INTEGRATOR_ constants. tolerance is the error
+ * allowed per step by INTEGRATOR_ADAPTIVE, relative to the size of the
+ * position and velocity.
+ */
+void selectIntegrator(int integrator, float tolerance)
+{
+    currentIntegrator = integrator;
+    currentTolerance = tolerance;
+}
 
 /*
- * Takes one test particle, n amount of x- y- and z-coordiates, and masses
+ * Returns the INTEGRATOR_ constant for "euler", "leapfrog", "rk4" or
+ * "adaptive", or -1 if name is none of them.
+ */
+int parseIntegrator(const char* name)
+{
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, integratorNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the name of the selected integrator.
+ */
+const char* integratorName(void)
+{
+    return integratorNames[currentIntegrator];
+}
+
+/*
+ * Allocates n test particles with a single allocation. Each array is padded
+ * to a whole number of cache lines, so all of them start on a cache line.
+ * The step sizes are set to 0, the other contents are not initialized.
+ */
+tparticles_t* createTParticles(int n)
+{
+    const size_t perLine = CACHE_LINE / sizeof(float);
+    size_t stride = ((size_t)n + perLine - 1) / perLine * perLine;
+
+    tparticles_t* ps = (tparticles_t*)malloc(sizeof(tparticles_t));
+    if (ps == NULL) {
+        fprintf(stderr, "Error allocating memory for test particles\n");
+        exit(-1);
+    }
+    // C99 has no aligned allocation, so round the start up by hand
+    ps->arena = malloc(8*stride*sizeof(float) + CACHE_LINE);
+    if (ps->arena == NULL) {
+        fprintf(stderr, "Error allocating memory for test particles\n");
+        exit(-1);
+    }
+    uintptr_t start = ((uintptr_t)ps->arena + CACHE_LINE - 1)
+                      / CACHE_LINE * CACHE_LINE;
+    float* arrays = (float*)start;
+
+    ps->x = arrays;
+    ps->y = arrays + stride;
+    ps->z = arrays + 2*stride;
+    ps->vx = arrays + 3*stride;
+    ps->vy = arrays + 4*stride;
+    ps->vz = arrays + 5*stride;
+    ps->m = arrays + 6*stride;
+    ps->h = arrays + 7*stride;
+    memset(ps->h, 0, n*sizeof(float));
+    ps->n = n;
+    return ps;
+}
+
+void freeTParticles(tparticles_t* ps)
+{
+    free(ps->arena);
+    free(ps);
+}
+
+/*
+ * Returns count test particles of ps starting at begin, sharing its
+ * arrays.
+ */
+tparticles_t sliceTParticles(const tparticles_t* ps, int begin, int count)
+{
+    tparticles_t s = *ps;
+    s.x += begin;
+    s.y += begin;
+    s.z += begin;
+    s.vx += begin;
+    s.vy += begin;
+    s.vz += begin;
+    s.m += begin;
+    s.h += begin;
+    s.n = count;
+    return s;
+}
+
+/*
+ * Adds the acceleration caused by n pseudo-particles on a test particle at
+ * (px, py, pz) to a[0], a[1] and a[2], using the selected kernel.
+ */
+void addAcceleration(float px, float py, float pz, const float* x,
+                     const float* y, const float* z, const float* m, int n,
+                     float* a)
+{
+    currentKernel(px, py, pz, x, y, z, m, n, a);
+}
+
+/*
+ * Takes test particle i, n amount of x- y- and z-coordiates, and masses.
+ * Stores the acceleration of the test particle in a[0], a[1] and a[2].
+ */
+void computeAcceleration(const tparticles_t* ps, int i, const float* x,
+                         const float* y, const float* z, const float* m,
+                         int n, float* a)
+{
+    a[0] = 0.0;
+    a[1] = 0.0;
+    a[2] = 0.0;
+    currentKernel(ps->x[i], ps->y[i], ps->z[i], x, y, z, m, n, a);
+}
+
+/*
+ * Stores the accelerations caused by the packed pseudo-particles on count
+ * test particles at (px[j], py[j], pz[j]) in a[j]. Each tile is decoded to
+ * single precision once and then summed by the kernels for all count test
+ * particles, as in blockAcceleration(), so only the loads are narrower.
+ */
+static void packedAcceleration(const packed_t* packed, const float* px,
+                               const float* py, const float* pz, int count,
+                               float (*a)[3])
+{
+    float x[TILE_SIZE];
+    float y[TILE_SIZE];
+    float z[TILE_SIZE];
+    float m[TILE_SIZE];
+    const int n = packed->n;
+
+    for (int j = 0; j < count; j++) {
+        a[j][0] = 0.0;
+        a[j][1] = 0.0;
+        a[j][2] = 0.0;
+    }
+
+    for (int tile = 0; tile < n; tile += TILE_SIZE) {
+        int len = n - tile < TILE_SIZE ? n - tile : TILE_SIZE;
+        packDecode(packed, tile, len, x, y, z, m);
+        for (int j = 0; j < count; j++) {
+            if (len == TILE_SIZE && currentTileKernel != NULL) {
+                currentTileKernel(px[j], py[j], pz[j], x, y, z, m, a[j]);
+            } else {
+                currentKernel(px[j], py[j], pz[j], x, y, z, m, len, a[j]);
+            }
+        }
+    }
+}
+
+/*
+ * Stores the acceleration caused by the field on a test particle at
+ * (px, py, pz) in a[0], a[1] and a[2].
+ */
+void fieldAcceleration(const field_t* field, float px, float py, float pz,
+                       float* a)
+{
+    if (field->grid != NULL && gridAcceleration(field->grid, px, py, pz, a)) {
+        return;
+    }
+    if (field->tree != NULL) {
+        octreeAcceleration(field->tree, px, py, pz, a);
+        return;
+    }
+    if (field->packed != NULL) {
+        packedAcceleration(field->packed, &px, &py, &pz, 1, (float (*)[3])a);
+        return;
+    }
+    a[0] = 0.0;
+    a[1] = 0.0;
+    a[2] = 0.0;
+    currentKernel(px, py, pz, field->x, field->y, field->z, field->m,
+                  field->n, a);
+}
+
+/*
+ * Returns the gravitational potential of the field at (px, py, pz).
+ * The grid is not used, so this is only an approximation if the field
+ * has an octree.
+ */
+double fieldPotential(const field_t* field, float px, float py, float pz)
+{
+    if (field->tree != NULL) {
+        return octreePotential(field->tree, px, py, pz);
+    }
+
+    double phi = 0.0;
+    for (int i = 0; i < field->n; i++) {
+        double dx = field->x[i] - px;
+        double dy = field->y[i] - py;
+        double dz = field->z[i] - pz;
+        phi -= field->m[i] / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
+    }
+    return phi;
+}
+
+/*
+ * Updates the position and velocity of test particle i given its
+ * acceleration a and a time-step t.
+ */
+void integrateParticle(tparticles_t* ps, int i, const float* a, float t)
+{
+    ps->x[i] += ps->vx[i] * t + 0.5 * a[0] * t*t;
+    ps->y[i] += ps->vy[i] * t + 0.5 * a[1] * t*t;
+    ps->z[i] += ps->vz[i] * t + 0.5 * a[2] * t*t;
+
+    ps->vx[i] += a[0] * t;
+    ps->vy[i] += a[1] * t;
+    ps->vz[i] += a[2] * t;
+}
+
+/*
+ * Updates the positions and velocities of count consecutive test particles
+ * starting at begin, given their accelerations a. Does the same as
+ * integrateParticle() for each of them, but as one loop over the arrays
+ * which the compiler can vectorize.
+ */
+static void integrateBlock(tparticles_t* ps, int begin, int count,
+                           float (*a)[3], float t)
+{
+    float* x = ps->x + begin;
+    float* y = ps->y + begin;
+    float* z = ps->z + begin;
+    float* vx = ps->vx + begin;
+    float* vy = ps->vy + begin;
+    float* vz = ps->vz + begin;
+
+    for (int j = 0; j < count; j++) {
+        x[j] += vx[j] * t + 0.5 * a[j][0] * t*t;
+        y[j] += vy[j] * t + 0.5 * a[j][1] * t*t;
+        z[j] += vz[j] * t + 0.5 * a[j][2] * t*t;
+
+        vx[j] += a[j][0] * t;
+        vy[j] += a[j][1] * t;
+        vz[j] += a[j][2] * t;
+    }
+}
+
+/*
+ * Takes test particle i, n amount of x- y- and z-coordiates, and masses
  * and a time-step t.
  * Updates the position and velocity of the test particle.
  */
-void updateParticle(particle_t* p, float* x, float* y, float* z, float* m, int n, float t)
+void updateParticle(tparticles_t* ps, int i, float* x, float* y, float* z,
+                    float* m, int n, float t)
+{
+    float a[3];
+    computeAcceleration(ps, i, x, y, z, m, n, a);
+    integrateParticle(ps, i, a, t);
+}
+
+/*
+ * Stores the accelerations caused by the field on count test particles at
+ * (px[j], py[j], pz[j]) in a[j]. The pseudo-particles are processed in
+ * tiles of TILE_SIZE and each tile is used by all count (up to BLOCK_SIZE)
+ * test particles while it is still in cache, rather than streaming all
+ * pseudo-particles from memory for every test particle. Whole tiles use the
+ * version of the kernel specialized for TILE_SIZE pseudo-particles. With
+ * PRECISION_KAHAN or PRECISION_DOUBLE there is a single tile, so the sum
+ * is only rounded to single precision once.
+ * The sum for each test particle still goes through the pseudo-particles in
+ * order, so with the scalar kernel the result is identical to calling
+ * computeAcceleration() for each test particle.
+ * If the field has a grid or an octree, it is used instead of the tiles,
+ * and if it has packed pseudo-particles, they are decoded one tile at a
+ * time (see packedAcceleration()).
+ */
+static void blockAcceleration(const field_t* field, const float* px,
+                              const float* py, const float* pz, int count,
+                              float (*a)[3])
+{
+    const float* x = field->x;
+    const float* y = field->y;
+    const float* z = field->z;
+    const float* m = field->m;
+    const int n = field->n;
+    // compensated and double precision sums must not be rounded per tile
+    const int tileSize = currentTileKernel != NULL ? TILE_SIZE : n;
+
+    if (field->grid != NULL || field->tree != NULL) {
+        for (int j = 0; j < count; j++) {
+            fieldAcceleration(field, px[j], py[j], pz[j], a[j]);
+        }
+        return;
+    }
+    if (field->packed != NULL) {
+        packedAcceleration(field->packed, px, py, pz, count, a);
+        return;
+    }
+
+    for (int j = 0; j < count; j++) {
+        a[j][0] = 0.0;
+        a[j][1] = 0.0;
+        a[j][2] = 0.0;
+    }
+
+    for (int tile = 0; tile < n; tile += tileSize) {
+        int len = n - tile < tileSize ? n - tile : tileSize;
+        if (len == TILE_SIZE && currentTileKernel != NULL) {
+            for (int j = 0; j < count; j++) {
+                currentTileKernel(px[j], py[j], pz[j], x + tile,
+                                  y + tile, z + tile, m + tile, a[j]);
+            }
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            currentKernel(px[j], py[j], pz[j],
+                          x + tile, y + tile, z + tile, m + tile,
+                          len, a[j]);
+        }
+    }
+}
+
+/*
+ * Advances count consecutive test particles starting at begin by t with
+ * the drift-kick-drift leapfrog, which is symplectic and second order for
+ * a single evaluation of the accelerations per step.
+ */
+static void leapfrogBlock(tparticles_t* ps, int begin, int count,
+                          const field_t* field, float t)
 {
-    float ax = 0.0;
-    float ay = 0.0;
-    float az = 0.0;
+    float a[BLOCK_SIZE][3];
+    float* x = ps->x + begin;
+    float* y = ps->y + begin;
+    float* z = ps->z + begin;
+    float* vx = ps->vx + begin;
+    float* vy = ps->vy + begin;
+    float* vz = ps->vz + begin;
+    const float half = 0.5f * t;
 
-    // loop through each pseudo-particle and calculate acceleration
-    for (int i = 0; i < n; i++) {
-        float dx = x[i] - p->x;
-        float dy = y[i] - p->y;
-        float dz = z[i] - p->z;
+    // drift to the middle of the step
+    for (int j = 0; j < count; j++) {
+        x[j] += vx[j] * half;
+        y[j] += vy[j] * half;
+        z[j] += vz[j] * half;
+    }
+
+    blockAcceleration(field, x, y, z, count, a);
+
+    // kick, then drift to the end of the step
+    for (int j = 0; j < count; j++) {
+        vx[j] += a[j][0] * t;
+        vy[j] += a[j][1] * t;
+        vz[j] += a[j][2] * t;
+
+        x[j] += vx[j] * half;
+        y[j] += vy[j] * half;
+        z[j] += vz[j] * half;
+    }
+}
+
+/*
+ * Advances count consecutive test particles starting at begin by t with
+ * the classic fourth order Runge-Kutta method, which evaluates the
+ * accelerations four times per step.
+ */
+static void rk4Block(tparticles_t* ps, int begin, int count,
+                     const field_t* field, float t)
+{
+    // weight of each stage and where the next stage is evaluated, as a
+    // fraction of the step
+    static const float weight[4] = {1.0f, 2.0f, 2.0f, 1.0f};
+    static const float offset[4] = {0.5f, 0.5f, 1.0f, 0.0f};
+
+    float a[BLOCK_SIZE][3];
+    float p[3][BLOCK_SIZE];     // position of the current stage
+    float k[3][BLOCK_SIZE];     // velocity of the current stage
+    float sumX[3][BLOCK_SIZE];  // weighted sums of the velocities
+    float sumV[3][BLOCK_SIZE];  // weighted sums of the accelerations
+    float* x[3] = {ps->x + begin, ps->y + begin, ps->z + begin};
+    float* v[3] = {ps->vx + begin, ps->vy + begin, ps->vz + begin};
+
+    for (int d = 0; d < 3; d++) {
+        for (int j = 0; j < count; j++) {
+            p[d][j] = x[d][j];
+            k[d][j] = v[d][j];
+            sumX[d][j] = 0.0f;
+            sumV[d][j] = 0.0f;
+        }
+    }
+
+    for (int s = 0; s < 4; s++) {
+        blockAcceleration(field, p[0], p[1], p[2], count, a);
+        float h = offset[s] * t;
+        for (int d = 0; d < 3; d++) {
+            for (int j = 0; j < count; j++) {
+                sumX[d][j] += weight[s] * k[d][j];
+                sumV[d][j] += weight[s] * a[j][d];
+                // the next stage starts from the state at the beginning
+                p[d][j] = x[d][j] + h * k[d][j];
+                k[d][j] = v[d][j] + h * a[j][d];
+            }
+        }
+    }
+
+    for (int d = 0; d < 3; d++) {
+        for (int j = 0; j < count; j++) {
+            x[d][j] += t / 6.0f * sumX[d][j];
+            v[d][j] += t / 6.0f * sumV[d][j];
+        }
+    }
+}
+
+/*
+ * Stores the derivative of the state y (position and velocity) of a test
+ * particle in dy.
+ */
+static void derivative(const field_t* field, const double* y, double* dy)
+{
+    float a[3];
+    fieldAcceleration(field, (float)y[0], (float)y[1], (float)y[2], a);
+    for (int d = 0; d < 3; d++) {
+        dy[d] = y[3 + d];
+        dy[3 + d] = a[d];
+    }
+}
+
+/*
+ * Returns the length of the 3-vector v.
+ */
+static double norm(const double* v)
+{
+    return sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+}
+
+/*
+ * Advances test particle i by t with the Bogacki-Shampine 3(2) method, in
+ * as many steps as it takes to keep the estimated error of each step below
+ * the tolerance, relative to the size of the position and velocity. A step
+ * takes three evaluations of the acceleration, since the last one is the
+ * first one of the next step. The step size carries over to the next call
+ * in ps->h.
+ */
+static void adaptiveParticle(tparticles_t* ps, int i, const field_t* field,
+                             float t)
+{
+    double y[6] = {ps->x[i], ps->y[i], ps->z[i],
+                   ps->vx[i], ps->vy[i], ps->vz[i]};
+    double k1[6], k2[6], k3[6], k4[6];
+    double next[6];
+    double stage[6];
+    double want = ps->h[i] > 0.0f && ps->h[i] < t ? ps->h[i] : t;
+    double remaining = t;
+
+    derivative(field, y, k1);
+    while (remaining > 0.0) {
+        double h = want < remaining ? want : remaining;
 
-        float invr = 1.0 / sqrt(dx*dx + dy*dy + dz*dz + EPSILON);
-        float invr3 = invr*invr*invr;
-        float f = m[i] * invr3;
+        for (int d = 0; d < 6; d++) {
+            stage[d] = y[d] + 0.5*h*k1[d];
+        }
+        derivative(field, stage, k2);
+        for (int d = 0; d < 6; d++) {
+            stage[d] = y[d] + 0.75*h*k2[d];
+        }
+        derivative(field, stage, k3);
+        for (int d = 0; d < 6; d++) {
+            next[d] = y[d] + h*(2.0/9.0*k1[d] + 1.0/3.0*k2[d]
+                                + 4.0/9.0*k3[d]);
+        }
+        derivative(field, next, k4);
 
-        ax += f * dx;
-        ay += f * dy;
-        az += f * dz;
+        // difference to the embedded second order solution
+        double err[6];
+        for (int d = 0; d < 6; d++) {
+            err[d] = h*(-5.0/72.0*k1[d] + 1.0/12.0*k2[d] + 1.0/9.0*k3[d]
+                        - 1.0/8.0*k4[d]);
+        }
+        double scaleX = currentTolerance*(norm(y) + h*norm(k1)) + DBL_MIN;
+        double scaleV = currentTolerance*(norm(y + 3) + h*norm(k1 + 3))
+                        + DBL_MIN;
+        double ratio = fmax(norm(err) / scaleX, norm(err + 3) / scaleV);
+
+        // the error of a third order step grows with h^3
+        double factor = ratio > 0.0 ? 0.9*pow(ratio, -1.0/3.0) : 5.0;
+        factor = fmin(fmax(factor, 0.2), 5.0);
+
+        if (ratio <= 1.0 || h <= MIN_STEP*t) {
+            memcpy(y, next, sizeof(y));
+            memcpy(k1, k4, sizeof(k1));
+            remaining -= h;
+            if (h < want) {
+                // the last step was cut short, which says nothing about
+                // the size of the next one
+                continue;
+            }
+        }
+        want = h*factor;
+    }
+
+    ps->x[i] = y[0];
+    ps->y[i] = y[1];
+    ps->z[i] = y[2];
+    ps->vx[i] = y[3];
+    ps->vy[i] = y[4];
+    ps->vz[i] = y[5];
+    ps->h[i] = want;
+}
+
+/*
+ * Updates the test particles from begin up to (not including) end by a
+ * time step t, with the integrator chosen by selectIntegrator(). The test
+ * particles are updated in blocks of up to BLOCK_SIZE, which share the
+ * tiles of pseudo-particles (see blockAcceleration()), except with
+ * INTEGRATOR_ADAPTIVE where each test particle takes its own steps.
+ * With INTEGRATOR_EULER and the scalar kernel the result is identical to
+ * calling updateParticle() for each test particle.
+ */
+void updateParticles(tparticles_t* ps, int begin, int end,
+                     const field_t* field, float t)
+{
+    float a[BLOCK_SIZE][3];
+
+    if (currentIntegrator == INTEGRATOR_ADAPTIVE) {
+        for (int i = begin; i < end; i++) {
+            adaptiveParticle(ps, i, field, t);
+        }
+        return;
     }
 
-    // update position and velocity of the test particle
-    p->x += p->vx * t + 0.5 * ax * t*t;
-    p->y += p->vy * t + 0.5 * ay * t*t;
-    p->z += p->vz * t + 0.5 * az * t*t;
+    for (int block = begin; block < end; block += BLOCK_SIZE) {
+        int size = end - block < BLOCK_SIZE ? end - block : BLOCK_SIZE;
 
-    p->vx += ax * t;
-    p->vy += ay * t;
-    p->vz += az * t;
-}
\ No newline at end of file
+        if (currentIntegrator == INTEGRATOR_LEAPFROG) {
+            leapfrogBlock(ps, block, size, field, t);
+        } else if (currentIntegrator == INTEGRATOR_RK4) {
+            rk4Block(ps, block, size, field, t);
+        } else {
+            blockAcceleration(field, ps->x + block, ps->y + block,
+                              ps->z + block, size, a);
+            integrateBlock(ps, block, size, a, t);
+        }
+    }
+}
@@ -1,13 +1,96 @@
+#ifndef PARTICLE_H
+#define PARTICLE_H
+
 #define EPSILON 0.000000001
 
+// number of pseudo-particles which are processed together by
+// updateParticles() (16 bytes each, so a tile fits in L2 cache)
+#define TILE_SIZE 4096
+// maximum number of test particles which share each tile
+#define BLOCK_SIZE 64
+
+// precision of the sums of the accelerations, see selectKernel()
+#define PRECISION_FLOAT 0   // single precision
+#define PRECISION_KAHAN 1   // single precision with compensated summation
+#define PRECISION_DOUBLE 2  // double precision
+
+// methods of updateParticles(), see selectIntegrator()
+#define INTEGRATOR_EULER 0      // x += v t + a t^2 / 2, v += a t
+#define INTEGRATOR_LEAPFROG 1   // drift-kick-drift leapfrog
+#define INTEGRATOR_RK4 2        // classic 4th order Runge-Kutta
+#define INTEGRATOR_ADAPTIVE 3   // Bogacki-Shampine 3(2) with error control
+
+// alignment of the arrays of test particles, in bytes
+#define CACHE_LINE 64
+
+/*
+ * The test particles, stored as one array per component. All arrays share
+ * a single allocation (the arena) and each starts on a cache line, so the
+ * positions and velocities of consecutive test particles are loaded
+ * sequentially. The masses are kept for output only and are never touched
+ * by the updates. h is the size of the next step of each test particle
+ * with INTEGRATOR_ADAPTIVE or with block steps (see blockstep.c), or 0 if
+ * it has not taken a step yet.
+ */
 typedef struct {
-    float x;
-    float y;
-    float z;
-    float m;
-    float vx;
-    float vy;
-    float vz;
-} particle_t;
-
-void updateParticle(particle_t*, float*, float*, float*, float*, int, float);
\ No newline at end of file
+    float* x;
+    float* y;
+    float* z;
+    float* vx;
+    float* vy;
+    float* vz;
+    float* m;
+    float* h;
+    int n;
+    void* arena;
+} tparticles_t;
+
+typedef struct octree octree_t;
+typedef struct grid grid_t;
+typedef struct packed packed_t;
+
+/*
+ * The pseudo-particles which act on the test particles. If grid is not
+ * NULL, accelerations are interpolated from the grid wherever it covers the
+ * test particle. Otherwise, if tree is not NULL, accelerations are
+ * approximated with the Barnes-Hut octree instead of summing over every
+ * pseudo-particle. If packed is not NULL, the direct sums read the
+ * pseudo-particles from this 16-bit copy (see packed.h) instead of x, y, z
+ * and m, which requires PRECISION_FLOAT.
+ */
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+    float* m;
+    int n;
+    const octree_t* tree;
+    const grid_t* grid;
+    const packed_t* packed;
+} field_t;
+
+tparticles_t* createTParticles(int);
+void freeTParticles(tparticles_t*);
+tparticles_t sliceTParticles(const tparticles_t*, int, int);
+void updateParticle(tparticles_t*, int, float*, float*, float*, float*, int,
+                    float);
+void updateParticles(tparticles_t*, int, int, const field_t*, float);
+void addAcceleration(float, float, float, const float*, const float*,
+                     const float*, const float*, int, float*);
+void fieldAcceleration(const field_t*, float, float, float, float*);
+double fieldPotential(const field_t*, float, float, float);
+void computeAcceleration(const tparticles_t*, int, const float*,
+                         const float*, const float*, const float*, int,
+                         float*);
+void integrateParticle(tparticles_t*, int, const float*, float);
+
+int selectKernel(const char*, int, int);
+const char* kernelName(void);
+int kernelFast(void);
+int parsePrecision(const char*);
+const char* precisionName(void);
+void selectIntegrator(int, float);
+int parseIntegrator(const char*);
+const char* integratorName(void);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "profile.h"
+#include "timer.h"
+
+// most phases of a run
+#define MAX_PHASES 32
+// most intervals kept for the trace, so long runs do not run out of memory
+#define MAX_INTERVALS (1 << 20)
+
+/*
+ * A named part of the run, such as the setup or a time step, and the
+ * statistics of the intervals spent in it.
+ */
+struct phase {
+    profile_t* profile;
+    const char* name;
+    int device;         // whether the intervals were measured by the device
+    long count;
+    double total;
+    double max;
+};
+
+/*
+ * One interval of a phase, in seconds since the profile was created.
+ */
+typedef struct {
+    const phase_t* phase;
+    double begin;
+    double end;
+} interval_t;
+
+struct profile {
+    phase_t phases[MAX_PHASES];
+    int numPhases;
+    int summary;            // whether to print the statistics of the phases
+    double start;           // wallTime() when the profile was created
+
+    // device timestamps plus offset give the time on the host clock
+    double deviceOffset;
+    int hasOffset;
+
+    // the intervals for the trace, if there is a trace file
+    const char* traceFile;
+    interval_t* intervals;
+    long numIntervals;
+    long capacity;
+    long dropped;
+
+    // device intervals may be added from another thread
+    pthread_mutex_t lock;
+};
+
+/*
+ * Creates a profile which prints the statistics of each phase if summary is
+ * set and writes all intervals as a Chrome trace (chrome://tracing) to
+ * traceFile if it is not NULL.
+ * Returns NULL if there is nothing to do, in which case the other functions
+ * do nothing either.
+ */
+profile_t* profileCreate(int summary, const char* traceFile)
+{
+    if (!summary && traceFile == NULL) {
+        return NULL;
+    }
+    profile_t* p = (profile_t*)calloc(1, sizeof(profile_t));
+    if (p == NULL) {
+        fprintf(stderr, "Error allocating memory for profile\n");
+        exit(-1);
+    }
+    p->summary = summary;
+    p->traceFile = traceFile;
+    p->start = wallTime();
+    pthread_mutex_init(&p->lock, NULL);
+    return p;
+}
+
+/*
+ * Returns the phase with the given name, creating it if it does not exist
+ * yet. name must stay valid until the profile is reported.
+ */
+phase_t* profilePhase(profile_t* p, const char* name)
+{
+    if (p == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < p->numPhases; i++) {
+        if (strcmp(p->phases[i].name, name) == 0) {
+            return &p->phases[i];
+        }
+    }
+    if (p->numPhases == MAX_PHASES) {
+        fprintf(stderr, "Too many phases to profile\n");
+        exit(-1);
+    }
+    phase_t* phase = &p->phases[p->numPhases++];
+    phase->profile = p;
+    phase->name = name;
+    return phase;
+}
+
+/*
+ * Returns the current time for the start of an interval of phase, or 0
+ * without reading the clock if phase is NULL.
+ */
+double profileTime(const phase_t* phase)
+{
+    return phase != NULL ? wallTime() : 0.0;
+}
+
+/*
+ * Records an interval of phase from begin to end, in wallTime() seconds.
+ * The caller holds the lock.
+ */
+static void addInterval(phase_t* phase, double begin, double end)
+{
+    profile_t* p = phase->profile;
+    double length = end - begin;
+    phase->count++;
+    phase->total += length;
+    if (length > phase->max) {
+        phase->max = length;
+    }
+
+    if (p->traceFile == NULL) {
+        return;
+    }
+    if (p->numIntervals == p->capacity) {
+        long capacity = p->capacity > 0 ? 2*p->capacity : 1024;
+        interval_t* intervals = NULL;
+        if (capacity <= MAX_INTERVALS) {
+            intervals = (interval_t*)realloc(p->intervals,
+                                             capacity*sizeof(interval_t));
+        }
+        if (intervals == NULL) {
+            p->dropped++;
+            return;
+        }
+        p->intervals = intervals;
+        p->capacity = capacity;
+    }
+    interval_t* interval = &p->intervals[p->numIntervals++];
+    interval->phase = phase;
+    interval->begin = begin - p->start;
+    interval->end = end - p->start;
+}
+
+/*
+ * Records an interval of phase from begin (see profileTime()) until now.
+ */
+void profileEnd(phase_t* phase, double begin)
+{
+    if (phase == NULL) {
+        return;
+    }
+    double end = wallTime();
+    pthread_mutex_lock(&phase->profile->lock);
+    addInterval(phase, begin, end);
+    pthread_mutex_unlock(&phase->profile->lock);
+}
+
+/*
+ * Records an interval of phase measured by the device, from start to end in
+ * nanoseconds of the device clock. The device clock is matched to the host
+ * clock when the first device interval is added, assuming it has just
+ * ended, so device intervals are only roughly aligned with host intervals.
+ */
+void profileAddDevice(phase_t* phase, uint64_t start, uint64_t end)
+{
+    if (phase == NULL) {
+        return;
+    }
+    profile_t* p = phase->profile;
+    pthread_mutex_lock(&p->lock);
+    if (!p->hasOffset) {
+        p->deviceOffset = wallTime() - end*1e-9;
+        p->hasOffset = 1;
+    }
+    phase->device = 1;
+    addInterval(phase, start*1e-9 + p->deviceOffset,
+                end*1e-9 + p->deviceOffset);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Writes the intervals as a Chrome trace, with the host and the device as
+ * separate threads.
+ */
+static void writeTrace(const profile_t* p)
+{
+    FILE* fp = fopen(p->traceFile, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening %s\n", p->traceFile);
+        return;
+    }
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            "\"tid\": 0, \"args\": {\"name\": \"host\"}},\n");
+    fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            "\"tid\": 1, \"args\": {\"name\": \"device\"}}");
+    for (long i = 0; i < p->numIntervals; i++) {
+        const interval_t* interval = &p->intervals[i];
+        fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, "
+                "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                interval->phase->name, interval->phase->device,
+                interval->begin*1e6,
+                (interval->end - interval->begin)*1e6);
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing %s\n", p->traceFile);
+    }
+}
+
+/*
+ * Prints the number of intervals, total, mean and longest time of each
+ * phase and its share of the run, writes the trace and frees the profile.
+ * Device phases overlap with the host phases which wait for them.
+ */
+void profileReport(profile_t* p, FILE* out)
+{
+    if (p == NULL) {
+        return;
+    }
+    double run = wallTime() - p->start;
+    if (p->summary) {
+        fprintf(out, "%-10s %-6s %10s %12s %12s %12s %7s\n", "phase", "where",
+                "count", "total (s)", "mean (ms)", "max (ms)", "share");
+        for (int i = 0; i < p->numPhases; i++) {
+            const phase_t* phase = &p->phases[i];
+            fprintf(out, "%-10s %-6s %10ld %12.6f %12.6f %12.6f %6.1f%%\n",
+                    phase->name, phase->device ? "device" : "host",
+                    phase->count, phase->total,
+                    phase->count > 0 ? phase->total / phase->count*1e3 : 0.0,
+                    phase->max*1e3, run > 0.0 ? phase->total / run*100 : 0.0);
+        }
+    }
+    if (p->traceFile != NULL) {
+        writeTrace(p);
+        if (p->dropped > 0) {
+            fprintf(stderr, "The trace is missing the last %ld intervals\n",
+                    p->dropped);
+        }
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->intervals);
+    free(p);
+}
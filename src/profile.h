@@ -0,0 +1,17 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct profile profile_t;
+typedef struct phase phase_t;
+
+profile_t* profileCreate(int, const char*);
+phase_t* profilePhase(profile_t*, const char*);
+double profileTime(const phase_t*);
+void profileEnd(phase_t*, double);
+void profileAddDevice(phase_t*, uint64_t, uint64_t);
+void profileReport(profile_t*, FILE*);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "trajectory.h"
+#include "mapfile.h"
+
+/*
+ * Header of a trajectory file. It is followed by one record per snapshot,
+ * consisting of the iteration (uint64_t) and the arrays x, y, z, vx, vy, vz
+ * of the recorded test particles.
+ */
+typedef struct {
+    char magic[4];          // "PNBT"
+    uint32_t version;       // TRAJECTORY_VERSION
+    uint32_t first;         // index of the first recorded test particle
+    uint32_t count;         // number of recorded test particles
+    uint32_t stride;        // iterations between snapshots
+    uint32_t reserved;
+} trajectory_header_t;
+
+/*
+ * Snapshots are written by a background thread. There are two buffers, so
+ * the next snapshot can be filled while the previous one is being written.
+ */
+struct trajectory {
+    FILE* fp;
+    int first;
+    int count;
+    int stride;
+
+    float* buffers[2];
+    uint64_t iterations[2];
+    int full[2];
+    int next;           // buffer to be filled next
+    int error;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int closing;
+};
+
+static void* writerMain(void* arg)
+{
+    trajectory_t* tr = (trajectory_t*)arg;
+    size_t size = 6*(size_t)tr->count;
+    int current = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&tr->lock);
+        while (!tr->full[current] && !tr->closing) {
+            pthread_cond_wait(&tr->changed, &tr->lock);
+        }
+        if (!tr->full[current]) {
+            pthread_mutex_unlock(&tr->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&tr->lock);
+
+        // the buffer is not touched by the simulation until it is released
+        int err = fwrite(&tr->iterations[current], sizeof(uint64_t), 1,
+                         tr->fp) != 1;
+        err |= fwrite(tr->buffers[current], sizeof(float), size,
+                      tr->fp) != size;
+
+        pthread_mutex_lock(&tr->lock);
+        tr->error |= err;
+        tr->full[current] = 0;
+        pthread_cond_broadcast(&tr->changed);
+        pthread_mutex_unlock(&tr->lock);
+
+        current = 1 - current;
+    }
+}
+
+/*
+ * Keeps the snapshots of an existing trajectory file which were taken
+ * before iteration start, so a resumed run can append to it. The snapshots
+ * are copied to a temporary file which then replaces the original, so the
+ * file is never left half rewritten. Returns 0 if there is no such file,
+ * 1 if the snapshots were kept, or -1 if the file records a different
+ * subset or stride and must not be overwritten.
+ */
+static int keepSnapshots(const char* filename,
+                         const trajectory_header_t* expected, int start)
+{
+    FILE* in = fopen(filename, "rb");
+    if (in == NULL) {
+        return 0;
+    }
+    trajectory_header_t header;
+    if (fread(&header, sizeof(header), 1, in) != 1
+            || memcmp(&header, expected, sizeof(header)) != 0) {
+        fclose(in);
+        return -1;
+    }
+
+    char* tmpPath = (char*)malloc(strlen(filename) + 5);
+    sprintf(tmpPath, "%s.tmp", filename);
+    FILE* out = fopen(tmpPath, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening trajectory file: %s\n", tmpPath);
+        exit(-1);
+    }
+    int err = fwrite(&header, sizeof(header), 1, out) != 1;
+
+    size_t size = 6*(size_t)header.count;
+    float* snapshot = (float*)malloc(size*sizeof(float));
+    uint64_t recorded;
+    while (fread(&recorded, sizeof(uint64_t), 1, in) == 1
+            && fread(snapshot, sizeof(float), size, in) == size
+            && recorded < (uint64_t)start) {
+        err |= fwrite(&recorded, sizeof(uint64_t), 1, out) != 1;
+        err |= fwrite(snapshot, sizeof(float), size, out) != size;
+    }
+    free(snapshot);
+    fclose(in);
+    err |= fclose(out);
+
+    if (err != 0 || replaceFile(tmpPath, filename) != 0) {
+        fprintf(stderr, "Error writing trajectory file: %s\n", filename);
+        remove(tmpPath);
+        exit(-1);
+    }
+    free(tmpPath);
+    return 1;
+}
+
+/*
+ * Creates a trajectory file which records count test particles starting at
+ * index first, every stride iterations. A run resumed after iteration
+ * start > 0 appends to an existing file with the same subset and stride,
+ * dropping the snapshots from start on, since they are taken again; a file
+ * which records something else is refused instead of being overwritten.
+ */
+trajectory_t* trajectoryOpen(const char* filename, int numTParticles,
+                             int stride, int first, int count, int start)
+{
+    if (first < 0 || count < 1 || first + count > numTParticles
+            || stride < 1) {
+        fprintf(stderr, "Invalid trajectory subset or stride\n");
+        exit(-1);
+    }
+
+    trajectory_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PNBT", 4);
+    header.version = TRAJECTORY_VERSION;
+    header.first = first;
+    header.count = count;
+    header.stride = stride;
+
+    int kept = 0;
+    if (start > 0) {
+        kept = keepSnapshots(filename, &header, start);
+        if (kept < 0) {
+            fprintf(stderr, "%s records a different subset or stride, "
+                    "refusing to overwrite it\n", filename);
+            exit(-1);
+        }
+    }
+
+    trajectory_t* tr = (trajectory_t*)calloc(1, sizeof(trajectory_t));
+    tr->fp = fopen(filename, kept ? "ab" : "wb");
+    if (tr->fp == NULL) {
+        fprintf(stderr, "Error opening trajectory file: %s\n", filename);
+        exit(-1);
+    }
+    tr->first = first;
+    tr->count = count;
+    tr->stride = stride;
+    for (int i = 0; i < 2; i++) {
+        tr->buffers[i] = (float*)malloc(6*(size_t)count*sizeof(float));
+        if (tr->buffers[i] == NULL) {
+            fprintf(stderr, "Error allocating memory for trajectory\n");
+            exit(-1);
+        }
+    }
+
+    if (!kept) {
+        fwrite(&header, sizeof(header), 1, tr->fp);
+    }
+
+    pthread_mutex_init(&tr->lock, NULL);
+    pthread_cond_init(&tr->changed, NULL);
+    if (pthread_create(&tr->writer, NULL, writerMain, tr) != 0) {
+        fprintf(stderr, "Error creating trajectory thread\n");
+        exit(-1);
+    }
+    return tr;
+}
+
+/*
+ * Returns 1 if a snapshot should be taken after the given iteration.
+ */
+int trajectoryDue(const trajectory_t* tr, int iteration)
+{
+    return iteration % tr->stride == 0;
+}
+
+/*
+ * Returns a buffer to store the next snapshot in, waiting for the writer if
+ * it is still busy with the snapshot which used the buffer before.
+ * The buffer holds the arrays x, y, z, vx, vy, vz of trajectoryCount()
+ * test particles, one after the other.
+ */
+float* trajectoryBegin(trajectory_t* tr)
+{
+    pthread_mutex_lock(&tr->lock);
+    while (tr->full[tr->next]) {
+        pthread_cond_wait(&tr->changed, &tr->lock);
+    }
+    pthread_mutex_unlock(&tr->lock);
+    return tr->buffers[tr->next];
+}
+
+/*
+ * Hands the buffer returned by trajectoryBegin() to the writer.
+ */
+void trajectoryCommit(trajectory_t* tr, int iteration)
+{
+    pthread_mutex_lock(&tr->lock);
+    tr->iterations[tr->next] = iteration;
+    tr->full[tr->next] = 1;
+    tr->next = 1 - tr->next;
+    pthread_cond_broadcast(&tr->changed);
+    pthread_mutex_unlock(&tr->lock);
+}
+
+int trajectoryFirst(const trajectory_t* tr)
+{
+    return tr->first;
+}
+
+int trajectoryCount(const trajectory_t* tr)
+{
+    return tr->count;
+}
+
+/*
+ * Waits for the remaining snapshots to be written and closes the file.
+ */
+void trajectoryClose(trajectory_t* tr)
+{
+    pthread_mutex_lock(&tr->lock);
+    tr->closing = 1;
+    pthread_cond_broadcast(&tr->changed);
+    pthread_mutex_unlock(&tr->lock);
+    pthread_join(tr->writer, NULL);
+
+    int err = tr->error;
+    err |= fclose(tr->fp);
+    if (err != 0) {
+        fprintf(stderr, "Error writing trajectory file\n");
+    }
+    pthread_mutex_destroy(&tr->lock);
+    pthread_cond_destroy(&tr->changed);
+    free(tr->buffers[0]);
+    free(tr->buffers[1]);
+    free(tr);
+}
+
+/*
+ * Reads the snapshot taken after the given iteration from a trajectory
+ * file into snapshot, which must hold 6*count floats. Returns 0 on
+ * success, or -1 if the file cannot be read, records a different number of
+ * test particles than count or has no such snapshot.
+ */
+int trajectoryRead(const char* filename, int iteration, int count,
+                   float* snapshot)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    trajectory_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, "PNBT", 4) != 0
+            || header.version != TRAJECTORY_VERSION
+            || header.count != (uint32_t)count) {
+        fclose(fp);
+        return -1;
+    }
+
+    size_t size = 6*(size_t)count;
+    uint64_t recorded;
+    while (fread(&recorded, sizeof(uint64_t), 1, fp) == 1) {
+        if (fread(snapshot, sizeof(float), size, fp) != size) {
+            break;
+        }
+        if (recorded == (uint64_t)iteration) {
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+    return -1;
+}
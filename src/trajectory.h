@@ -0,0 +1,18 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+// increment whenever the layout of a trajectory file changes
+#define TRAJECTORY_VERSION 1
+
+typedef struct trajectory trajectory_t;
+
+trajectory_t* trajectoryOpen(const char*, int, int, int, int, int);
+int trajectoryDue(const trajectory_t*, int);
+float* trajectoryBegin(trajectory_t*);
+void trajectoryCommit(trajectory_t*, int);
+int trajectoryFirst(const trajectory_t*);
+int trajectoryCount(const trajectory_t*);
+void trajectoryClose(trajectory_t*);
+int trajectoryRead(const char*, int, int, float*);
+
+#endif